@@ -45,62 +45,33 @@
 #include <string.h>
 
 #include "keys2.h"
+#include "VocabKeyLoader.h"
 #include "VocabTree.h"
 
-unsigned char *ReadAndFilterKeys(const char *keyfile, int dim, 
-                                 double min_feature_scale, 
-                                 int max_keys, int &num_keys_out)
-{
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    if (num_keys == 0) {
-        num_keys_out = 0;
-        return NULL;
-    }
-    
-    /* Filter keys */
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    int num_keys_filtered = 0;
-    if (min_feature_scale == 0.0 && max_keys == 0) {
-        for (int j = 0; j < num_keys * dim; j++) {
-            keys_char[j] = (unsigned char) keys[j];
-        }
-        num_keys_filtered = num_keys;
-    } else {
-        for (int j = 0; j < num_keys; j++) {
-            if (info[j].scale < min_feature_scale)
-                continue;
-            
-            for (int k = 0; k < dim; k++) {
-                keys_char[num_keys_filtered * dim + k] = 
-                    (unsigned char) keys[j * dim + k];
-            }
-            
-            num_keys_filtered++;
-
-            if (max_keys > 0 && num_keys_filtered >= max_keys)
-                break;
-        }
-    }
-
-    delete [] keys;
+#include "defines.h"
 
-    if (info != NULL) 
-        delete [] info;
+struct add_image_data_t {
+    VocabTree *tree;
+    int start_id;
+};
 
-    num_keys_out = num_keys_filtered;
+/* Add a loaded key file to the database */
+static void add_image(int index, int slot, KeyBuffer &keys, void *data)
+{
+    add_image_data_t *add = (add_image_data_t *) data;
 
-    return keys_char;
+    printf("[VocabBuildDB] Adding vector %d (%d keys)\n", 
+           add->start_id + index, keys.m_num_keys);
+    add->tree->AddImageToDatabase(add->start_id + index, keys.m_num_keys, 
+                                  keys.m_keys);
 }
 
 int main(int argc, char **argv) 
 {
-    if (argc < 4 || argc > 8) {
+    if (argc < 4 || argc > 10) {
         printf("Usage: %s <list.in> <tree.in> <db.out> [use_tfidf:1] "
-               "[normalize:1] [start_id:0] [distance_type:1]\n",
+               "[normalize:1] [start_id:0] [distance_type:1] "
+               "[num_threads:2] [prefetch:0]\n",
                argv[0]);
 
         return 1;
@@ -116,6 +87,10 @@ int main(int argc, char **argv)
     DistanceType distance_type = DistanceMin;
     int start_id = 0;
 
+    /* By default one thread loads key files while another adds them */
+    VocabLoadOptions load;
+    load.num_threads = 2;
+
     if (argc >= 5)
         use_tfidf = atoi(argv[4]);
 
@@ -128,6 +103,12 @@ int main(int argc, char **argv)
     if (argc >= 8)
         distance_type = (DistanceType) atoi(argv[7]);
 
+    if (argc >= 9)
+        load.num_threads = MAX(1, atoi(argv[8]));
+
+    if (argc >= 10)
+        load.prefetch = MAX(0, atoi(argv[9]));
+
     switch (distance_type) {
     case DistanceDot:
         printf("[VocabMatch] Using distance Dot\n");
@@ -164,7 +145,9 @@ int main(int argc, char **argv)
     tree.Read(tree_in);
 
 #if 1
-    tree.Flatten();
+    /* Cache the search structure for the flattened tree next to
+     * the tree file */
+    tree.Flatten((std::string(tree_in) + ".ann").c_str());
 #endif
 
     tree.m_distance_type = distance_type;
@@ -173,25 +156,20 @@ int main(int argc, char **argv)
     /* Initialize leaf weights to 1.0 */
     tree.SetConstantLeafWeights();
 
-    const int dim = 128;
     int num_db_images = (int) key_files.size();
     unsigned long count = 0;
 
     tree.ClearDatabase();
 
-    for (int i = 0; i < num_db_images; i++) {
-        int num_keys = 0;
-        unsigned char *keys = ReadAndFilterKeys(key_files[i].c_str(), 
-                                                dim, min_feature_scale,
-                                                0, num_keys);
+    /* Images are added in list order while the next key files are
+     * loaded */
+    load.min_feature_scale = min_feature_scale;
 
-        printf("[VocabBuildDB] Adding vector %d (%d keys)\n", 
-               start_id + i, num_keys);
-        tree.AddImageToDatabase(start_id + i, num_keys, keys);
+    add_image_data_t add;
+    add.tree = &tree;
+    add.start_id = start_id;
 
-        if (num_keys > 0) 
-            delete [] keys;
-    }
+    LoadKeyFiles(key_files, load, NULL, add_image, &add);
 
     printf("[VocabBuildDB] Pushed %lu features\n", count);
     fflush(stdout);
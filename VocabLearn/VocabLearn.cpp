@@ -39,20 +39,61 @@
 
 #include <string>
 #include <vector>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 
-#include "VocabTree.h"
-#include "keys2.h"
-#include "defines.h"
+#include <omp.h>
 
-#define MAX_ARRAY_SIZE 8388608 // 2 ** 23
+#include "VocabTree.h"
+#include "VocabTreeCheckpoint.h"
+#include "VocabTrainingSet.h"
 
 int main(int argc, char **argv) 
 {
-    if (argc != 6) {
-        printf("Usage: %s <list.in> <depth> <branching_factor> "
-               "<restarts> <tree.out>\n", argv[0]);
+    /* Pull out the flags, which may appear anywhere */
+    bool checkpoint = false, resume = false;
+    KMeansOptions options;
+    int num_args = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--checkpoint") == 0)
+            checkpoint = true;
+        else if (strcmp(argv[i], "--resume") == 0)
+            resume = true;
+        else if (strncmp(argv[i], "--trees=", 8) == 0)
+            options.forest_trees = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--checks=", 9) == 0)
+            options.max_pts_visit = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--index_drift=", 14) == 0)
+            options.index_drift = atof(argv[i] + 14);
+        else
+            argv[num_args++] = argv[i];
+    }
+
+    argc = num_args;
+
+    if (argc < 6 || argc > 11) {
+        printf("Usage: %s [--checkpoint] [--resume] [--trees=4] "
+               "[--checks=512] [--index_drift=0] <list.in|train.in> "
+               "<depth> <branching_factor> "
+               "<restarts> <tree.out> [init:0] [batch_size:0] "
+               "[batch_iterations:100] [assign:0] "
+               "[parallel_restarts:0]\n", argv[0]);
+        printf("  --checkpoint: save progress to <tree.out>.ckpt\n");
+        printf("  --resume: resume the build saved in <tree.out>.ckpt\n");
+        printf("  --trees: number of trees in the kd-forest (assign 2)\n");
+        printf("  --checks: points checked per kd-tree or kd-forest "
+               "search\n");
+        printf("  --index_drift: rebuild the kd-tree or kd-forest only "
+               "once a mean has moved this far\n");
+        printf("  init: 0 -- random initial means, 1 -- k-means++\n");
+        printf("  batch_size: if > 0, use mini-batch kmeans with "
+               "batches of this size\n");
+        printf("  assign: 0 -- assign keys to their closest means with "
+               "a kd-tree, 1 -- exactly, 2 -- with a randomized "
+               "kd-forest\n");
+        printf("  parallel_restarts: 1 -- run restarts concurrently, "
+               "abandoning clearly worse ones early\n");
         return 1;
     }
 
@@ -62,36 +103,62 @@ int main(int argc, char **argv)
     int restarts = atoi(argv[4]);
     const char *tree_out = argv[5];
 
+    if (argc >= 7)
+        options.init = (KMeansInit) atoi(argv[6]);
+    if (argc >= 8)
+        options.batch_size = atoi(argv[7]);
+    if (argc >= 9)
+        options.batch_iterations = atoi(argv[8]);
+    if (argc >= 10)
+        options.assign = (KMeansAssign) atoi(argv[9]);
+    if (argc >= 11 && atoi(argv[10]) != 0)
+        options.parallel_restarts = true;
+
     printf("Building tree with depth: %d, branching factor: %d, "
            "and restarts: %d\n", depth, bf, restarts);
 
-    FILE *f = fopen(list_in, "r");
-    if (f == NULL) {
-      printf("Could not open file: %s\n", list_in);
-      return 1;
-    }
-    
-    std::vector<std::string> key_files;
-    char buf[256];
-    while (fgets(buf, 256, f)) {
-        /* Remove trailing newline */
-        if (buf[strlen(buf) - 1] == '\n')
-            buf[strlen(buf) - 1] = 0;
-
-        key_files.push_back(std::string(buf));
-    }
+    VocabTrainingSet keys;
+    if (IsTrainingFile(list_in)) {
+        printf("Mapping training file %s\n", list_in);
+        if (keys.Map(list_in) != 0)
+            return 1;
+    } else {
+        FILE *f = fopen(list_in, "r");
+        if (f == NULL) {
+          printf("Could not open file: %s\n", list_in);
+          return 1;
+        }
 
-    fclose(f);
-    
-    int num_files = (int) key_files.size();
-    unsigned long total_keys = 0;
-    for (int i = 0; i < num_files; i++) {
-        int num_keys = GetNumberOfKeys(key_files[i].c_str());
-        total_keys += num_keys;
+        std::vector<std::string> key_files;
+        char buf[256];
+        while (fgets(buf, 256, f)) {
+            /* Remove trailing newline */
+            if (buf[strlen(buf) - 1] == '\n')
+                buf[strlen(buf) - 1] = 0;
+
+            key_files.push_back(std::string(buf));
+        }
+
+        fclose(f);
+
+        /* Load (and inflate) the key files concurrently */
+        VocabSampleOptions sample;
+        sample.num_threads = omp_get_max_threads();
+
+        if (keys.ReadKeyFiles(key_files, sample) != 0)
+            return 1;
     }
 
+    unsigned long total_keys = keys.m_num;
     printf("Total number of keys: %lu\n", total_keys);
 
+    /* Keys are indexed with 32-bit ints while building the tree */
+    if (total_keys > (unsigned long) INT_MAX) {
+        printf("Error: too many keys (at most %d are supported)\n",
+               INT_MAX);
+        return 1;
+    }
+
     // Reduce the branching factor if need be if there are not
     // enough keys, to avoid problems later.
     if (bf >= (int)total_keys){
@@ -101,72 +168,39 @@ int main(int argc, char **argv)
     
     fflush(stdout);
 
-    int dim = 128;
-    unsigned long long len = (unsigned long long) total_keys * dim;
-
-    int num_arrays = 
-        len / MAX_ARRAY_SIZE + ((len % MAX_ARRAY_SIZE) == 0 ? 0 : 1);
-
-    unsigned char **vs = new unsigned char *[num_arrays];
-
-    printf("Allocating %llu bytes in total, in %d arrays\n", len, num_arrays);
-
-    unsigned long long total = 0;
-    for (int i = 0; i < num_arrays; i++) {
-        unsigned long long remainder = len - total;
-        unsigned long len_curr = MIN(remainder, MAX_ARRAY_SIZE);
-
-        printf("Allocating array of size %lu\n", len_curr);
-        fflush(stdout);
-        vs[i] = new unsigned char[len_curr];
+    /* Subtrees two levels down are saved as they are finished (one
+     * level down for trees of depth 1) */
+    VocabTreeCheckpoint ckpt;
+    std::string ckpt_file = std::string(tree_out) + ".ckpt";
+    if (resume) {
+        printf("Resuming from checkpoint %s\n", ckpt_file.c_str());
+        if (ckpt.Resume(ckpt_file.c_str()) != 0)
+            return 1;
+    } else if (checkpoint) {
+        printf("Saving checkpoints to %s\n", ckpt_file.c_str());
+        if (ckpt.Create(ckpt_file.c_str(), depth > 1 ? 2 : 1) != 0)
+            return 1;
+    }
 
-        remainder -= len_curr;
+    VocabTree tree;
+    kmeans_stats_t stats;
+    if (tree.Build((int) total_keys, keys.m_dim, depth, bf, restarts, 
+                   keys.m_data, options, &stats, 
+                   (resume || checkpoint) ? &ckpt : NULL) != 0) {
+        return 1;
     }
 
-    /* Create the array of pointers */
-    printf("Allocating pointer array of size %lu\n", 4 * total_keys);
-    fflush(stdout);
+    if (tree.Write(tree_out) != 0)
+        return 1;
 
-    unsigned char **vp = new unsigned char *[total_keys];
-    
-    unsigned long off = 0;
-    unsigned long curr_key = 0;
-    int curr_array = 0;
-    for (int i = 0; i < num_files; i++) {
-        printf("  Reading keyfile %s\n", key_files[i].c_str());
-        fflush(stdout);
-
-        short int *keys;
-        int num_keys = 0;
-
-        keypt_t *info = NULL;
-        num_keys = ReadKeyFile(key_files[i].c_str(), &keys);
-
-        if (num_keys > 0) {
-            for (int j = 0; j < num_keys; j++) {
-                for (int k = 0; k < dim; k++) {
-                    vs[curr_array][off + k] = keys[j * dim + k];
-                }
-                
-                vp[curr_key] = vs[curr_array] + off;
-                curr_key++;
-                off += dim;
-                if (off == MAX_ARRAY_SIZE) {
-                    off = 0;
-                    curr_array++;
-                }
-            }
-
-            delete [] keys;
-
-            if (info != NULL)
-                delete [] info;
-        }
+    /* The tree is safely written, so the checkpoint is not needed */
+    if (resume || checkpoint) {
+        ckpt.Close();
+        remove(ckpt_file.c_str());
     }
 
-    VocabTree tree;
-    tree.Build(total_keys, dim, depth, bf, restarts, vp);
-    tree.Write(tree_out);
+    printf("Ran %ld Lloyd rounds and %ld mini-batch iterations in total\n",
+           stats.rounds, stats.batches);
 
     return 0;
 }
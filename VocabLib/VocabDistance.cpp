@@ -0,0 +1,386 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+/* VocabDistance.cpp */
+/* SIMD kernels for squared distances between byte descriptors, with
+ * a runtime choice of the instruction set */
+
+#include "VocabDistance.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VOCAB_DISTANCE_X86
+/* Some versions of gcc warn about the AVX-512 headers themselves */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+unsigned long vec_diff_normsq_scalar(int dim, 
+                                     const unsigned char *a, 
+                                     const unsigned char *b)
+{
+    unsigned long normsq = 0;
+
+    for (int i = 0; i < dim; i++) {
+        int d = (int) a[i] - (int) b[i];
+        normsq += d * d;
+    }
+
+    return normsq;
+}
+
+void vec_diff_normsq_batch_scalar(int dim, const unsigned char *q, 
+                                  int n, const unsigned char * const *c,
+                                  unsigned long *dists)
+{
+    for (int j = 0; j < n; j++) 
+        dists[j] = vec_diff_normsq_scalar(dim, q, c[j]);
+}
+
+#ifdef VOCAB_DISTANCE_X86
+
+/* The kernels accumulate in unsigned 32-bit lanes, which cannot
+ * overflow for dim <= 65536 (65536 * 255^2 < 2^32).  Longer vectors
+ * use the scalar code */
+#define MAX_SIMD_DIM 65536
+
+/* Sum of squared differences over the elements [start, dim) */
+static inline unsigned long vec_diff_normsq_tail(int start, int dim, 
+                                                 const unsigned char *a,
+                                                 const unsigned char *b)
+{
+    unsigned long normsq = 0;
+
+    for (int i = start; i < dim; i++) {
+        int d = (int) a[i] - (int) b[i];
+        normsq += d * d;
+    }
+
+    return normsq;
+}
+
+/* SSE2: |a - b| via saturated subtraction, widened to 16 bits and
+ * squared with madd, 16 bytes at a time */
+static inline __m128i sq_diff_sse2(__m128i a, __m128i b, __m128i acc)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    __m128i lo = _mm_unpacklo_epi8(d, zero);
+    __m128i hi = _mm_unpackhi_epi8(d, zero);
+
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+    return _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+}
+
+static inline unsigned long hsum_sse2(__m128i acc)
+{
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1,0,3,2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2,3,0,1)));
+    return (unsigned int) _mm_cvtsi128_si32(acc);
+}
+
+static unsigned long vec_diff_normsq_sse2(int dim, 
+                                          const unsigned char *a, 
+                                          const unsigned char *b)
+{
+    if (dim > MAX_SIMD_DIM)
+        return vec_diff_normsq_scalar(dim, a, b);
+
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= dim; i += 16) {
+        acc = sq_diff_sse2(_mm_loadu_si128((const __m128i *) (a + i)),
+                           _mm_loadu_si128((const __m128i *) (b + i)), acc);
+    }
+
+    return hsum_sse2(acc) + vec_diff_normsq_tail(i, dim, a, b);
+}
+
+static void vec_diff_normsq_batch_sse2(int dim, const unsigned char *q, 
+                                       int n, const unsigned char * const *c,
+                                       unsigned long *dists)
+{
+    if (dim > MAX_SIMD_DIM) {
+        vec_diff_normsq_batch_scalar(dim, q, n, c, dists);
+        return;
+    }
+
+    int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+        int i = 0;
+
+        for (; i + 16 <= dim; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (q + i));
+            acc0 = sq_diff_sse2(x, 
+                       _mm_loadu_si128((const __m128i *) (c[j] + i)), acc0);
+            acc1 = sq_diff_sse2(x, 
+                       _mm_loadu_si128((const __m128i *) (c[j+1] + i)), acc1);
+        }
+
+        dists[j] = hsum_sse2(acc0) + vec_diff_normsq_tail(i, dim, q, c[j]);
+        dists[j+1] = 
+            hsum_sse2(acc1) + vec_diff_normsq_tail(i, dim, q, c[j+1]);
+    }
+
+    for (; j < n; j++)
+        dists[j] = vec_diff_normsq_sse2(dim, q, c[j]);
+}
+
+/* AVX2: the same, 32 bytes at a time */
+__attribute__((target("avx2")))
+static inline __m256i sq_diff_avx2(__m256i a, __m256i b, __m256i acc)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i d = 
+        _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+    __m256i lo = _mm256_unpacklo_epi8(d, zero);
+    __m256i hi = _mm256_unpackhi_epi8(d, zero);
+
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned long hsum_avx2(__m256i acc)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+                              _mm256_extracti128_si256(acc, 1));
+    return hsum_sse2(s);
+}
+
+__attribute__((target("avx2")))
+static unsigned long vec_diff_normsq_avx2(int dim, 
+                                          const unsigned char *a, 
+                                          const unsigned char *b)
+{
+    if (dim > MAX_SIMD_DIM)
+        return vec_diff_normsq_scalar(dim, a, b);
+
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 32 <= dim; i += 32) {
+        acc = sq_diff_avx2(_mm256_loadu_si256((const __m256i *) (a + i)),
+                           _mm256_loadu_si256((const __m256i *) (b + i)), 
+                           acc);
+    }
+
+    return hsum_avx2(acc) + vec_diff_normsq_tail(i, dim, a, b);
+}
+
+__attribute__((target("avx2")))
+static void vec_diff_normsq_batch_avx2(int dim, const unsigned char *q, 
+                                       int n, const unsigned char * const *c,
+                                       unsigned long *dists)
+{
+    if (dim > MAX_SIMD_DIM) {
+        vec_diff_normsq_batch_scalar(dim, q, n, c, dists);
+        return;
+    }
+
+    int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        int i = 0;
+
+        for (; i + 32 <= dim; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *) (q + i));
+            acc0 = sq_diff_avx2(x, 
+                       _mm256_loadu_si256((const __m256i *) (c[j] + i)), 
+                       acc0);
+            acc1 = sq_diff_avx2(x, 
+                       _mm256_loadu_si256((const __m256i *) (c[j+1] + i)), 
+                       acc1);
+        }
+
+        dists[j] = hsum_avx2(acc0) + vec_diff_normsq_tail(i, dim, q, c[j]);
+        dists[j+1] = 
+            hsum_avx2(acc1) + vec_diff_normsq_tail(i, dim, q, c[j+1]);
+    }
+
+    for (; j < n; j++)
+        dists[j] = vec_diff_normsq_avx2(dim, q, c[j]);
+}
+
+/* AVX-512BW: the same, 64 bytes at a time */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i sq_diff_avx512(__m512i a, __m512i b, __m512i acc)
+{
+    __m512i zero = _mm512_setzero_si512();
+    __m512i d = 
+        _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+    __m512i lo = _mm512_unpacklo_epi8(d, zero);
+    __m512i hi = _mm512_unpackhi_epi8(d, zero);
+
+    acc = _mm512_add_epi32(acc, _mm512_madd_epi16(lo, lo));
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(hi, hi));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline unsigned long hsum_avx512(__m512i acc)
+{
+    /* Fold the four 128-bit blocks together */
+    acc = _mm512_add_epi32(acc, _mm512_shuffle_i64x2(acc, acc, 0x4e));
+    acc = _mm512_add_epi32(acc, _mm512_shuffle_i64x2(acc, acc, 0xb1));
+    return hsum_sse2(_mm512_castsi512_si128(acc));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned long vec_diff_normsq_avx512(int dim, 
+                                            const unsigned char *a, 
+                                            const unsigned char *b)
+{
+    if (dim > MAX_SIMD_DIM)
+        return vec_diff_normsq_scalar(dim, a, b);
+
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+
+    for (; i + 64 <= dim; i += 64) {
+        acc = sq_diff_avx512(_mm512_loadu_si512((const void *) (a + i)),
+                             _mm512_loadu_si512((const void *) (b + i)), 
+                             acc);
+    }
+
+    return hsum_avx512(acc) + vec_diff_normsq_tail(i, dim, a, b);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void vec_diff_normsq_batch_avx512(int dim, const unsigned char *q, 
+                                         int n, 
+                                         const unsigned char * const *c,
+                                         unsigned long *dists)
+{
+    if (dim > MAX_SIMD_DIM) {
+        vec_diff_normsq_batch_scalar(dim, q, n, c, dists);
+        return;
+    }
+
+    int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = _mm512_setzero_si512();
+        int i = 0;
+
+        for (; i + 64 <= dim; i += 64) {
+            __m512i x = _mm512_loadu_si512((const void *) (q + i));
+            acc0 = sq_diff_avx512(x, 
+                       _mm512_loadu_si512((const void *) (c[j] + i)), acc0);
+            acc1 = sq_diff_avx512(x, 
+                       _mm512_loadu_si512((const void *) (c[j+1] + i)), acc1);
+        }
+
+        dists[j] = 
+            hsum_avx512(acc0) + vec_diff_normsq_tail(i, dim, q, c[j]);
+        dists[j+1] = 
+            hsum_avx512(acc1) + vec_diff_normsq_tail(i, dim, q, c[j+1]);
+    }
+
+    for (; j < n; j++)
+        dists[j] = vec_diff_normsq_avx512(dim, q, c[j]);
+}
+
+#endif /* VOCAB_DISTANCE_X86 */
+
+int vec_diff_normsq_kernels(DistanceKernel *kernels)
+{
+    int num_kernels = 0;
+
+#ifdef VOCAB_DISTANCE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && 
+        __builtin_cpu_supports("avx512bw")) {
+        DistanceKernel k = { "avx512bw", vec_diff_normsq_avx512, 
+                             vec_diff_normsq_batch_avx512 };
+        kernels[num_kernels++] = k;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        DistanceKernel k = { "avx2", vec_diff_normsq_avx2, 
+                             vec_diff_normsq_batch_avx2 };
+        kernels[num_kernels++] = k;
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        DistanceKernel k = { "sse2", vec_diff_normsq_sse2, 
+                             vec_diff_normsq_batch_sse2 };
+        kernels[num_kernels++] = k;
+    }
+#endif
+
+    DistanceKernel scalar = 
+        { "scalar", vec_diff_normsq_scalar, vec_diff_normsq_batch_scalar };
+    kernels[num_kernels++] = scalar;
+
+    return num_kernels;
+}
+
+/* The fastest kernel the CPU supports.  The kernels are checked
+ * against the scalar code by VocabTestDistance, not here */
+static DistanceKernel SelectKernel()
+{
+    DistanceKernel kernels[VOCAB_DISTANCE_MAX_KERNELS];
+    vec_diff_normsq_kernels(kernels);
+
+    return kernels[0];
+}
+
+/* Chosen during static initialization, before any threads start */
+static DistanceKernel g_kernel = SelectKernel();
+
+unsigned long vec_diff_normsq(int dim, 
+                              const unsigned char *a, 
+                              const unsigned char *b)
+{
+    return g_kernel.m_single(dim, a, b);
+}
+
+void vec_diff_normsq_batch(int dim, const unsigned char *q, 
+                           int n, const unsigned char * const *c,
+                           unsigned long *dists)
+{
+    g_kernel.m_batch(dim, q, n, c, dists);
+}
+
+const char *vec_diff_normsq_kernel()
+{
+    return g_kernel.m_name;
+}
@@ -0,0 +1,90 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+/* VocabDistance.h */
+/* Squared Euclidean distances between byte descriptors */
+
+#ifndef __vocab_distance_h__
+#define __vocab_distance_h__
+
+/* Squared distance between the vectors a and b of length dim.  Uses
+ * the fastest kernel the CPU supports (AVX-512BW, AVX2, SSE2 or plain
+ * C), chosen once at startup */
+unsigned long vec_diff_normsq(int dim, 
+                              const unsigned char *a, 
+                              const unsigned char *b);
+
+/* Squared distances from the vector q to each of the n vectors c[i],
+ * stored in dists[i].  Each block of q is loaded once for several of
+ * the c[i] */
+void vec_diff_normsq_batch(int dim, const unsigned char *q, 
+                           int n, const unsigned char * const *c,
+                           unsigned long *dists);
+
+/* Plain C versions of the above, used as the reference for the SIMD
+ * kernels */
+unsigned long vec_diff_normsq_scalar(int dim, 
+                                     const unsigned char *a, 
+                                     const unsigned char *b);
+void vec_diff_normsq_batch_scalar(int dim, const unsigned char *q, 
+                                  int n, const unsigned char * const *c,
+                                  unsigned long *dists);
+
+/* Name of the kernel in use ("avx512bw", "avx2", "sse2" or "scalar") */
+const char *vec_diff_normsq_kernel();
+
+typedef unsigned long (*vec_diff_fn)(int, const unsigned char *, 
+                                     const unsigned char *);
+typedef void (*vec_diff_batch_fn)(int, const unsigned char *, int,
+                                  const unsigned char * const *,
+                                  unsigned long *);
+
+/* A distance kernel: its name and its single and batched versions */
+class DistanceKernel {
+public:
+    const char *m_name;
+    vec_diff_fn m_single;
+    vec_diff_batch_fn m_batch;
+};
+
+#define VOCAB_DISTANCE_MAX_KERNELS 4
+
+/* Fill kernels (at least VOCAB_DISTANCE_MAX_KERNELS entries) with the
+ * kernels the CPU supports, fastest first, ending with the scalar
+ * one.  The first is the one in use.  Returns the number of kernels */
+int vec_diff_normsq_kernels(DistanceKernel *kernels);
+
+#endif /* __vocab_distance_h__ */
@@ -1,5 +1,11 @@
 /* VocabFlatNode.cpp */
 
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+
 #include "VocabTree.h"
 
 #include "../lib/ann_1.1_char/include/ANN/ANN.h"
@@ -72,19 +78,18 @@ int VocabTreeFlatNode::PushFeature(unsigned char *v, double weight,
 }
 #endif
 
-unsigned long VocabTreeFlatNode::
-    PushAndScoreFeature(unsigned char *v, unsigned int index, 
-                        int bf, int dim, bool add)
+const VocabTreeLeaf *VocabTreeFlatNode::
+    PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                        VocabQueryContext &ctx) const
 {
     int nn_idx[NUM_NNS];
     ANNdist distsq[NUM_NNS];
 
-    annMaxPtsVisit(256);
-    // annMaxPtsVisit(128);
-
-    m_tree->annkPriSearch(v, NUM_NNS, nn_idx, distsq, 0.0);
+    /* Pass the search limit with the query rather than through
+     * annMaxPtsVisit, which sets a global */
+    m_tree->annkPriSearch(v, NUM_NNS, nn_idx, distsq, 0.0, 256);
 
-    unsigned long r;
+    const VocabTreeLeaf *r;
     if (USE_SOFT_ASSIGNMENT) {
         double w_weights[NUM_NNS];
         
@@ -102,16 +107,35 @@ unsigned long VocabTreeFlatNode::
             // printf("dist: %0.3f, w_weight: %0.3f\n", 
             //        (double) distsq[i], w_weight);
             double w_weight = w_weights[i];
-            r = m_children[nn_idx[i]]->PushAndScoreFeature(v, index, 
-                                                           bf, dim, add);
+            r = m_children[nn_idx[i]]->PushAndScoreFeature(v, bf, dim, ctx);
         }
     } else {
-        r = m_children[nn_idx[0]]->PushAndScoreFeature(v, index, bf, dim, add);
+        r = m_children[nn_idx[0]]->PushAndScoreFeature(v, bf, dim, ctx);
     }
 
     return r;
 }
 
+void VocabTreeFlatNode::PushFeatureBatch(int bf, int dim, int n, 
+                                         unsigned char *v, 
+                                         int *idx, int *tmp,
+                                         int depth_curr,
+                                         VocabQueryContext &ctx) const
+{
+    /* The search tree already groups the leaves, so the features are
+     * looked up one at a time */
+    for (int i = 0; i < n; i++) {
+        int nn_idx[NUM_NNS];
+        ANNdist distsq[NUM_NNS];
+
+        m_tree->annkPriSearch(v + (unsigned long) idx[i] * dim, NUM_NNS, 
+                              nn_idx, distsq, 0.0, 256);
+
+        m_children[nn_idx[0]]->PushFeatureBatch(bf, dim, 1, v, idx + i, 
+                                                tmp, depth_curr + 1, ctx);
+    }
+}
+
 /* Create a search tree for the given set of keypoints */
 void VocabTreeFlatNode::BuildANNTree(int num_leaves, int dim)
 {
@@ -127,3 +151,96 @@ void VocabTreeFlatNode::BuildANNTree(int num_leaves, int dim)
     /* Create a search tree for k2 */
     m_tree = new ANNkd_tree(pts, num_leaves, dim, 16);
 }
+
+#define FLAT_TREE_MAGIC "VTFLAT01"
+
+int VocabTreeFlatNode::ReadANNTree(const char *filename, 
+                                   int num_leaves, int dim)
+{
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+
+    if (!in.is_open())
+        return -1;
+
+    char magic[8];
+    int file_leaves = 0, file_dim = 0;
+    unsigned long long file_hash = 0;
+
+    in.read(magic, 8);
+    in.read((char *) &file_leaves, sizeof(int));
+    in.read((char *) &file_dim, sizeof(int));
+    in.read((char *) &file_hash, sizeof(unsigned long long));
+
+    if (!in || memcmp(magic, FLAT_TREE_MAGIC, 8) != 0 ||
+        file_leaves != num_leaves || file_dim != dim) {
+        return -1;
+    }
+
+    ANNpointArray pts = annAllocPts(num_leaves, dim);
+
+    unsigned long id = 0;
+    FillDescriptors(num_leaves, dim, id, pts[0]);
+
+    if (HashDescriptors(pts[0], (unsigned long) num_leaves * dim) != 
+        file_hash) {
+        annDeallocPts(pts);
+        return -1;
+    }
+
+    /* A truncated or corrupt file leaves the stream failed, and the
+     * caller builds the tree instead */
+    ANNkd_tree *tree = new ANNkd_tree(in, pts, num_leaves, dim);
+
+    if (!in) {
+        printf("[VocabTreeFlatNode::ReadANNTree] Invalid search tree in "
+               "file %s\n", filename);
+        delete tree;
+        annDeallocPts(pts);
+        return -1;
+    }
+
+    m_tree = tree;
+
+    return 0;
+}
+
+int VocabTreeFlatNode::WriteANNTree(const char *filename, 
+                                    int num_leaves, int dim) const
+{
+    if (m_tree == NULL)
+        return -1;
+
+    /* Write to a temporary file and rename it into place, so that a
+     * crash or another process writing the same cache never leaves a
+     * partial file under the final name */
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", filename, (int) getpid());
+
+    std::ofstream out(tmp, std::ios::out | std::ios::binary);
+
+    if (!out.is_open()) {
+        printf("[VocabTreeFlatNode::WriteANNTree] Error opening file %s "
+               "for writing\n", tmp);
+        return -1;
+    }
+
+    unsigned long long hash = 
+        HashDescriptors(m_tree->thePoints()[0], 
+                        (unsigned long) num_leaves * dim);
+
+    out.write(FLAT_TREE_MAGIC, 8);
+    out.write((const char *) &num_leaves, sizeof(int));
+    out.write((const char *) &dim, sizeof(int));
+    out.write((const char *) &hash, sizeof(unsigned long long));
+    m_tree->DumpBinary(out);
+    out.close();
+
+    if (!out || rename(tmp, filename) != 0) {
+        printf("[VocabTreeFlatNode::WriteANNTree] Error writing file %s\n",
+               filename);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
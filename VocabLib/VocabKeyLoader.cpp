@@ -0,0 +1,101 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+
+/* VocabKeyLoader.cpp */
+/* A pipeline of threads loading key files for a sequential consumer */
+
+#include <omp.h>
+
+#include "VocabKeyLoader.h"
+
+int GetNumLoadSlots(const VocabLoadOptions &options)
+{
+    int num_threads = (options.num_threads < 1) ? 1 : options.num_threads;
+
+    if (options.prefetch > 0)
+        return options.prefetch;
+
+    return 2 * num_threads;
+}
+
+void LoadKeyFiles(const std::vector<std::string> &key_files,
+                  const VocabLoadOptions &options,
+                  key_file_fn process, key_file_fn consume, void *data)
+{
+    int num_files = (int) key_files.size();
+    int num_threads = (options.num_threads < 1) ? 1 : options.num_threads;
+    int num_slots = GetNumLoadSlots(options);
+
+    KeyBuffer *slots = new KeyBuffer[num_slots];
+    int num_consumed = 0; /* Also orders the calls to consume */
+
+    /* File i is loaded into slot i % num_slots.  The dependencies make
+     * the load of file i wait until file i - num_slots has been
+     * consumed, and the consumption of file i wait for its load and
+     * for the consumption of file i - 1.  The tasks of file i are
+     * only created once file i - num_slots has been consumed, so at
+     * most num_slots files have tasks in flight, however long the
+     * list */
+#pragma omp parallel num_threads(num_threads)
+#pragma omp single
+    for (int i = 0; i < num_files; i++) {
+        int s = i % num_slots;
+
+        if (i >= num_slots) {
+#pragma omp taskwait depend(inout: slots[s])
+        }
+
+#pragma omp task depend(out: slots[s])
+        {
+            double start = omp_get_wtime();
+            LoadKeyFile(key_files[i].c_str(), slots[s], 
+                        options.min_feature_scale, options.max_keys);
+            slots[s].m_load_time = omp_get_wtime() - start;
+
+            if (process != NULL)
+                process(i, s, slots[s], data);
+        }
+
+#pragma omp task depend(in: slots[s]) depend(inout: num_consumed)
+        {
+            consume(i, s, slots[s], data);
+            num_consumed++;
+        }
+    }
+
+    delete [] slots;
+}
@@ -0,0 +1,47 @@
+/* VocabKeyLoader.h */
+/* Loading the key files of a list ahead of the code that uses them */
+
+#ifndef __vocab_key_loader_h__
+#define __vocab_key_loader_h__
+
+#include <string>
+#include <vector>
+
+#include "keys2.h"
+
+/* How a list of key files is loaded */
+class VocabLoadOptions {
+public:
+    VocabLoadOptions() : num_threads(1), prefetch(0),
+                         min_feature_scale(0.0), max_keys(0) { }
+
+    int num_threads;           /* threads loading (and processing) files */
+    int prefetch;              /* number of key buffers, which bounds how
+                                * far loading runs ahead of the
+                                * consumer; 0 means 2 * num_threads */
+    double min_feature_scale;  /* drop keys with a smaller scale */
+    int max_keys;              /* if > 0, keep at most this many keys of
+                                * each file (see LoadKeyFile) */
+};
+
+/* Called for a loaded key file.  slot is the index of the key buffer
+ * holding it (in [0, number of buffers)), so per-slot state can be
+ * kept alongside the buffers */
+typedef void (*key_file_fn)(int index, int slot, KeyBuffer &keys, 
+                            void *data);
+
+/* Returns the number of key buffers LoadKeyFiles uses with options */
+int GetNumLoadSlots(const VocabLoadOptions &options);
+
+/* Load each key file of a list into one of a ring of key buffers,
+ * using options.num_threads threads.  process (if not NULL) is called
+ * right after a file is loaded, on the loading thread, and may run
+ * concurrently for different files.  consume is then called for each
+ * file in list order, one at a time.  A buffer is only reused once
+ * its file has been consumed, so at most GetNumLoadSlots(options)
+ * files are in memory at once */
+void LoadKeyFiles(const std::vector<std::string> &key_files,
+                  const VocabLoadOptions &options,
+                  key_file_fn process, key_file_fn consume, void *data);
+
+#endif /* __vocab_key_loader_h__ */
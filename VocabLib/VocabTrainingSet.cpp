@@ -0,0 +1,371 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+
+/* VocabTrainingSet.cpp */
+/* Reading, writing, and mapping packed training descriptors */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "kmeans.h"
+#include "VocabTree.h"
+#include "VocabTrainingSet.h"
+#include "keys2.h"
+#include "VocabKeyLoader.h"
+
+#define VOCAB_TRAIN_MAGIC "VTKEYS01"
+#define VOCAB_TRAIN_DIM 128
+
+struct training_header_t {
+    char magic[8];
+    unsigned int dim;
+    unsigned int pad;
+    unsigned long long num;
+};
+
+/* Receives the sampled keys, a batch at a time */
+typedef int (*key_sink_t)(const unsigned char *keys, unsigned long num_keys,
+                          void *data);
+
+/* State of sample_key_files, passed from one key file to the next */
+struct sample_state_t {
+    const std::vector<std::string> *key_files;
+    const VocabSampleOptions *sample;
+    unsigned long long state;      /* Random state */
+    unsigned long long seen;       /* Keys offered to the reservoir */
+    std::vector<int> keep;
+    std::vector<unsigned char> reservoir;
+    key_sink_t sink;
+    void *data;
+    int error;
+};
+
+/* Keep a random subset of at most sample.max_keys_per_image of the
+ * loaded keys (if > 0).  Returns the number of keys kept, packed at
+ * the start of keys.m_keys */
+static int subsample_keys(KeyBuffer &keys, sample_state_t &s)
+{
+    int num_keys = keys.m_num_keys;
+    int max_keep = s.sample->max_keys_per_image;
+    if (max_keep <= 0 || num_keys <= max_keep)
+        return num_keys;
+
+    std::vector<int> &keep = s.keep;
+    keep.resize(num_keys);
+    for (int i = 0; i < num_keys; i++)
+        keep[i] = i;
+
+    /* Partial Fisher-Yates shuffle, then restore the file order */
+    for (int i = 0; i < max_keep; i++) {
+        int j = i + next_random(s.state) % (num_keys - i);
+        std::swap(keep[i], keep[j]);
+    }
+
+    std::sort(keep.begin(), keep.begin() + max_keep);
+
+    /* keep[i] >= i, so the keys can be packed in place */
+    for (int i = 0; i < max_keep; i++) {
+        if (keep[i] != i) {
+            memcpy(keys.m_keys + (size_t) i * VOCAB_TRAIN_DIM,
+                   keys.m_keys + (size_t) keep[i] * VOCAB_TRAIN_DIM,
+                   VOCAB_TRAIN_DIM);
+        }
+    }
+
+    return max_keep;
+}
+
+/* Sample the keys of one loaded key file; called in list order */
+static void sample_keys(int index, int slot, KeyBuffer &keys, void *data)
+{
+    sample_state_t &s = *(sample_state_t *) data;
+    const VocabSampleOptions &sample = *s.sample;
+
+    if (s.error)
+        return;
+
+    printf("  Reading keyfile %s\n", (*s.key_files)[index].c_str());
+    fflush(stdout);
+
+    int num_keys = subsample_keys(keys, s);
+
+    if (num_keys == 0)
+        return;
+
+    if (sample.max_keys == 0) {
+        if (s.sink(keys.m_keys, num_keys, s.data) != 0)
+            s.error = 1;
+
+        return;
+    }
+
+    for (int j = 0; j < num_keys; j++, s.seen++) {
+        const unsigned char *key = 
+            keys.m_keys + (size_t) j * VOCAB_TRAIN_DIM;
+
+        if (s.seen < sample.max_keys) {
+            s.reservoir.insert(s.reservoir.end(), 
+                               key, key + VOCAB_TRAIN_DIM);
+        } else {
+            unsigned long long r = next_random_ull(s.state, s.seen + 1);
+            if (r < sample.max_keys) {
+                memcpy(&s.reservoir[r * VOCAB_TRAIN_DIM], key, 
+                       VOCAB_TRAIN_DIM);
+            }
+        }
+    }
+}
+
+/* Sample the keys of a list of key files in a single pass, passing
+ * them to sink.  Without a limit on the total, each file's keys are
+ * passed on as soon as they are read; otherwise they go through a
+ * reservoir (Algorithm R), which is passed on at the end, or swapped
+ * into out if it is not NULL.  The files are loaded (and inflated, if
+ * gzipped) by sample.num_threads threads, and sampled in list order */
+static int sample_key_files(const std::vector<std::string> &key_files,
+                            const VocabSampleOptions &sample,
+                            key_sink_t sink, void *data,
+                            std::vector<unsigned char> *out = NULL)
+{
+    sample_state_t s;
+    s.key_files = &key_files;
+    s.sample = &sample;
+    s.state = seed_state(sample.seed);
+    s.seen = 0;
+    s.sink = sink;
+    s.data = data;
+    s.error = 0;
+
+    /* The reservoir fills up unless there are fewer keys in all */
+    if (sample.max_keys > 0)
+        s.reservoir.reserve((size_t) sample.max_keys * VOCAB_TRAIN_DIM);
+
+    VocabLoadOptions load;
+    load.num_threads = sample.num_threads;
+    load.min_feature_scale = sample.min_feature_scale;
+
+    LoadKeyFiles(key_files, load, NULL, sample_keys, &s);
+
+    if (s.error)
+        return -1;
+
+    if (sample.max_keys > 0) {
+        printf("[sample_key_files] Sampled %lu of %llu keys\n",
+               (unsigned long) (s.reservoir.size() / VOCAB_TRAIN_DIM), 
+               s.seen);
+
+        if (out != NULL) {
+            out->swap(s.reservoir);
+        } else if (!s.reservoir.empty() && 
+                   sink(&s.reservoir[0], 
+                        s.reservoir.size() / VOCAB_TRAIN_DIM, data) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int append_keys(const unsigned char *keys, unsigned long num_keys,
+                       void *data)
+{
+    std::vector<unsigned char> *buffer = (std::vector<unsigned char> *) data;
+    buffer->insert(buffer->end(), keys, keys + num_keys * VOCAB_TRAIN_DIM);
+
+    return 0;
+}
+
+int VocabTrainingSet::ReadKeyFiles(const std::vector<std::string> &key_files,
+                                   const VocabSampleOptions &sample)
+{
+    Clear();
+
+    /* A sample of the whole collection is swapped into m_buffer
+     * rather than copied */
+    if (sample_key_files(key_files, sample, append_keys, &m_buffer,
+                         &m_buffer) != 0) {
+        Clear();
+        return -1;
+    }
+
+    m_num = m_buffer.size() / VOCAB_TRAIN_DIM;
+    m_dim = VOCAB_TRAIN_DIM;
+    m_data = m_buffer.empty() ? NULL : &m_buffer[0];
+
+    return 0;
+}
+
+int VocabTrainingSet::Map(const char *filename)
+{
+    Clear();
+
+    unsigned long size;
+    void *base = MapFile(filename, size);
+    if (base == NULL)
+        return -1;
+
+    const training_header_t *header = (const training_header_t *) base;
+    if (size < sizeof(training_header_t) ||
+        memcmp(header->magic, VOCAB_TRAIN_MAGIC, 8) != 0) {
+        printf("[VocabTrainingSet::Map] Error: %s is not a training file\n",
+               filename);
+        UnmapFile(base, size);
+        return -1;
+    }
+
+    /* The tree is built from 128-byte SIFT descriptors only */
+    if (header->dim != VOCAB_TRAIN_DIM) {
+        printf("[VocabTrainingSet::Map] Error: training file %s has "
+               "dimension %u instead of %d\n", filename, header->dim,
+               VOCAB_TRAIN_DIM);
+        UnmapFile(base, size);
+        return -1;
+    }
+
+    /* Compared by division, since num * dim can overflow */
+    if (header->num > (size - sizeof(training_header_t)) / header->dim) {
+        printf("[VocabTrainingSet::Map] Error: training file %s is "
+               "truncated\n", filename);
+        UnmapFile(base, size);
+        return -1;
+    }
+
+    m_base = base;
+    m_size = size;
+    m_num = (unsigned long) header->num;
+    m_dim = (int) header->dim;
+    m_data = (const unsigned char *) base + sizeof(training_header_t);
+
+    return 0;
+}
+
+void VocabTrainingSet::Clear()
+{
+    /* Swap to release the memory, not just the contents */
+    std::vector<unsigned char>().swap(m_buffer);
+
+    if (m_base != NULL)
+        UnmapFile(m_base, m_size);
+
+    m_num = 0;
+    m_dim = 0;
+    m_data = NULL;
+    m_base = NULL;
+    m_size = 0;
+}
+
+bool IsTrainingFile(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return false;
+
+    char magic[8];
+    bool match = (fread(magic, 1, 8, f) == 8 &&
+                  memcmp(magic, VOCAB_TRAIN_MAGIC, 8) == 0);
+    fclose(f);
+
+    return match;
+}
+
+/* Destination of the keys written to a training file */
+typedef struct {
+    FILE *f;
+    unsigned long long num;
+} training_writer_t;
+
+static int write_keys(const unsigned char *keys, unsigned long num_keys,
+                      void *data)
+{
+    training_writer_t *writer = (training_writer_t *) data;
+
+    size_t len = (size_t) num_keys * VOCAB_TRAIN_DIM;
+    if (fwrite(keys, 1, len, writer->f) != len)
+        return -1;
+
+    writer->num += num_keys;
+
+    return 0;
+}
+
+int WriteTrainingFile(const char *filename,
+                      const std::vector<std::string> &key_files,
+                      const VocabSampleOptions &sample)
+{
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("[WriteTrainingFile] Error opening file %s for writing\n",
+               filename);
+        return -1;
+    }
+
+    training_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VOCAB_TRAIN_MAGIC, 8);
+    header.dim = VOCAB_TRAIN_DIM;
+
+    /* The count is filled in once all of the keys are written */
+    int error = (fwrite(&header, sizeof(header), 1, f) != 1);
+
+    training_writer_t writer;
+    writer.f = f;
+    writer.num = 0;
+
+    if (!error)
+        error = (sample_key_files(key_files, sample, write_keys, 
+                                  &writer) != 0);
+
+    if (!error) {
+        header.num = writer.num;
+        error = (fseek(f, 0, SEEK_SET) != 0 ||
+                 fwrite(&header, sizeof(header), 1, f) != 1);
+    }
+
+    error = (fclose(f) != 0) || error;
+
+    if (error) {
+        printf("[WriteTrainingFile] Error writing file %s\n", filename);
+        return -1;
+    }
+
+    printf("[WriteTrainingFile] Wrote %llu keys to %s\n", header.num,
+           filename);
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+/* VocabTrainingSet.h */
+/* Training descriptors for VocabTree::Build, either read from key
+ * files or mapped from a packed training file */
+
+#ifndef __vocab_training_set_h__
+#define __vocab_training_set_h__
+
+#include <string>
+#include <vector>
+
+/* A training file is a 24-byte header followed by the descriptors,
+ * packed one after another:
+ *
+ *   magic : "VTKEYS01"
+ *   dim   : unsigned int
+ *   pad   : unsigned int
+ *   num   : unsigned long long
+ *   data  : num * dim bytes */
+
+/* Which keys of a set of key files to train on.  The defaults keep
+ * every key */
+class VocabSampleOptions {
+public:
+    VocabSampleOptions() : min_feature_scale(0.0), max_keys_per_image(0),
+                           max_keys(0), seed(0), num_threads(1) { }
+
+    double min_feature_scale;  /* drop keys with a smaller scale */
+    int max_keys_per_image;    /* if > 0, keep a random subset of at
+                                * most this many of the remaining keys
+                                * of each image (in file order) */
+    unsigned long max_keys;    /* if > 0, keep a uniform random sample
+                                * of at most this many keys of the
+                                * whole collection (reservoir sampling,
+                                * so the order is not preserved) */
+    unsigned int seed;         /* seed for the random choices */
+    int num_threads;           /* threads loading the key files; the
+                                * sample does not depend on it */
+};
+
+class VocabTrainingSet {
+public:
+    VocabTrainingSet() : m_num(0), m_dim(0), m_data(NULL),
+                         m_base(NULL), m_size(0) { }
+    ~VocabTrainingSet() { Clear(); }
+
+    /* Read the (sampled) descriptors of a list of key files into one
+     * array, in a single pass over the files */
+    int ReadKeyFiles(const std::vector<std::string> &key_files,
+                     const VocabSampleOptions &sample = 
+                         VocabSampleOptions());
+
+    /* Map a training file, so that the descriptors are paged in from
+     * disk as the tree is built rather than held in memory */
+    int Map(const char *filename);
+
+    /* Release the descriptors */
+    void Clear();
+
+    unsigned long m_num;          /* Number of descriptors */
+    int m_dim;                    /* Dimension of each descriptor */
+    const unsigned char *m_data;  /* The packed descriptors */
+
+private:
+    std::vector<unsigned char> m_buffer;  /* Descriptors read from key
+                                           * files */
+    void *m_base;                         /* Start of the mapped file */
+    unsigned long m_size;                 /* Size of the mapped file */
+};
+
+/* Is filename a training file? */
+bool IsTrainingFile(const char *filename);
+
+/* Write the (sampled) descriptors of a list of key files to a
+ * training file, in a single pass over the key files.  Unless
+ * sample.max_keys is set, only one key file is held in memory at a
+ * time */
+int WriteTrainingFile(const char *filename,
+                      const std::vector<std::string> &key_files,
+                      const VocabSampleOptions &sample = 
+                          VocabSampleOptions());
+
+#endif /* __vocab_training_set_h__ */
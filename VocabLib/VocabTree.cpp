@@ -45,38 +45,31 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "VocabTree.h"
+#include "VocabDistance.h"
 #include "defines.h"
 #include "qsort.h"
 #include "util.h"
 
-/* Useful utility function for computing the squared distance between
- * two vectors a and b of length dim */
-static unsigned long vec_diff_normsq(int dim, 
-                                     unsigned char *a, 
-                                     unsigned char *b)
-{
-    int i;
-    unsigned long normsq = 0;
-
-    for (i = 0; i < dim; i++) {
-        int d = (int) a[i] - (int) b[i];
-        normsq += d * d;
-    }
-
-    return normsq;
-}
-
 void VocabTreeInteriorNode::Clear(int bf) 
 {
     if (m_children != NULL) {
         for (int i = 0; i < bf; i++) {
-            m_children[i]->Clear(bf);
-            delete m_children[i];
+            if (m_children[i] != NULL) {
+                m_children[i]->Clear(bf);
+                delete m_children[i];
+            }
         }
 
         delete [] m_children;
     }
+
+    if (m_child_desc != NULL) {
+        delete [] m_child_desc;
+        delete [] m_child_slot;
+    }
     
     if (m_desc != NULL) 
         delete [] m_desc;    
@@ -107,9 +100,9 @@ VocabTreeLeaf::~VocabTreeLeaf()
 }
 #endif
 
-unsigned long VocabTreeInteriorNode::
-    PushAndScoreFeature(unsigned char *v, 
-                        unsigned int index, int bf, int dim, bool add)
+const VocabTreeLeaf *VocabTreeInteriorNode::
+    PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                        VocabQueryContext &ctx) const
 {
     unsigned long min_dist = ULONG_MAX;
     int best_idx = 0;
@@ -126,25 +119,96 @@ unsigned long VocabTreeInteriorNode::
         }
     }    
 
-    unsigned long r = 
-        m_children[best_idx]->PushAndScoreFeature(v, index, bf, dim, add);
+    return m_children[best_idx]->PushAndScoreFeature(v, bf, dim, ctx);
+}
 
-    return r;
+const VocabTreeLeaf *VocabTreeLeaf::
+    PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                        VocabQueryContext &ctx) const
+{
+    ctx.AddScore(m_id, m_weight);
+    return this;
 }
 
-unsigned long VocabTreeLeaf::PushAndScoreFeature(unsigned char *v, 
-                                                 unsigned int index, 
-                                                 int bf, int dim, 
-                                                 bool add) 
+void VocabTreeInteriorNode::PushFeatureBatch(int bf, int dim, int n, 
+                                             unsigned char *v, 
+                                             int *idx, int *tmp,
+                                             int depth_curr,
+                                             VocabQueryContext &ctx) const
 {
-    m_score += m_weight;
+    if (n == 0)
+        return;
 
-    if (add) {
-        /* Update the inverted file */
-        AddFeatureToInvertedFile(index, bf, dim);
+    int *best = tmp;
+    int *sorted = tmp + n;
+
+    /* This level's slice of ctx.m_starts holds the start of each
+     * child's share of the features, followed by the next free slot
+     * of each.  It is indexed rather than pointed to, since deeper
+     * levels may grow the vector */
+    unsigned long base = (unsigned long) depth_curr * (2 * bf + 1);
+    if (ctx.m_starts.size() < base + 2 * bf + 1)
+        ctx.m_starts.resize(base + 2 * bf + 1);
+
+    if (ctx.m_dists.size() < (unsigned long) m_num_children + 1)
+        ctx.m_dists.resize(m_num_children + 1);
+
+    int *start = &ctx.m_starts[base];
+    int *pos = start + bf + 1;
+    unsigned long *dists = &ctx.m_dists[0];
+
+    for (int j = 0; j <= bf; j++)
+        start[j] = 0;
+
+    /* Find the closest child of each feature, breaking ties the same
+     * way as PushAndScoreFeature */
+    for (int i = 0; i < n; i++) {
+        unsigned char *f = v + (unsigned long) idx[i] * dim;
+        unsigned long min_dist = ULONG_MAX;
+        int best_idx = 0;
+
+        vec_diff_normsq_batch(dim, f, m_num_children, m_child_desc, dists);
+
+        for (int j = 0; j < m_num_children; j++) {
+            if (dists[j] < min_dist) {
+                min_dist = dists[j];
+                best_idx = m_child_slot[j];
+            }
+        }
+
+        best[i] = best_idx;
+        start[best_idx + 1]++;
+    }
+
+    /* Group the features by child */
+    for (int j = 0; j < bf; j++) 
+        start[j + 1] += start[j];
+
+    memcpy(pos, start, sizeof(int) * bf);
+    for (int i = 0; i < n; i++) 
+        sorted[pos[best[i]]++] = idx[i];
+
+    memcpy(idx, sorted, sizeof(int) * n);
+
+    for (int j = 0; j < bf; j++) {
+        int first = ctx.m_starts[base + j];
+        int count = ctx.m_starts[base + j + 1] - first;
+
+        if (count > 0) {
+            m_children[j]->PushFeatureBatch(bf, dim, count, v, idx + first,
+                                            tmp + 2 * first, depth_curr + 1,
+                                            ctx);
+        }
     }
-    
-    return m_id;
+}
+
+void VocabTreeLeaf::PushFeatureBatch(int bf, int dim, int n, 
+                                     unsigned char *v, int *idx, int *tmp,
+                                     int depth_curr,
+                                     VocabQueryContext &ctx) const
+{
+    for (int i = 0; i < n; i++) 
+        ctx.m_leaves[idx[i]] = this;
 }
 
 int VocabTreeLeaf::AddFeatureToInvertedFile(unsigned int index, 
@@ -198,24 +262,6 @@ double VocabTreeLeaf::ComputeTFIDFWeights(int bf, double n)
     return 0;
 }
 
-int VocabTreeInteriorNode::FillQueryVector(float *q, int bf, 
-                                           double mag_inv)
-{
-    for (int i = 0; i < bf; i++) {
-        if (m_children[i] != NULL) {
-            m_children[i]->FillQueryVector(q, bf, mag_inv);
-        }
-    }
-
-    return 0;
-}
-
-int VocabTreeLeaf::FillQueryVector(float *q, int bf, double mag_inv)
-{
-    q[m_id] = m_score * mag_inv;
-    return 0;
-}
-
 int VocabTreeInteriorNode::ScoreQuery(float *q, int bf, DistanceType dtype, 
                                       float *scores)
 {
@@ -266,29 +312,6 @@ double ComputeMagnitude(DistanceType dtype, double dim)
     }
 }
 
-double VocabTreeInteriorNode::
-    ComputeDatabaseVectorMagnitude(int bf, DistanceType dtype) 
-{
-    double mag = 0.0;
-
-    for (int i = 0; i < bf; i++) {
-        if (m_children[i] != NULL) {
-            mag += m_children[i]->ComputeDatabaseVectorMagnitude(bf, dtype);
-        }
-    }
-
-    return mag;
-}
-
-double VocabTreeLeaf::
-    ComputeDatabaseVectorMagnitude(int bf, DistanceType dtype) 
-{
-    double dim = m_score;
-    double mag = ComputeMagnitude(dtype, dim);
-
-    return mag;
-}
-
 int VocabTreeInteriorNode::
     ComputeDatabaseMagnitudes(int bf, DistanceType dtype, int start_index,
                               std::vector<float> &mags) 
@@ -392,17 +415,20 @@ int VocabTreeLeaf::GetMaxDatabaseImageIndex(int bf) const
 
 
 /* Implementations of driver functions */
-int VocabTree::PushAndScoreFeature(unsigned char *v, 
-                                   unsigned int index, bool add)
+unsigned long VocabTree::PushAndScoreFeature(unsigned char *v, 
+                                             VocabQueryContext &ctx) const
 {
-    qsort_descending();
-    m_root->PushAndScoreFeature(v, index, m_branch_factor, m_dim, add);
-    
-    return 0;
+    return m_root->PushAndScoreFeature(v, m_branch_factor, m_dim, ctx)->m_id;
 }
 
 int VocabTree::ComputeTFIDFWeights(unsigned int num_db_images)
 {
+    if (IsFinalized()) {
+        printf("[VocabTree::ComputeTFIDFWeights] Error: database is "
+               "finalized\n");
+        return -1;
+    }
+
     if (m_root != NULL) {
         // double n = m_root->CountFeatures(m_branch_factor);
         // printf("[VocabTree::ComputeTFIDFWeights] Found %lf features\n", n);
@@ -414,6 +440,12 @@ int VocabTree::ComputeTFIDFWeights(unsigned int num_db_images)
 
 int VocabTree::NormalizeDatabase(int start_index, int num_db_images)
 {
+    if (IsFinalized()) {
+        printf("[VocabTree::NormalizeDatabase] Error: database is "
+               "finalized\n");
+        return -1;
+    }
+
     std::vector<float> mags;
     mags.resize(num_db_images);
     m_root->ComputeDatabaseMagnitudes(m_branch_factor, m_distance_type, 
@@ -427,29 +459,171 @@ int VocabTree::NormalizeDatabase(int start_index, int num_db_images)
     return m_root->NormalizeDatabase(m_branch_factor, start_index, mags);
 }
 
+void VocabQueryContext::Reset(unsigned long num_nodes)
+{
+    if (m_scores.size() < num_nodes)
+        m_scores.resize(num_nodes, 0.0);
+
+    int num_touched = (int) m_touched.size();
+    for (int i = 0; i < num_touched; i++) {
+        m_scores[m_touched[i]] = 0.0;
+    }
+
+    m_touched.clear();
+}
+
+/* Is image a ranked above image b? */
+static inline bool BetterScore(const float *scores, int a, int b)
+{
+    return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+}
+
+/* Restore the heap property (worst image at the root) below slot i */
+static void SiftDownScores(const float *scores, int *heap, int len, int i)
+{
+    while (true) {
+        int worst = i;
+        int l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < len && BetterScore(scores, heap[worst], heap[l]))
+            worst = l;
+        if (r < len && BetterScore(scores, heap[worst], heap[r]))
+            worst = r;
+
+        if (worst == i)
+            return;
+
+        int tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+int SelectTopScores(int n, const float *scores, int k, int *top)
+{
+    if (k > n)
+        k = n;
+
+    if (k <= 0)
+        return 0;
+
+    /* Keep the best k images seen so far in a heap with the worst of
+     * them at the root, so most images are rejected with one test */
+    for (int i = 0; i < k; i++) 
+        top[i] = i;
+
+    for (int i = k / 2 - 1; i >= 0; i--) 
+        SiftDownScores(scores, top, k, i);
+
+    for (int i = k; i < n; i++) {
+        if (BetterScore(scores, i, top[0])) {
+            top[0] = i;
+            SiftDownScores(scores, top, k, 0);
+        }
+    }
+
+    /* Sort the heap, moving the worst image to the back each time */
+    for (int len = k - 1; len > 0; len--) {
+        int tmp = top[0];
+        top[0] = top[len];
+        top[len] = tmp;
+        SiftDownScores(scores, top, len, 0);
+    }
+
+    return k;
+}
+
+int VocabQueryContext::SelectTopScores(int n, const float *scores, int k)
+{
+    m_top.resize(MAX(0, MIN(k, n)));
+
+    if (m_top.empty())
+        return 0;
+
+    return ::SelectTopScores(n, scores, k, &m_top[0]);
+}
+
+double VocabTree::ComputeContextMagnitude(VocabQueryContext &ctx) const
+{
+    /* Visit the words in tree order so that the sums below match a
+     * full traversal of the tree */
+    std::sort(ctx.m_touched.begin(), ctx.m_touched.end());
+
+    double mag = 0.0;
+    int num_touched = (int) ctx.m_touched.size();
+    for (int i = 0; i < num_touched; i++) {
+        mag += ComputeMagnitude(m_distance_type, 
+                                ctx.m_scores[ctx.m_touched[i]]);
+    }
+
+    return mag;
+}
+
+int VocabTree::QuantizeBatch(int n, unsigned char *v, 
+                             VocabQueryContext &ctx) const
+{
+    if (m_root == NULL)
+        return -1;
+
+    ctx.m_leaves.resize(n);
+    ctx.m_batch.resize(3 * n);
+
+    if (n == 0)
+        return 0;
+
+    int *idx = &ctx.m_batch[0];
+    for (int i = 0; i < n; i++) 
+        idx[i] = i;
+
+    m_root->PushFeatureBatch(m_branch_factor, m_dim, n, v, idx, idx + n,
+                             0, ctx);
+
+    return 0;
+}
+
+int VocabTree::QuantizeBatch(int n, unsigned char *v, 
+                             unsigned long *word_ids) const
+{
+    VocabQueryContext ctx;
+    
+    if (QuantizeBatch(n, v, ctx) != 0)
+        return -1;
+
+    for (int i = 0; i < n; i++) 
+        word_ids[i] = ctx.m_leaves[i]->m_id;
+
+    return 0;
+}
 
 double VocabTree::AddImageToDatabase(int index, int n, unsigned char *v,
                                      unsigned long *ids)
 {
-    m_root->ClearScores(m_branch_factor);
-    unsigned long off = 0;
+    if (IsFinalized()) {
+        printf("[VocabTree::AddImageToDatabase] Error: database is "
+               "finalized\n");
+        return 0.0;
+    }
+
+    m_context.Reset(m_num_nodes);
 
     // printf("[AddImageToDatabase] Adding image with %d features...\n", n);
     // fflush(stdout);
 
+    QuantizeBatch(n, v, m_context);
+
     for (int i = 0; i < n; i++) {
-        unsigned long id = 
-            m_root->PushAndScoreFeature(v+off, index, m_branch_factor, m_dim);
+        VocabTreeLeaf *leaf = (VocabTreeLeaf *) m_context.m_leaves[i];
+        m_context.AddScore(leaf->m_id, leaf->m_weight);
 
-        if (ids != NULL)
-            ids[i] = id;
+        /* Update the inverted file */
+        leaf->AddFeatureToInvertedFile(index, m_branch_factor, m_dim);
 
-        off += m_dim;
-        fflush(stdout);
+        if (ids != NULL)
+            ids[i] = leaf->m_id;
     }
 
-    double mag = m_root->ComputeDatabaseVectorMagnitude(m_branch_factor,
-                                                        m_distance_type);
+    double mag = ComputeContextMagnitude(m_context);
 
     m_database_images++;
 
@@ -468,36 +642,70 @@ double VocabTree::AddImageToDatabase(int index, int n, unsigned char *v,
 double VocabTree::ScoreQueryKeys(int n, bool normalize, unsigned char *v, 
                                  float *scores)
 {
-    qsort_descending();
+    return ScoreQueryKeys(n, normalize, v, scores, m_context);
+}
 
+double VocabTree::ScoreQueryKeys(int n, bool normalize, unsigned char *v, 
+                                 float *scores, VocabQueryContext &ctx) const
+{
     /* Compute the query vector */
-    m_root->ClearScores(m_branch_factor);
-    unsigned long off = 0;
-    for (int i = 0; i < n; i++) {
-        m_root->PushAndScoreFeature(v + off, 0, 
-                                    m_branch_factor, m_dim, false);
+    ctx.Reset(m_num_nodes);
+    QuantizeBatch(n, v, ctx);
 
-        off += m_dim;
+    for (int i = 0; i < n; i++) {
+        ctx.AddScore(ctx.m_leaves[i]->m_id, ctx.m_leaves[i]->m_weight);
     }
 
-    double mag = m_root->ComputeDatabaseVectorMagnitude(m_branch_factor, 
-                                                        m_distance_type);
+    double mag = ComputeContextMagnitude(ctx);
 
     if (m_distance_type == DistanceDot)
         mag = sqrt(mag);
 
-    /* Now, compute the normalized vector */
-    int num_nodes = m_num_nodes;
-    float *q = new float[num_nodes];
+    /* Now, score the normalized vector.  Only the touched leaves
+     * have non-zero entries in the query vector */
+    double mag_inv = normalize ? 1.0 / mag : 1.0;
 
-    if (normalize)
-        m_root->FillQueryVector(q, m_branch_factor, 1.0 / mag);
-    else
-        m_root->FillQueryVector(q, m_branch_factor, 1.0);
+    if (!IsFinalized()) {
+        /* Without the inverted index, score with the inverted files
+         * of the leaves, which need the whole query vector */
+        std::vector<float> q(m_num_nodes, 0.0);
+
+        int num_touched = (int) ctx.m_touched.size();
+        for (int i = 0; i < num_touched; i++) {
+            unsigned long id = ctx.m_touched[i];
+            q[id] = ctx.m_scores[id] * mag_inv;
+        }
 
-    m_root->ScoreQuery(q, m_branch_factor, m_distance_type, scores);
+        m_root->ScoreQuery(&q[0], m_branch_factor, m_distance_type, scores);
+
+        return mag;
+    }
 
-    delete [] q;
+    const unsigned long *offsets = m_index.m_offsets;
+    const unsigned int *images = m_index.m_images;
+    const float *counts = m_index.m_counts;
+
+    int num_touched = (int) ctx.m_touched.size();
+    for (int i = 0; i < num_touched; i++) {
+        unsigned long id = ctx.m_touched[i];
+        float q = ctx.m_scores[id] * mag_inv;
+
+        if (q == 0.0) 
+            continue;
+
+        unsigned long end = offsets[id + 1];
+
+        switch (m_distance_type) {
+        case DistanceDot:
+            for (unsigned long j = offsets[id]; j < end; j++)
+                scores[images[j]] += q * counts[j];
+            break;
+        case DistanceMin:
+            for (unsigned long j = offsets[id]; j < end; j++)
+                scores[images[j]] += MIN(q, counts[j]);
+            break;
+        }
+    }
 
     return mag;
 }
@@ -520,7 +728,7 @@ void VocabTreeLeaf::PopulateLeaves(int bf, int dim,
     leaves[g_leaf_counter++] = this;
 }
 
-int VocabTree::Flatten()
+int VocabTree::Flatten(const char *search_tree)
 {
     if (m_root == NULL)
         return -1;
@@ -540,7 +748,20 @@ int VocabTree::Flatten()
 
     g_leaf_counter = 0;
     m_root->PopulateLeaves(m_branch_factor, m_dim, new_root->m_children);
-    new_root->BuildANNTree(num_leaves, m_dim);
+
+    if (search_tree != NULL && 
+        new_root->ReadANNTree(search_tree, num_leaves, m_dim) == 0) {
+        printf("[VocabTree::Flatten] Read search tree %s\n", search_tree);
+    } else {
+        new_root->BuildANNTree(num_leaves, m_dim);
+
+        if (search_tree != NULL && 
+            new_root->WriteANNTree(search_tree, num_leaves, m_dim) == 0) {
+            printf("[VocabTree::Flatten] Wrote search tree %s\n", 
+                   search_tree);
+        }
+    }
+
     new_root->m_desc = new unsigned char[m_dim];
     memset(new_root->m_desc, 0, m_dim);
     new_root->m_id = 0;
@@ -555,6 +776,12 @@ int VocabTree::Flatten()
 
 int VocabTree::Combine(const VocabTree &tree)
 {
+    if (IsFinalized() || tree.IsFinalized()) {
+        printf("[VocabTree::Combine] Error: cannot combine finalized "
+               "databases\n");
+        return -1;
+    }
+
     return m_root->Combine(tree.m_root, m_branch_factor);
 }
 
@@ -565,6 +792,13 @@ int VocabTree::GetMaxDatabaseImageIndex() const
 
 int VocabTree::Clear() 
 {
+    m_context = VocabQueryContext();
+
+    if (IsMapped())
+        return ClearMapped();
+
+    m_index.Clear();
+
     if (m_root != NULL) {
         m_root->Clear(m_branch_factor);
         delete m_root;
@@ -46,6 +46,8 @@
 
 #include "../lib/ann_1.1_char/include/ANN/ANN.h"
 
+#include "kmeans.h"
+
 /* Types of distances supported */
 typedef enum {
     DistanceDot  = 0,
@@ -69,6 +71,87 @@ public:
                     * feature appears */
 };
 
+/* Read-only inverted file stored in compressed sparse row form.  The
+ * postings of the visual word with id w are stored in
+ * m_images[m_offsets[w] .. m_offsets[w+1]-1], with the matching
+ * (weighted, normalized) counts in m_counts */
+class VocabInvertedIndex {
+public:
+    VocabInvertedIndex() : m_num_words(0), m_num_postings(0),
+                           m_offsets(NULL), m_images(NULL), m_counts(NULL),
+                           m_owned(false) { }
+
+    /* Allocate storage for the given number of words and postings */
+    int Allocate(unsigned long num_words, unsigned long num_postings);
+    /* Point the index at existing (e.g., memory-mapped) arrays, which
+     * are not freed by Clear */
+    void Wrap(unsigned long num_words, unsigned long num_postings,
+              unsigned long *offsets, unsigned int *images, float *counts);
+    /* Free the storage */
+    void Clear();
+
+    bool IsEmpty() const { return m_offsets == NULL; }
+
+    /* Member variables */
+    unsigned long m_num_words;    /* Number of entries in the word table */
+    unsigned long m_num_postings; /* Total length of the posting lists */
+    unsigned long *m_offsets;     /* Start of each posting list
+                                   * (m_num_words + 1 entries) */
+    unsigned int *m_images;       /* Database image of each posting */
+    float *m_counts;              /* Weighted count of each posting */
+    bool m_owned;                 /* Were the arrays allocated by us? */
+};
+
+class VocabTreeLeaf;
+class VocabTreeCheckpoint;
+
+/* Find the k highest of n scores without sorting all of them, using
+ * a bounded heap.  On return, top holds the indices of the min(k, n)
+ * best scores in decreasing order of score, with ties broken by
+ * index.  Returns the number of indices written */
+int SelectTopScores(int n, const float *scores, int k, int *top);
+
+/* Hash len bytes of descriptors */
+unsigned long long HashDescriptors(const unsigned char *desc, 
+                                   unsigned long len);
+
+/* Mutable state for scoring one image against a tree: the query
+ * vector (the score of each visual word, and the words with a
+ * non-zero score) and scratch space for ranking the database images.
+ * The tree itself is read-only during a query, so several queries
+ * can be scored against one tree at the same time, each with its own
+ * context */
+class VocabQueryContext {
+public:
+    VocabQueryContext() { }
+
+    /* Size the score table for a tree with num_nodes nodes and reset
+     * the scores of the words touched by the previous image */
+    void Reset(unsigned long num_nodes);
+
+    /* Find the k best of the n database scores (see SelectTopScores).
+     * On return, m_top holds their image indices, best first.
+     * Returns the number of indices found */
+    int SelectTopScores(int n, const float *scores, int k);
+
+    /* Accumulate a weight to the score of the word with the given id */
+    void AddScore(unsigned long id, float weight) {
+        if (m_scores[id] == 0.0 && weight != 0.0)
+            m_touched.push_back(id);
+        m_scores[id] += weight;
+    }
+
+    /* Member variables */
+    std::vector<float> m_scores;          /* Score of each word, by id */
+    std::vector<unsigned long> m_touched; /* Words with a non-zero score */
+    std::vector<int> m_top;               /* Best images of the query */
+    std::vector<const VocabTreeLeaf *> m_leaves; /* Leaves of a batch */
+    std::vector<int> m_batch;             /* Scratch space for a batch */
+    std::vector<int> m_starts;            /* Per level of a batch: where
+                                           * each child's share starts */
+    std::vector<unsigned long> m_dists;   /* Distances to the children */
+};
+
 /* Abstract class for a node of the vocabulary tree */
 class VocabTreeNode {
 public:
@@ -93,30 +176,67 @@ public:
      *   depth_curr : current depth
      *   bf     : branching factor of the tree (children per node)
      *   restarts   : number of random restarts during clustering
-     *   v      : list of arrays representing the features
+     *   v      : the features (reordered by cluster on return)
      *
      *   means      : work array for storing means that get passed to kmeans
      *   clustering : work array for storing clustering in kmeans
+     *   seed       : random seed for the kmeans at this node (each
+     *                child derives its own, so the tree does not
+     *                depend on the order the subtrees are built in)
+     *   options    : options passed to kmeans
+     *   stats      : the work done by kmeans is added to this
+     *   checkpoint : if not NULL, the clusterings above its level are
+     *                restored from it or saved to it, and so are the
+     *                subtrees at its level
+     *
+     * Inside a parallel region, each child subtree is built as a
+     * separate task with its own work arrays
      */
     virtual int BuildRecurse(int n, int dim, int depth, int depth_curr, 
-                             int bf, int restarts, unsigned char **v,
-                             double *means, unsigned int *clustering) = 0;
-
-    /* Push a feature down to a leaf of the tree, and accumulate it to
-     * the score of that leaf.  Optionally, add the feature to the
-     * inverted file.
+                             int bf, int restarts, VectorSet v,
+                             double *means, unsigned int *clustering,
+                             unsigned int seed, const KMeansOptions &options,
+                             kmeans_stats_t *stats, 
+                             VocabTreeCheckpoint *checkpoint) = 0;
+
+    /* Push a feature down to a leaf of the tree, and accumulate the
+     * weight of that leaf to its score in a query context.
      * 
      * Inputs: 
-     *   v     : array containing the feature descriptor
-     *   index : index of the image that this feature belongs to
-     *   bf    : branch factor of the tree
-     *   dim   : dimensionality of the tree
-     *   add   : should this feature be added to the inverted file?
+     *   v       : array containing the feature descriptor
+     *   bf      : branch factor of the tree
+     *   dim     : dimensionality of the tree
+     *   ctx     : context holding the scores of the current image
+     *
+     * Return value : the leaf the feature was assigned to
      */
-    virtual unsigned long PushAndScoreFeature(unsigned char *v, 
-                                              unsigned int index, 
-                                              int bf, int dim,
-                                              bool add = true) = 0;
+    virtual const VocabTreeLeaf *
+        PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                            VocabQueryContext &ctx) const = 0;
+
+    /* Push a batch of features down the tree together: each node
+     * compares its children against all the features that reach it
+     * at once, then passes each child its share of the batch.  Finds
+     * the same leaves as PushAndScoreFeature.
+     *
+     * Inputs:
+     *   bf      : branch factor of the tree
+     *   dim     : dimensionality of the tree
+     *   n       : number of features that reach this node
+     *   v       : array of all the descriptors of the batch
+     *   idx     : indices (into v) of the features that reach this
+     *             node; reordered by the call
+     *   tmp     : scratch space of 2*n entries
+     *   depth_curr : depth of this node
+     *   ctx     : holds the remaining scratch space, grown as needed
+     *
+     * Outputs:
+     *   ctx.m_leaves : ctx.m_leaves[idx[i]] is set to the leaf of each
+     *                  feature
+     */
+    virtual void PushFeatureBatch(int bf, int dim, int n, unsigned char *v,
+                                  int *idx, int *tmp, int depth_curr,
+                                  VocabQueryContext &ctx) const = 0;
 
     /* Update the counts in an inverted file associated with a visual
      * word 
@@ -129,19 +249,6 @@ public:
     virtual int AddFeatureToInvertedFile(unsigned int index, 
                                          int bf, int dim) = 0;
 
-    /* Given a set of previously pushed features, fill a query array
-     * of size num_nodes with the bag-of-words vector entries 
-     * 
-     * Inputs:
-     *   bf      : branching factor of the tree
-     *   mag_inv : inverse magnitude of the BoW vector
-     *   
-     * Outputs:
-     *   q       : array of size num_nodes storing the BoW vector on exit
-     */
-    virtual int FillQueryVector(float *q, int bf, double mag_inv)
-        { return 0; }
-
     /* Given a query BoW vector, compute its similarity to all the
      * database vectors using the inverted file stored in the tree 
      *
@@ -177,8 +284,6 @@ public:
                                 VocabTreeNode **leaves) = 0;
 
     /* Functions for normalizing the database vectors */
-    virtual double ComputeDatabaseVectorMagnitude(int bf, DistanceType dtype) 
-        { return 0; }
     virtual int NormalizeDatabase(int bf, int start_index, 
                                   std::vector<float> &mags)
         { return 0; }
@@ -192,11 +297,10 @@ public:
         { return 0; }
     virtual unsigned long ComputeIDs(int bf, unsigned long id) 
         { return 0; }        
+    virtual void IndexChildren(int bf) { }
     virtual unsigned long CountNodes(int bf) const = 0;
     virtual unsigned long CountLeaves(int bf) const = 0;
     virtual double CountFeatures(int bf) = 0;
-    virtual int ClearScores(int bf)
-        { return 0; }
     virtual int ClearDatabase(int bf)
         { return 0; }
     virtual int SetInteriorNodeWeight(int bf, float weight)
@@ -212,6 +316,26 @@ public:
 
     virtual int GetMaxDatabaseImageIndex(int bf) const
         { return 0; }
+
+    /* Functions for moving the inverted files into a
+     * VocabInvertedIndex.  CountPostings stores the length of each
+     * posting list in counts[id+1]; MovePostings copies the lists
+     * into the index and releases the per-leaf storage */
+    virtual void CountPostings(int bf, unsigned long *counts) const
+        { }
+    virtual void MovePostings(int bf, VocabInvertedIndex &index)
+        { }
+
+    /* Fill the tables of a mapped database file (see
+     * VocabTreeMapIO.cpp), indexed by node id:
+     *   desc     : node descriptors (dim bytes per node)
+     *   weights  : leaf weights
+     *   rows     : row of the node in the child table (-1 for leaves)
+     *   children : child table, bf node ids per row (-1 if empty)
+     *   next_row : next free row of the child table */
+    virtual void FillMapTables(int bf, int dim, unsigned char *desc, 
+                               float *weights, int *rows, int *children,
+                               int &next_row) const = 0;
         
     /* Member variables */
     unsigned char *m_desc; /* Descriptor for this node */
@@ -221,7 +345,9 @@ public:
 /* Class representing an interior node of the vocab tree */
 class VocabTreeInteriorNode : public VocabTreeNode {
 public:
-    VocabTreeInteriorNode() : VocabTreeNode(), m_children(NULL) { }
+    VocabTreeInteriorNode() : VocabTreeNode(), m_children(NULL), 
+                              m_num_children(0), m_child_desc(NULL),
+                              m_child_slot(NULL) { }
     virtual ~VocabTreeInteriorNode() { };
 
     virtual int Read(FILE *f, int bf, int dim);
@@ -232,13 +358,18 @@ public:
     virtual void Clear(int bf);
 
     virtual int BuildRecurse(int n, int dim, int depth, int depth_curr, 
-                             int bf, int restarts, unsigned char **v,
-                             double *means, unsigned int *clustering);
-
-    virtual unsigned long PushAndScoreFeature(unsigned char *v, 
-                                              unsigned int index, 
-                                              int bf, int dim,
-                                              bool add = true);
+                             int bf, int restarts, VectorSet v,
+                             double *means, unsigned int *clustering,
+                             unsigned int seed, const KMeansOptions &options,
+                             kmeans_stats_t *stats, 
+                             VocabTreeCheckpoint *checkpoint);
+
+    virtual const VocabTreeLeaf *
+        PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                            VocabQueryContext &ctx) const;
+    virtual void PushFeatureBatch(int bf, int dim, int n, unsigned char *v,
+                                  int *idx, int *tmp, int depth_curr,
+                                  VocabQueryContext &ctx) const;
 
     virtual int AddFeatureToInvertedFile(unsigned int index, 
                                          int bf, int dim) { return 0; }
@@ -256,26 +387,37 @@ public:
 
     virtual int PrintWeights(int depth_curr, int bf) const;
     virtual unsigned long ComputeIDs(int bf, unsigned long id);
+    virtual void IndexChildren(int bf);
     virtual unsigned long CountNodes(int bf) const;
     virtual unsigned long CountLeaves(int bf) const;
     virtual double CountFeatures(int bf);
-    virtual int ClearScores(int bf);
     virtual int NormalizeDatabase(int bf, int start_index, 
                                   std::vector<float> &mags);
-    virtual double ComputeDatabaseVectorMagnitude(int bf, DistanceType dtype);
     virtual int ComputeDatabaseMagnitudes(int bf, DistanceType dtype, 
                                           int start_index, 
                                           std::vector<float> &mags);
     
     virtual int ClearDatabase(int bf);
     virtual int SetConstantLeafWeights(int bf);
-    virtual int FillQueryVector(float *q, int bf, double mag_inv);
 
     virtual int Combine(VocabTreeNode *other, int bf);
     virtual int GetMaxDatabaseImageIndex(int bf) const;
 
+    virtual void CountPostings(int bf, unsigned long *counts) const;
+    virtual void MovePostings(int bf, VocabInvertedIndex &index);
+    virtual void FillMapTables(int bf, int dim, unsigned char *desc, 
+                               float *weights, int *rows, int *children,
+                               int &next_row) const;
+
     /* Member variables */
     VocabTreeNode **m_children; /* Array of child nodes */
+
+    /* The children that exist, for PushFeatureBatch: their
+     * descriptors and their slots in m_children.  Filled by
+     * IndexChildren once the tree is built or read */
+    int m_num_children;
+    const unsigned char **m_child_desc;
+    int *m_child_slot;
 };
 
 /* Class representing a leaf of the vocab tree.  Each leaf represents
@@ -283,7 +425,7 @@ public:
 class VocabTreeLeaf : public VocabTreeNode
 {
 public:
-    VocabTreeLeaf() : VocabTreeNode(), m_score(0.0), m_weight(1.0) { }
+    VocabTreeLeaf() : VocabTreeNode(), m_weight(1.0) { }
     virtual ~VocabTreeLeaf() { };
 
     /* I/O functions */
@@ -295,18 +437,22 @@ public:
     virtual void Clear(int bf);
 
     virtual int BuildRecurse(int n, int dim, int depth, int depth_curr, 
-                             int bf, int restarts, unsigned char **v,
-                             double *means, unsigned int *clustering);
-
-    virtual unsigned long PushAndScoreFeature(unsigned char *v, 
-                                              unsigned int index, 
-                                              int bf, int dim,
-                                              bool add = true);
+                             int bf, int restarts, VectorSet v,
+                             double *means, unsigned int *clustering,
+                             unsigned int seed, const KMeansOptions &options,
+                             kmeans_stats_t *stats, 
+                             VocabTreeCheckpoint *checkpoint);
+
+    virtual const VocabTreeLeaf *
+        PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                            VocabQueryContext &ctx) const;
+    virtual void PushFeatureBatch(int bf, int dim, int n, unsigned char *v,
+                                  int *idx, int *tmp, int depth_curr,
+                                  VocabQueryContext &ctx) const;
 
     virtual int ScoreQuery(float *q, int bf, DistanceType dtype, 
                            float *scores);
     virtual int AddFeatureToInvertedFile(unsigned int index, int bf, int dim);
-    virtual int FillQueryVector(float *q, int bf, double mag_inv);
 
     virtual double ComputeTFIDFWeights(int bf, double n);
 
@@ -316,12 +462,10 @@ public:
                                     int start_index, int bf, int dim) const;
     virtual void PopulateLeaves(int bf, int dim, VocabTreeNode **leaves);
 
-    virtual double ComputeDatabaseVectorMagnitude(int bf, DistanceType dtype);
     virtual int ComputeDatabaseMagnitudes(int bf, DistanceType dtype, 
                                           int start_index, 
                                           std::vector<float> &mags);
 
-    virtual int ClearScores(int bf);
     virtual int ClearDatabase(int bf);
 
     virtual int SetInteriorNodeWeight(int bf, float weight);
@@ -342,8 +486,13 @@ public:
     virtual int Combine(VocabTreeNode *other, int bf);
     virtual int GetMaxDatabaseImageIndex(int bf) const;
 
+    virtual void CountPostings(int bf, unsigned long *counts) const;
+    virtual void MovePostings(int bf, VocabInvertedIndex &index);
+    virtual void FillMapTables(int bf, int dim, unsigned char *desc, 
+                               float *weights, int *rows, int *children,
+                               int &next_row) const;
+
     /* Member variables */
-    float m_score;   /* Current, temporary score for the current image */
     float m_weight;  /* Weight for this visual word */
     std::vector<ImageCount> m_image_list;  /* Images that contain this word */
 };
@@ -352,19 +501,49 @@ public:
 class VocabTreeFlatNode : public VocabTreeInteriorNode
 {
 public:
-    VocabTreeFlatNode() : VocabTreeInteriorNode()
+    VocabTreeFlatNode() : VocabTreeInteriorNode(), m_tree(NULL)
     { }
 
-    virtual unsigned long PushAndScoreFeature(unsigned char *v, 
-                                              unsigned int index, 
-                                              int bf, int dim, 
-                                              bool add = true);
+    virtual const VocabTreeLeaf *
+        PushAndScoreFeature(unsigned char *v, int bf, int dim, 
+                            VocabQueryContext &ctx) const;
+    virtual void PushFeatureBatch(int bf, int dim, int n, unsigned char *v,
+                                  int *idx, int *tmp, int depth_curr,
+                                  VocabQueryContext &ctx) const;
 
     void BuildANNTree(int num_leaves, int dim);
 
+    /* Read a search tree written by WriteANNTree instead of building
+     * it.  Fails (returning -1) if the file is missing or was written
+     * for different leaf descriptors */
+    int ReadANNTree(const char *filename, int num_leaves, int dim);
+    int WriteANNTree(const char *filename, int num_leaves, int dim) const;
+
     ann_1_1_char::ANNkd_tree *m_tree; /* For finding nearest neighbors */
 };
 
+/* Storage owned by a tree that was read from a mapped database file.
+ * The descriptors and the inverted index point into the mapping, and
+ * the nodes are allocated in pools */
+class VocabTreeMapping {
+public:
+    VocabTreeMapping() : m_base(NULL), m_size(0), m_interiors(NULL),
+                         m_leaves(NULL), m_children(NULL), 
+                         m_child_desc(NULL), m_child_slot(NULL) { }
+
+    void *m_base;                        /* Start of the mapped file */
+    unsigned long m_size;                /* Size of the mapped file */
+    VocabTreeInteriorNode *m_interiors;  /* Pool of interior nodes */
+    VocabTreeLeaf *m_leaves;             /* Pool of leaves */
+    VocabTreeNode **m_children;          /* Pool of child arrays */
+    const unsigned char **m_child_desc;  /* Pools of the child indexes */
+    int *m_child_slot;
+};
+
+/* Map (or, on Windows, read) a whole file into memory, and release it */
+void *MapFile(const char *filename, unsigned long &size_out);
+void UnmapFile(void *base, unsigned long size);
+
 class VocabTree {
 public:
     VocabTree() : m_database_images(0), m_branch_factor(0),
@@ -373,7 +552,16 @@ public:
                   m_root(NULL){ }
 
     /* I/O routines */
+    /* Read a tree or database, in either the tree format written by
+     * Write or the mapped format written by WriteMapped */
     int Read(const char *filename);
+    /* Map a database written by WriteMapped into memory.  The
+     * descriptors and inverted index are used in place, so the tree
+     * is finalized on return */
+    int ReadMapped(const char *filename);
+    /* Write a finalized database in the mapped format */
+    int WriteMapped(const char *filename) const;
+    bool IsMapped() const { return m_mapping.m_base != NULL; }
     int WriteHeader(FILE *f) const;
     int Write(const char *filename) const;
     int WriteFlat(const char *filename) const;
@@ -381,7 +569,10 @@ public:
     int WriteDatabaseVectors(const char *filename, 
                              int start_index, int num_vectors) const;
 
-    int Flatten(); /* Flatten the tree to a single level */
+    /* Flatten the tree to a single level.  If search_tree is given,
+     * the search structure for the flat level is read from that file
+     * when it is valid, and otherwise built and written there */
+    int Flatten(const char *search_tree = NULL);
 
     /* Build the vocabulary tree using kmeans 
      *
@@ -391,21 +582,56 @@ public:
      *  depth    : total depth of the tree to create
      *  bf       : desired branching factor of the tree (children per node)
      *  restarts : number of random restarts during clustering
-     *  vp       : array of pointers to arrays representing the features
+     *  data     : the features, packed one after another (e.g., in
+     *             memory or in a training file mapped with 
+     *             VocabTrainingSet::Map).  Only a 32-bit index per
+     *             feature is allocated, so data may be larger than RAM
+     *  options  : options for the kmeans at each node
+     *
+     *  checkpoint : if not NULL, progress is saved to it as the tree
+     *             is built, and restored from it if it was resumed
+     *             (see VocabTreeCheckpoint)
+     *
+     * Output:
+     *  stats    : if not NULL, the work done by kmeans over all nodes
      */
     int Build(int n, int dim, int depth, int bf, int restarts, 
-              unsigned char **vp);
+              const unsigned char *data, 
+              const KMeansOptions &options = KMeansOptions(),
+              kmeans_stats_t *stats = NULL,
+              VocabTreeCheckpoint *checkpoint = NULL);
 
     /* Push a feature down to a leaf of the tree, and accumulate it to
-     * the score of that leaf.  Optionally, add the feature to the
-     * inverted file.  Recursively calls PushAndScoreFeature
+     * the score of that leaf in a query context.  Recursively calls
+     * PushAndScoreFeature
      * 
      * Inputs: 
      *   v     : array containing the feature descriptor
-     *   index : index of the image that this feature belongs to
-     *   add   : should this feature be added to the inverted file?
+     *   ctx   : context holding the scores of the current image
+     *
+     * Return value : id of the leaf (visual word) of the feature
+     */
+    unsigned long PushAndScoreFeature(unsigned char *v, 
+                                      VocabQueryContext &ctx) const;
+
+    /* Find the visual word (leaf id) of each of n descriptors, pushing
+     * them down the tree together with PushFeatureBatch.  Gives the
+     * same ids as pushing the features one at a time.
+     *
+     * Inputs:
+     *   n        : number of feature descriptors
+     *   v        : array of descriptors, concatenated into one big
+     *              array of length n*dim
+     *
+     * Outputs:
+     *   word_ids : at exit, the word id of each descriptor
      */
-    int PushAndScoreFeature(unsigned char *v, unsigned int index, bool add);
+    int QuantizeBatch(int n, unsigned char *v, 
+                      unsigned long *word_ids) const;
+    /* Same as above, but leaves the leaf of each descriptor in
+     * ctx.m_leaves */
+    int QuantizeBatch(int n, unsigned char *v, 
+                      VocabQueryContext &ctx) const;
 
     /* Add an image to the database.
      *
@@ -441,6 +667,23 @@ public:
      */
     double ScoreQueryKeys(int n, bool normalize, unsigned char *v, 
                           float *scores);
+    /* Same as above, but uses the given context for the query vector.
+     * Calls with different contexts can run concurrently */
+    double ScoreQueryKeys(int n, bool normalize, unsigned char *v, 
+                          float *scores, VocabQueryContext &ctx) const;
+
+    /* Move the per-leaf inverted files into a compact, read-only
+     * inverted index that is used for scoring queries.  Call this
+     * once the database is complete (after ComputeTFIDFWeights and
+     * NormalizeDatabase).  The database can no longer be modified or
+     * written in the tree format afterwards.  Until then, queries are
+     * scored from the inverted files of the leaves, which is slower */
+    int FinalizeDatabase();
+    bool IsFinalized() const { return !m_index.IsEmpty(); }
+
+    /* Sort the touched words of a context by id and compute the
+     * magnitude of its BoW vector */
+    double ComputeContextMagnitude(VocabQueryContext &ctx) const;
 
     /* Empty out the database */
     int ClearDatabase();
@@ -461,6 +704,7 @@ public:
 
     /* Destroy this tree */
     int Clear();
+    int ClearMapped();
     
     /* Member variables */
     int m_database_images;         /* Number of images in the database */
@@ -470,6 +714,13 @@ public:
     unsigned long m_num_nodes;     /* Number of nodes in the tree */
     DistanceType m_distance_type;  /* Type of the distance measure */
     VocabTreeNode *m_root;         /* Root of the tree */
+
+    /* Context for AddImageToDatabase and single-threaded scoring */
+    VocabQueryContext m_context;
+    /* Inverted index built by FinalizeDatabase */
+    VocabInvertedIndex m_index;
+    /* Storage for a tree read with ReadMapped */
+    VocabTreeMapping m_mapping;
 };
 
 #endif /* __vocab_tree_h__ */
@@ -38,28 +38,33 @@
 /* Routines for building a vocab tree */
 
 #include "VocabTree.h"
+#include "VocabTreeCheckpoint.h"
 #include "kmeans.h"
 #include "util.h"
 
-int VocabTreeLeaf::BuildRecurse(int n, int dim, int depth, 
-                                int depth_curr, int bf, 
-                                int restarts, unsigned char **v,
-                                double *means, unsigned int *clustering)
+/* Derive the kmeans seed of child i from the seed of its parent */
+static unsigned int ChildSeed(unsigned int seed, int i)
 {
-    /* Nothing to do on the bottom level, everything was taken care of
-     * above us */
-    return 0;
+    unsigned int h = seed ^ (0x9e3779b9u * (unsigned int) (i + 1));
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
 }
 
-int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth, 
-                                        int depth_curr, int bf, 
-                                        int restarts, unsigned char **v,
-                                        double *means, 
-                                        unsigned int *clustering)
+/* Cluster the features of a node with kmeans, creating its children
+ * and counting the features of each, and reorder the features by
+ * cluster */
+static void ClusterNode(int n, int dim, int depth, int depth_curr, int bf,
+                        int restarts, VectorSet v, double *means,
+                        unsigned int *clustering, unsigned int seed,
+                        const KMeansOptions &options, kmeans_stats_t *stats,
+                        const unsigned char *desc, VocabTreeNode **children,
+                        int *counts)
 {
-    if (depth_curr > depth)
-        return 0;
-
     if (depth_curr < 2) {
         for (int i = 0; i < depth_curr; i++) 
             printf(" ");
@@ -69,16 +74,20 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
         fflush(stdout);
     }
 
-    /* Allocate the children for this node */
-    m_children = new VocabTreeNode *[bf];
-
     /* Run k-means */
-    double error = kmeans(n, dim, bf, restarts, v, means, clustering);
+    kmeans_stats_t kmeans_stats = { 0, 0 };
+    double error = kmeans(n, dim, bf, restarts, v, means, clustering, seed,
+                          options, &kmeans_stats);
+
+#pragma omp atomic
+    stats->rounds += kmeans_stats.rounds;
+#pragma omp atomic
+    stats->batches += kmeans_stats.batches;
 
     double error_means = 0.0;
     for (int i = 0; i < bf; i++) {
         for (int j = 0; j < dim; j++) {
-            double d = means[i * dim + j] - m_desc[j];
+            double d = means[i * dim + j] - desc[j];
             error_means += d * d;
         }
     }
@@ -93,8 +102,6 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
         fflush(stdout);
     }
 
-    int *counts = new int[bf];
-    
     for (int i = 0; i < bf; i++) {
         counts[i] = 0;
     }
@@ -107,30 +114,30 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
     for (int i = 0; i < bf; i++) {
         if (counts[i] > 0) {
             if (depth_curr == depth || counts[i] <= 2 * bf) {
-                m_children[i] = new VocabTreeLeaf();
+                children[i] = new VocabTreeLeaf();
             } else {
-                m_children[i] = new VocabTreeInteriorNode();
+                children[i] = new VocabTreeInteriorNode();
             }
 
-            m_children[i]->m_desc = new unsigned char[dim];
+            children[i]->m_desc = new unsigned char[dim];
 
             for (int j = 0; j < dim; j++) {
-                m_children[i]->m_desc[j] = iround(means[i * dim + j]);
+                children[i]->m_desc[j] = iround(means[i * dim + j]);
             }
         } else {
-            m_children[i] = NULL;
+            children[i] = NULL;
         }
     }
 
     if (depth_curr < depth) {
-        /* Reorder the pointers to the vectors */
+        /* Reorder the indices of the vectors by cluster */
         int idx = 0;
         for (int i = 0; i < bf; i++) {
             for (int j = 0; j < n; j++) {
                 if ((int) clustering[j] == i) {
-                    unsigned char *v_tmp = v[idx];
-                    v[idx] = v[j];
-                    v[j] = v_tmp;
+                    unsigned int v_tmp = v.m_idx[idx];
+                    v.m_idx[idx] = v.m_idx[j];
+                    v.m_idx[j] = v_tmp;
 
                     unsigned int tmp = clustering[idx];
                     clustering[idx] = clustering[j];
@@ -140,13 +147,117 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
                 }
             }
         }
-    
+    }
+}
+
+int VocabTreeLeaf::BuildRecurse(int n, int dim, int depth, 
+                                int depth_curr, int bf, 
+                                int restarts, VectorSet v,
+                                double *means, unsigned int *clustering,
+                                unsigned int seed, 
+                                const KMeansOptions &options, 
+                                kmeans_stats_t *stats,
+                                VocabTreeCheckpoint *checkpoint)
+{
+    /* Nothing to do on the bottom level, everything was taken care of
+     * above us */
+    return 0;
+}
+
+int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth, 
+                                        int depth_curr, int bf, 
+                                        int restarts, VectorSet v,
+                                        double *means, 
+                                        unsigned int *clustering,
+                                        unsigned int seed,
+                                        const KMeansOptions &options,
+                                        kmeans_stats_t *stats,
+                                        VocabTreeCheckpoint *checkpoint)
+{
+    if (depth_curr > depth)
+        return 0;
+
+    /* Allocate the children for this node */
+    m_children = new VocabTreeNode *[bf];
+    int *counts = new int[bf];
+
+    /* Above the checkpoint level, a saved clustering replaces the
+     * kmeans (and leaves v in the order it had after it) */
+    bool saved = (checkpoint != NULL && depth_curr < checkpoint->Level());
+    bool restored = saved && 
+        checkpoint->LoadSplit(depth_curr, v, n, bf, dim, m_children, counts);
+
+    if (!restored) {
+        ClusterNode(n, dim, depth, depth_curr, bf, restarts, v, means, 
+                    clustering, seed, options, stats, m_desc, m_children, 
+                    counts);
+
+        if (saved) 
+            checkpoint->SaveSplit(depth_curr, v, n, bf, dim, m_children, 
+                                  counts);
+    }
+
+    if (depth_curr < depth) {
+        /* Build each child subtree as a task with its own work
+         * arrays.  The children work on disjoint ranges of v, and
+         * nothing below needs the work arrays of this node, so the
+         * tasks are not waited on here; whoever started the build
+         * waits for all of them.  Outside of a parallel region the
+         * tasks simply run in order */
         int off = 0;
         for (int i = 0; i < bf; i++) {
+            /* Subtrees at the checkpoint level are saved once all of
+             * their tasks are done, or restored if they were saved */
+            bool checkpointed = (checkpoint != NULL && 
+                                 depth_curr + 1 == checkpoint->Level() &&
+                                 counts[i] > 2 * bf);
+
+            if (checkpointed) {
+                VocabTreeNode *subtree = 
+                    checkpoint->LoadSubtree(depth_curr + 1, v + off, bf, dim);
+
+                if (subtree != NULL) {
+                    m_children[i]->Clear(bf);
+                    delete m_children[i];
+                    m_children[i] = subtree;
+                    off += counts[i];
+                    continue;
+                }
+            }
+
             if (m_children[i] != NULL) {
-                m_children[i]->BuildRecurse(counts[i], dim, depth, depth_curr + 1,
-                                            bf, restarts, v + off, means, 
-                                            clustering);
+                VocabTreeNode *child = m_children[i];
+                int count = counts[i];
+                VectorSet v_child = v + off;
+                unsigned int seed_child = ChildSeed(seed, i);
+
+#pragma omp task firstprivate(child, count, v_child, seed_child, \
+                              checkpointed)
+                {
+                    double *means_child = new double[bf * dim];
+                    unsigned int *clustering_child = new unsigned int[count];
+
+                    if (checkpointed) {
+#pragma omp taskgroup
+                        child->BuildRecurse(count, dim, depth, depth_curr + 1,
+                                            bf, restarts, v_child, 
+                                            means_child, clustering_child, 
+                                            seed_child, options, stats,
+                                            checkpoint);
+
+                        checkpoint->SaveSubtree(depth_curr + 1, v_child, 
+                                                bf, dim, child);
+                    } else {
+                        child->BuildRecurse(count, dim, depth, depth_curr + 1,
+                                            bf, restarts, v_child, 
+                                            means_child, clustering_child, 
+                                            seed_child, options, stats,
+                                            checkpoint);
+                    }
+
+                    delete [] means_child;
+                    delete [] clustering_child;
+                }
             }
 
             off += counts[i];
@@ -159,12 +270,17 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
 }
 
 int VocabTree::Build(int n, int dim, int depth, int bf, int restarts, 
-                     unsigned char **vp)
+                     const unsigned char *data, 
+                     const KMeansOptions &options,
+                     kmeans_stats_t *stats, 
+                     VocabTreeCheckpoint *checkpoint)
 {
     printf("[VocabTree::Build] Building tree from %d features\n", n);
     printf("[VocabTree::Build]   with depth %d, branching factor %d\n", 
            depth, bf);
     printf("[VocabTree::Build]   and restarts %d\n", restarts);
+    printf("[VocabTree::Build]   seeding with %s\n", 
+           options.init == KMeansInitPlusPlus ? "k-means++" : "random");
     fflush(stdout);
 
     m_depth = depth;
@@ -184,19 +300,57 @@ int VocabTree::Build(int n, int dim, int depth, int bf, int restarts,
         exit(-1);
     }
 
+    /* The features are referred to by index from here on */
+    unsigned int *idx = new unsigned int[n];
+    for (int i = 0; i < n; i++)
+        idx[i] = i;
+
+    VectorSet v(data, idx, dim);
+
+    /* The seed for the whole tree comes from rand(), so srand still
+     * controls the result */
+    unsigned int seed = (unsigned int) rand();
+    kmeans_stats_t total = { 0, 0 };
+
+    if (checkpoint != NULL && 
+        checkpoint->Begin(n, dim, depth, bf, restarts, options, seed, 
+                          data, idx) != 0) {
+        delete [] idx;
+        delete [] means;
+        delete [] clustering;
+        return -1;
+    }
+
     m_root = new VocabTreeInteriorNode();
     m_root->m_desc = new unsigned char[dim];
     for (int i = 0; i < dim; i++) 
         m_root->m_desc[i] = 0;
-    
-    m_root->BuildRecurse(n, dim, depth, 0, bf, restarts, 
-                         vp, means, clustering);
 
-    delete [] vp;
-    delete means;
-    delete clustering;
+    /* Subtrees are built as tasks by the threads of this team.  The
+     * implicit barrier at the end of the region waits for all of
+     * them */
+#pragma omp parallel
+    {
+#pragma omp single
+        m_root->BuildRecurse(n, dim, depth, 0, bf, restarts, 
+                             v, means, clustering, seed, 
+                             options, &total, checkpoint);
+    }
+
+    m_root->ComputeIDs(m_branch_factor, 0);
+    m_root->IndexChildren(m_branch_factor);
+    m_num_nodes = CountNodes();
+
+    delete [] idx;
+    delete [] means;
+    delete [] clustering;
+
+    if (stats != NULL)
+        *stats = total;
 
-    printf("[VocabTree::Build] Finished building tree.\n");
+    printf("[VocabTree::Build] Finished building tree "
+           "(%ld Lloyd rounds, %ld mini-batch iterations).\n", 
+           total.rounds, total.batches);
     fflush(stdout);
 
     return 0;
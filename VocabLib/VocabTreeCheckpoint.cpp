@@ -0,0 +1,436 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+
+/* VocabTreeCheckpoint.cpp */
+/* Saving and restoring the progress of VocabTree::Build */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "defines.h"
+#include "VocabTree.h"
+#include "VocabTreeCheckpoint.h"
+
+#define VOCAB_CHECKPOINT_MAGIC "VTCKPT02"
+
+/* Parameters of the build, at the start of the file */
+typedef struct {
+    char magic[8];
+    int n, dim, depth, bf, restarts, level;
+    unsigned int seed;
+    int init, assign, max_pts_visit, forest_trees;
+    int parallel_restarts, prune_rounds;
+    int batch_size, batch_iterations;
+    double prune_margin, index_drift;
+    unsigned long long desc_hash;  /* Hash of the training features */
+} checkpoint_header_t;
+
+/* Hash the n features of the build, in blocks hashed in parallel and
+ * then combined in order */
+static unsigned long long HashFeatures(const unsigned char *data, int n, 
+                                       int dim)
+{
+    const unsigned long block_size = 1 << 20;
+    unsigned long len = (unsigned long) n * dim;
+    long num_blocks = (long) ((len + block_size - 1) / block_size);
+
+    std::vector<unsigned long long> hashes(num_blocks + 1, 0);
+
+#pragma omp parallel for
+    for (long b = 0; b < num_blocks; b++) {
+        unsigned long start = (unsigned long) b * block_size;
+        unsigned long end = MIN(start + block_size, len);
+        hashes[b] = HashDescriptors(data + start, end - start);
+    }
+
+    return HashDescriptors((const unsigned char *) &hashes[0], 
+                           sizeof(unsigned long long) * num_blocks);
+}
+
+/* Each record is a header followed by len bytes of payload.  A split
+ * ('N') holds, for each child, a flag (0 -- none, 1 -- leaf, 2 --
+ * interior) and its descriptor, then the counts of the children and
+ * the order of the node's features.  A subtree ('S') is in the tree
+ * format */
+typedef struct {
+    char type;
+    char pad[7];
+    unsigned long long key;
+    long long len;
+} checkpoint_record_t;
+
+int VocabTreeCheckpoint::Create(const char *filename, int level)
+{
+    Close();
+
+    m_file = fopen(filename, "w+b");
+    if (m_file == NULL) {
+        printf("[VocabTreeCheckpoint::Create] Error opening file %s for "
+               "writing\n", filename);
+        return -1;
+    }
+
+    m_level = level < 1 ? 1 : level;
+    m_resuming = false;
+
+    return 0;
+}
+
+int VocabTreeCheckpoint::Resume(const char *filename)
+{
+    Close();
+
+    m_file = fopen(filename, "r+b");
+    if (m_file == NULL) {
+        printf("[VocabTreeCheckpoint::Resume] Error opening file %s\n",
+               filename);
+        return -1;
+    }
+
+    checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, m_file) != 1 ||
+        memcmp(header.magic, VOCAB_CHECKPOINT_MAGIC, 8) != 0) {
+        printf("[VocabTreeCheckpoint::Resume] Error: %s is not a "
+               "checkpoint file\n", filename);
+        Close();
+        return -1;
+    }
+
+    fseek(m_file, 0, SEEK_END);
+    long long size = ftell(m_file);
+
+    /* Index the complete records */
+    long long pos = sizeof(header);
+    checkpoint_record_t record;
+    while (fseek(m_file, pos, SEEK_SET) == 0 &&
+           fread(&record, sizeof(record), 1, m_file) == 1) {
+        long long payload = pos + sizeof(record);
+        if (record.len < 0 || payload + record.len > size)
+            break;
+
+        if (record.type == 'N')
+            m_splits[record.key] = payload;
+        else if (record.type == 'S')
+            m_subtrees[record.key] = payload;
+        else 
+            break;
+
+        pos = payload + record.len;
+    }
+
+    if (pos < size) {
+        printf("[VocabTreeCheckpoint::Resume] Discarding %lld bytes of "
+               "an incomplete record\n", size - pos);
+        fflush(m_file);
+#ifndef WIN32
+        if (ftruncate(fileno(m_file), pos) != 0) {
+            printf("[VocabTreeCheckpoint::Resume] Error truncating file "
+                   "%s\n", filename);
+            Close();
+            return -1;
+        }
+#endif
+    }
+
+    printf("[VocabTreeCheckpoint::Resume] Restoring %d clusterings and "
+           "%d subtrees\n", (int) m_splits.size(), (int) m_subtrees.size());
+
+    m_level = header.level;
+    m_resuming = true;
+
+    return 0;
+}
+
+void VocabTreeCheckpoint::Close()
+{
+    if (m_file != NULL)
+        fclose(m_file);
+
+    m_file = NULL;
+    m_level = 0;
+    m_resuming = false;
+    m_idx = NULL;
+    m_splits.clear();
+    m_subtrees.clear();
+}
+
+int VocabTreeCheckpoint::Begin(int n, int dim, int depth, int bf,
+                               int restarts, const KMeansOptions &options,
+                               unsigned int &seed, 
+                               const unsigned char *data,
+                               const unsigned int *idx)
+{
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VOCAB_CHECKPOINT_MAGIC, 8);
+    header.n = n;
+    header.dim = dim;
+    header.depth = depth;
+    header.bf = bf;
+    header.restarts = restarts;
+    header.level = m_level;
+    header.seed = seed;
+    header.init = (int) options.init;
+    header.assign = (int) options.assign;
+    header.max_pts_visit = options.max_pts_visit;
+    header.forest_trees = options.forest_trees;
+    header.parallel_restarts = options.parallel_restarts ? 1 : 0;
+    header.prune_rounds = options.prune_rounds;
+    header.batch_size = options.batch_size;
+    header.batch_iterations = options.batch_iterations;
+    header.prune_margin = options.prune_margin;
+    header.index_drift = options.index_drift;
+    header.desc_hash = HashFeatures(data, n, dim);
+
+    m_idx = idx;
+
+    if (m_resuming) {
+        checkpoint_header_t saved;
+        if (fseek(m_file, 0, SEEK_SET) != 0 ||
+            fread(&saved, sizeof(saved), 1, m_file) != 1) {
+            printf("[VocabTreeCheckpoint::Begin] Error reading checkpoint\n");
+            return -1;
+        }
+
+        header.seed = saved.seed;
+        if (memcmp(&header, &saved, sizeof(header)) != 0) {
+            printf("[VocabTreeCheckpoint::Begin] Error: the checkpoint is "
+                   "of a build with different features or parameters\n");
+            return -1;
+        }
+
+        seed = saved.seed;
+        return 0;
+    }
+
+    if (fseek(m_file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, m_file) != 1 || 
+        fflush(m_file) != 0) {
+        printf("[VocabTreeCheckpoint::Begin] Error writing checkpoint\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+unsigned long long VocabTreeCheckpoint::Key(int depth_curr, 
+                                            VectorSet v) const
+{
+    return ((unsigned long long) depth_curr << 40) | 
+        (unsigned long long) (v.m_idx - m_idx);
+}
+
+/* Append a record whose payload is either data or, if node is not
+ * NULL, the subtree at node.  The record is flushed to disk before
+ * returning, so a build killed at any point loses at most the
+ * records being written */
+int VocabTreeCheckpoint::WriteRecord(char type, unsigned long long key,
+                                     const void *data, long long len,
+                                     const VocabTreeNode *node, 
+                                     int bf, int dim)
+{
+    int error = 0;
+
+#pragma omp critical(vocab_checkpoint)
+    {
+        checkpoint_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.type = type;
+        record.key = key;
+        record.len = -1;
+
+        fseek(m_file, 0, SEEK_END);
+        long long pos = ftell(m_file);
+        fwrite(&record, sizeof(record), 1, m_file);
+
+        if (node != NULL)
+            node->Write(m_file, bf, dim);
+        else
+            fwrite(data, 1, len, m_file);
+
+        /* The length marks the record as complete */
+        fflush(m_file);
+        record.len = ftell(m_file) - pos - (long long) sizeof(record);
+        fseek(m_file, pos, SEEK_SET);
+        fwrite(&record, sizeof(record), 1, m_file);
+
+        error = (fflush(m_file) != 0 || ferror(m_file));
+#ifndef WIN32
+        fsync(fileno(m_file));
+#endif
+    }
+
+    if (error) {
+        printf("[VocabTreeCheckpoint::WriteRecord] Error writing "
+               "checkpoint\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int VocabTreeCheckpoint::SaveSplit(int depth_curr, VectorSet v, int n, 
+                                   int bf, int dim, 
+                                   VocabTreeNode * const *children,
+                                   const int *counts)
+{
+    size_t len = (size_t) bf * (1 + dim) + bf * sizeof(int) + 
+        (size_t) n * sizeof(unsigned int);
+    std::vector<unsigned char> buf(len);
+
+    unsigned char *p = &buf[0];
+    for (int i = 0; i < bf; i++, p += 1 + dim) {
+        if (children[i] == NULL) {
+            memset(p, 0, 1 + dim);
+        } else {
+            p[0] = (dynamic_cast<VocabTreeLeaf *>(children[i]) != NULL) ? 
+                1 : 2;
+            memcpy(p + 1, children[i]->m_desc, dim);
+        }
+    }
+
+    memcpy(p, counts, bf * sizeof(int));
+    p += bf * sizeof(int);
+    memcpy(p, v.m_idx, (size_t) n * sizeof(unsigned int));
+
+    return WriteRecord('N', Key(depth_curr, v), &buf[0], len, NULL, bf, dim);
+}
+
+bool VocabTreeCheckpoint::LoadSplit(int depth_curr, VectorSet v, int n, 
+                                    int bf, int dim, 
+                                    VocabTreeNode **children, int *counts)
+{
+    std::map<unsigned long long, long long>::const_iterator iter = 
+        m_splits.find(Key(depth_curr, v));
+
+    if (iter == m_splits.end())
+        return false;
+
+    size_t len = (size_t) bf * (1 + dim) + bf * sizeof(int) + 
+        (size_t) n * sizeof(unsigned int);
+    std::vector<unsigned char> buf(len);
+
+    bool ok;
+#pragma omp critical(vocab_checkpoint)
+    {
+        ok = (fseek(m_file, iter->second, SEEK_SET) == 0 &&
+              fread(&buf[0], 1, len, m_file) == len);
+    }
+
+    if (!ok) {
+        printf("[VocabTreeCheckpoint::LoadSplit] Error reading "
+               "checkpoint\n");
+        return false;
+    }
+
+    const unsigned char *p = &buf[0];
+    for (int i = 0; i < bf; i++, p += 1 + dim) {
+        if (p[0] == 0) {
+            children[i] = NULL;
+            continue;
+        }
+
+        if (p[0] == 1)
+            children[i] = new VocabTreeLeaf();
+        else
+            children[i] = new VocabTreeInteriorNode();
+
+        children[i]->m_desc = new unsigned char[dim];
+        memcpy(children[i]->m_desc, p + 1, dim);
+    }
+
+    memcpy(counts, p, bf * sizeof(int));
+    p += bf * sizeof(int);
+    memcpy(v.m_idx, p, (size_t) n * sizeof(unsigned int));
+
+    return true;
+}
+
+int VocabTreeCheckpoint::SaveSubtree(int depth_curr, VectorSet v, 
+                                     int bf, int dim,
+                                     const VocabTreeNode *node)
+{
+    return WriteRecord('S', Key(depth_curr, v), NULL, 0, node, bf, dim);
+}
+
+VocabTreeNode *VocabTreeCheckpoint::LoadSubtree(int depth_curr, 
+                                                VectorSet v, 
+                                                int bf, int dim)
+{
+    std::map<unsigned long long, long long>::const_iterator iter = 
+        m_subtrees.find(Key(depth_curr, v));
+
+    if (iter == m_subtrees.end())
+        return NULL;
+
+    VocabTreeNode *node = NULL;
+
+#pragma omp critical(vocab_checkpoint)
+    {
+        /* Read the interior flag */
+        char interior;
+        if (fseek(m_file, iter->second, SEEK_SET) == 0 &&
+            fread(&interior, sizeof(char), 1, m_file) == 1) {
+
+            if (interior == 1)
+                node = new VocabTreeInteriorNode();
+            else
+                node = new VocabTreeLeaf();
+
+            /* A subtree that cannot be read is rebuilt */
+            if (node->Read(m_file, bf, dim) != 0) {
+                node->Clear(bf);
+                delete node;
+                node = NULL;
+            }
+        }
+    }
+
+    if (node == NULL) {
+        printf("[VocabTreeCheckpoint::LoadSubtree] Error reading "
+               "checkpoint\n");
+    }
+
+    return node;
+}
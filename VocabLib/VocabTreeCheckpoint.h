@@ -0,0 +1,87 @@
+/* VocabTreeCheckpoint.h */
+/* Checkpoints of a vocabulary tree under construction */
+
+#ifndef __vocab_tree_checkpoint_h__
+#define __vocab_tree_checkpoint_h__
+
+#include <stdio.h>
+
+#include <map>
+
+#include "kmeans.h"
+
+class VocabTreeNode;
+
+/* A checkpoint file is a log of records appended while
+ * VocabTree::Build runs, so that an interrupted build can be resumed:
+ *
+ *   - the clustering of every interior node above the checkpoint
+ *     level: its children and the order of its features afterwards
+ *   - every finished subtree rooted at the checkpoint level, in the
+ *     tree format
+ *
+ * Nodes are identified by their depth and the offset of their
+ * features in the order of the whole build.  Since each node's
+ * clustering depends only on its features and its seed, a resumed
+ * build produces the same tree as an uninterrupted one */
+class VocabTreeCheckpoint {
+public:
+    VocabTreeCheckpoint() : m_file(NULL), m_level(0), m_resuming(false),
+                            m_idx(NULL) { }
+    ~VocabTreeCheckpoint() { Close(); }
+
+    /* Start a new checkpoint file, saving the subtrees rooted at the
+     * given level (at least 1) */
+    int Create(const char *filename, int level);
+
+    /* Reopen a checkpoint file to resume the build it records.  A
+     * record cut short by the interruption is discarded */
+    int Resume(const char *filename);
+
+    void Close();
+
+    /* Called by VocabTree::Build before the root is clustered: record
+     * the parameters of the build or, when resuming, check them
+     * against the saved ones (including a hash of the features, data)
+     * and restore the saved seed.  idx is the index array of the whole
+     * build */
+    int Begin(int n, int dim, int depth, int bf, int restarts,
+              const KMeansOptions &options, unsigned int &seed,
+              const unsigned char *data, const unsigned int *idx);
+
+    int Level() const { return m_level; }
+
+    /* Save the clustering of an interior node: its children (with
+     * the number of features of each) and the order of v afterwards */
+    int SaveSplit(int depth_curr, VectorSet v, int n, int bf, int dim,
+                  VocabTreeNode * const *children, const int *counts);
+
+    /* Restore a saved clustering, creating the children and
+     * reordering v.  Returns false if there is none */
+    bool LoadSplit(int depth_curr, VectorSet v, int n, int bf, int dim,
+                   VocabTreeNode **children, int *counts);
+
+    /* Save a finished subtree */
+    int SaveSubtree(int depth_curr, VectorSet v, int bf, int dim,
+                    const VocabTreeNode *node);
+
+    /* Read a saved subtree, or return NULL if there is none */
+    VocabTreeNode *LoadSubtree(int depth_curr, VectorSet v, int bf, int dim);
+
+private:
+    unsigned long long Key(int depth_curr, VectorSet v) const;
+    int WriteRecord(char type, unsigned long long key, 
+                    const void *data, long long len, 
+                    const VocabTreeNode *node, int bf, int dim);
+
+    FILE *m_file;
+    int m_level;                  /* Level of the saved subtrees */
+    bool m_resuming;              /* Was the file read by Resume? */
+    const unsigned int *m_idx;    /* Index array of the build */
+
+    /* Payload offsets of the saved records */
+    std::map<unsigned long long, long long> m_splits;
+    std::map<unsigned long long, long long> m_subtrees;
+};
+
+#endif /* __vocab_tree_checkpoint_h__ */
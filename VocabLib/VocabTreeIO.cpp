@@ -103,19 +103,28 @@ int VocabTreeInteriorNode::Read(FILE *f, int bf, int dim)
     float dummy;
 
     m_desc = new unsigned char[dim];
-    fread(m_desc, sizeof(unsigned char), dim, f);
-    fread(&dummy, sizeof(float), 1, f);
-    fread(children, sizeof(char), bf, f);
+    if (fread(m_desc, sizeof(unsigned char), dim, f) != (size_t) dim ||
+        fread(&dummy, sizeof(float), 1, f) != 1 ||
+        fread(children, sizeof(char), bf, f) != (size_t) bf) {
+        delete [] children;
+        return -1;
+    }
 
+    /* On an error, the children not yet read are left NULL, so that
+     * the node can still be cleared */
     m_children = new VocabTreeNode *[bf];
+    for (int i = 0; i < bf; i++)
+        m_children[i] = NULL;
 
-    for (int i = 0; i < bf; i++) {
-        if (children[i] == 0) {
-            m_children[i] = NULL;
-        } else {
+    int error = 0;
+    for (int i = 0; i < bf && error == 0; i++) {
+        if (children[i] != 0) {
             /* Read the interior flag */
             char interior;
-            fread(&interior, sizeof(char), 1, f);
+            if (fread(&interior, sizeof(char), 1, f) != 1) {
+                error = -1;
+                break;
+            }
 
             if (interior == 1) {
                 m_children[i] = new VocabTreeInteriorNode();
@@ -123,13 +132,13 @@ int VocabTreeInteriorNode::Read(FILE *f, int bf, int dim)
                 m_children[i] = new VocabTreeLeaf();
             }
             
-            m_children[i]->Read(f, bf, dim);
+            error = m_children[i]->Read(f, bf, dim);
         }
     }
 
     delete [] children;
 
-    return 0;    
+    return error;    
 }
 
 int VocabTreeInteriorNode::WriteNode(FILE *f, int bf, int dim) const
@@ -191,19 +200,22 @@ int VocabTreeLeaf::WriteASCII(FILE *f, int bf, int dim) const {
 int VocabTreeLeaf::Read(FILE *f, int bf, int dim)
 {
     m_desc = new unsigned char[dim];
-    fread(m_desc, sizeof(unsigned char), dim, f);
-    fread(&m_weight, sizeof(float), 1, f);
-
     int num_images;
-    fread(&num_images, sizeof(int), 1, f);
+    if (fread(m_desc, sizeof(unsigned char), dim, f) != (size_t) dim ||
+        fread(&m_weight, sizeof(float), 1, f) != 1 ||
+        fread(&num_images, sizeof(int), 1, f) != 1 || num_images < 0)
+        return -1;
 
-    m_image_list.resize(num_images);
+    /* The list grows as it is read, so a corrupt count cannot force
+     * a large allocation */
     for (int i = 0; i < num_images; i++) {
         int img;
         float count;
-        fread(&img, sizeof(int), 1, f);
-        fread(&count, sizeof(float), 1, f);
-        m_image_list[i] = ImageCount(img, count);
+        if (fread(&img, sizeof(int), 1, f) != 1 ||
+            fread(&count, sizeof(float), 1, f) != 1)
+            return -1;
+
+        m_image_list.push_back(ImageCount(img, count));
     }
 
     return 0;
@@ -239,6 +251,16 @@ int VocabTree::Read(const char *filename)
         return -1;
     }
 
+    /* Check for a mapped database */
+    char magic[8];
+    if (fread(magic, sizeof(char), 8, f) == 8 && 
+        memcmp(magic, "VTMAPDB", 7) == 0) {
+        fclose(f);
+        return ReadMapped(filename);
+    }
+
+    rewind(f);
+
     /* Read the fields for the tree */
     fread(&m_branch_factor, sizeof(int), 1, f);
     fread(&m_depth, sizeof(int), 1, f);
@@ -252,6 +274,7 @@ int VocabTree::Read(const char *filename)
 
     m_root->Read(f, m_branch_factor, m_dim);
     /* unsigned long next_id = */ m_root->ComputeIDs(m_branch_factor, 0);
+    m_root->IndexChildren(m_branch_factor);
     /* unsigned long n = */ m_root->CountNodes(m_branch_factor);
     /* printf("  Next id: %lu == %lu + 1\n", next_id, n); */
 
@@ -277,6 +300,12 @@ int VocabTree::Write(const char *filename) const
     if (m_root == NULL) 
         return -1;
 
+    if (IsFinalized()) {
+        printf("[VocabTree::Write] Error: cannot write a finalized "
+               "database in the tree format\n");
+        return -1;
+    }
+
     FILE *f = fopen(filename, "wb");
     
     if (f == NULL) {
@@ -344,7 +373,7 @@ int VocabTree::WriteASCII(const char *filename) const
 int VocabTree::WriteDatabaseVectors(const char *filename, 
                                     int start_index, int num_vectors) const
 {
-    if (m_root == NULL)
+    if (m_root == NULL || IsFinalized())
         return -1;
 
     std::vector<sp_list> vectors;
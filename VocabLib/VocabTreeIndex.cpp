@@ -0,0 +1,179 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+
+/* VocabTreeIndex.cpp */
+/* Compressed (CSR) inverted index for a vocabulary tree database */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "VocabTree.h"
+
+int VocabInvertedIndex::Allocate(unsigned long num_words, 
+                                 unsigned long num_postings)
+{
+    Clear();
+
+    m_offsets = new unsigned long[num_words + 1];
+    m_images = new unsigned int[num_postings];
+    m_counts = new float[num_postings];
+
+    if (m_offsets == NULL || m_images == NULL || m_counts == NULL) {
+        printf("[VocabInvertedIndex::Allocate] Error allocating index\n");
+        Clear();
+        return -1;
+    }
+
+    m_num_words = num_words;
+    m_num_postings = num_postings;
+    m_owned = true;
+
+    return 0;
+}
+
+void VocabInvertedIndex::Wrap(unsigned long num_words, 
+                              unsigned long num_postings,
+                              unsigned long *offsets, unsigned int *images,
+                              float *counts)
+{
+    Clear();
+
+    m_num_words = num_words;
+    m_num_postings = num_postings;
+    m_offsets = offsets;
+    m_images = images;
+    m_counts = counts;
+    m_owned = false;
+}
+
+void VocabInvertedIndex::Clear()
+{
+    if (m_owned) {
+        if (m_offsets != NULL)
+            delete [] m_offsets;
+        if (m_images != NULL)
+            delete [] m_images;
+        if (m_counts != NULL)
+            delete [] m_counts;
+    }
+
+    m_offsets = NULL;
+    m_images = NULL;
+    m_counts = NULL;
+    m_num_words = m_num_postings = 0;
+    m_owned = false;
+}
+
+void VocabTreeInteriorNode::CountPostings(int bf, unsigned long *counts) const
+{
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            m_children[i]->CountPostings(bf, counts);
+        }
+    }
+}
+
+void VocabTreeLeaf::CountPostings(int bf, unsigned long *counts) const
+{
+    counts[m_id + 1] = m_image_list.size();
+}
+
+void VocabTreeInteriorNode::MovePostings(int bf, VocabInvertedIndex &index)
+{
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            m_children[i]->MovePostings(bf, index);
+        }
+    }
+}
+
+void VocabTreeLeaf::MovePostings(int bf, VocabInvertedIndex &index)
+{
+    unsigned long off = index.m_offsets[m_id];
+    int n = (int) m_image_list.size();
+
+    assert(off + n == index.m_offsets[m_id + 1]);
+
+    for (int i = 0; i < n; i++) {
+        index.m_images[off + i] = m_image_list[i].m_index;
+        index.m_counts[off + i] = m_image_list[i].m_count;
+    }
+
+    /* Release the storage for the list */
+    std::vector<ImageCount>().swap(m_image_list);
+}
+
+int VocabTree::FinalizeDatabase()
+{
+    if (m_root == NULL)
+        return -1;
+
+    if (IsFinalized()) 
+        return 0;
+
+    unsigned long num_words = m_num_nodes;
+    unsigned long *counts = new unsigned long[num_words + 1];
+
+    for (unsigned long i = 0; i <= num_words; i++)
+        counts[i] = 0;
+
+    m_root->CountPostings(m_branch_factor, counts);
+
+    /* Turn the counts into offsets */
+    for (unsigned long i = 0; i < num_words; i++)
+        counts[i+1] += counts[i];
+
+    unsigned long num_postings = counts[num_words];
+
+    if (m_index.Allocate(num_words, num_postings) != 0) {
+        delete [] counts;
+        return -1;
+    }
+
+    memcpy(m_index.m_offsets, counts, sizeof(unsigned long) * (num_words+1));
+    delete [] counts;
+
+    m_root->MovePostings(m_branch_factor, m_index);
+
+    printf("[VocabTree::FinalizeDatabase] Built inverted index with "
+           "%lu words and %lu postings\n", num_words, num_postings);
+    fflush(stdout);
+
+    return 0;
+}
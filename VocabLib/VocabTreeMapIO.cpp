@@ -0,0 +1,578 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+
+/* VocabTreeMapIO.cpp */
+/* Reading and writing databases in a memory-mappable format */
+
+/* A mapped database file consists of a header followed by a set of
+ * tables, each aligned to VOCAB_MAP_ALIGN bytes and indexed by node
+ * id:
+ *
+ *   descriptors : num_nodes * dim bytes
+ *   weights     : num_nodes floats (the leaf weights)
+ *   rows        : num_nodes ints, the row of each interior node in
+ *                 the child table, -1 for leaves and -2 for unused ids
+ *   children    : num_interior * branch_factor ints, the ids of the
+ *                 children of each interior node (-1 if empty)
+ *   offsets     : num_nodes + 1 64-bit offsets into the postings
+ *   images      : num_postings unsigned ints, each below num_images
+ *   counts      : num_postings floats
+ *
+ * The descriptors and postings are used in place by ReadMapped, so
+ * several processes mapping the same file share one copy in the page
+ * cache.  Node 0 is the root. */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "VocabTree.h"
+
+#define VOCAB_MAP_MAGIC "VTMAPDB1"
+#define VOCAB_MAP_VERSION 2
+#define VOCAB_MAP_ALIGN 64
+
+typedef struct {
+    char magic[8];                   /* VOCAB_MAP_MAGIC */
+    int version;                     /* VOCAB_MAP_VERSION */
+    int branch_factor;
+    int depth;
+    int dim;
+    unsigned long long num_nodes;
+    unsigned long long num_interior;
+    unsigned long long num_postings;
+    unsigned long long num_images;   /* Number of database images */
+
+    /* Byte offsets of the tables from the start of the file */
+    unsigned long long desc_offset;
+    unsigned long long weight_offset;
+    unsigned long long row_offset;
+    unsigned long long child_offset;
+    unsigned long long posting_offset;
+    unsigned long long image_offset;
+    unsigned long long count_offset;
+    unsigned long long file_size;
+} VocabTreeMapHeader;
+
+static unsigned long long AlignOffset(unsigned long long off)
+{
+    return (off + VOCAB_MAP_ALIGN - 1) / VOCAB_MAP_ALIGN * VOCAB_MAP_ALIGN;
+}
+
+/* Write a table at the given offset, padding the file up to it */
+static int WriteTable(FILE *f, unsigned long long &pos, 
+                      unsigned long long offset, 
+                      const void *data, size_t size, size_t count)
+{
+    static const char zeros[VOCAB_MAP_ALIGN] = { 0 };
+
+    assert(offset >= pos && offset - pos < VOCAB_MAP_ALIGN);
+    if (offset > pos)
+        fwrite(zeros, 1, (size_t) (offset - pos), f);
+
+    size_t written = fwrite(data, size, count, f);
+    pos = offset + (unsigned long long) size * count;
+
+    return (written == count) ? 0 : -1;
+}
+
+void VocabTreeInteriorNode::FillMapTables(int bf, int dim, 
+                                          unsigned char *desc, 
+                                          float *weights, int *rows, 
+                                          int *children, 
+                                          int &next_row) const
+{
+    int row = next_row++;
+
+    memcpy(desc + m_id * dim, m_desc, dim);
+    weights[m_id] = 0.0;
+    rows[m_id] = row;
+
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            children[(unsigned long) row * bf + i] = 
+                (int) m_children[i]->m_id;
+            m_children[i]->FillMapTables(bf, dim, desc, weights, rows, 
+                                         children, next_row);
+        } else {
+            children[(unsigned long) row * bf + i] = -1;
+        }
+    }
+}
+
+void VocabTreeLeaf::FillMapTables(int bf, int dim, unsigned char *desc, 
+                                  float *weights, int *rows, int *children,
+                                  int &next_row) const
+{
+    memcpy(desc + m_id * dim, m_desc, dim);
+    weights[m_id] = m_weight;
+    rows[m_id] = -1;
+}
+
+int VocabTree::WriteMapped(const char *filename) const
+{
+    if (m_root == NULL)
+        return -1;
+
+    if (!IsFinalized()) {
+        printf("[VocabTree::WriteMapped] Error: the database must be "
+               "finalized before writing\n");
+        return -1;
+    }
+
+    unsigned long num_nodes = m_num_nodes;
+    unsigned long num_interior = 
+        CountNodes() - CountLeaves();
+
+    unsigned char *desc = new unsigned char[num_nodes * m_dim];
+    float *weights = new float[num_nodes];
+    int *rows = new int[num_nodes];
+    int *children = new int[num_interior * m_branch_factor];
+
+    memset(desc, 0, num_nodes * m_dim);
+    for (unsigned long i = 0; i < num_nodes; i++) {
+        weights[i] = 0.0;
+        rows[i] = -2;
+    }
+
+    int next_row = 0;
+    m_root->FillMapTables(m_branch_factor, m_dim, desc, weights, rows,
+                          children, next_row);
+    assert((unsigned long) next_row == num_interior);
+
+    /* Lay out the file */
+    VocabTreeMapHeader header;
+    memset(&header, 0, sizeof(VocabTreeMapHeader));
+    memcpy(header.magic, VOCAB_MAP_MAGIC, 8);
+    header.version = VOCAB_MAP_VERSION;
+    header.branch_factor = m_branch_factor;
+    header.depth = m_depth;
+    header.dim = m_dim;
+    header.num_nodes = num_nodes;
+    header.num_interior = num_interior;
+    header.num_postings = m_index.m_num_postings;
+
+    /* Ids are not always dense, so store one more than the largest */
+    header.num_images = m_database_images;
+    for (unsigned long i = 0; i < m_index.m_num_postings; i++) {
+        if (m_index.m_images[i] >= header.num_images)
+            header.num_images = m_index.m_images[i] + 1;
+    }
+
+    unsigned long long pos = sizeof(VocabTreeMapHeader);
+    header.desc_offset = AlignOffset(pos);
+    pos = header.desc_offset + (unsigned long long) num_nodes * m_dim;
+    header.weight_offset = AlignOffset(pos);
+    pos = header.weight_offset + sizeof(float) * num_nodes;
+    header.row_offset = AlignOffset(pos);
+    pos = header.row_offset + sizeof(int) * num_nodes;
+    header.child_offset = AlignOffset(pos);
+    pos = header.child_offset + 
+        sizeof(int) * (unsigned long long) num_interior * m_branch_factor;
+    header.posting_offset = AlignOffset(pos);
+    pos = header.posting_offset + 
+        sizeof(unsigned long long) * (num_nodes + 1);
+    header.image_offset = AlignOffset(pos);
+    pos = header.image_offset + 
+        sizeof(unsigned int) * header.num_postings;
+    header.count_offset = AlignOffset(pos);
+    header.file_size = header.count_offset + 
+        sizeof(float) * header.num_postings;
+
+    FILE *f = fopen(filename, "wb");
+    
+    if (f == NULL) {
+        printf("[VocabTree::WriteMapped] Error opening file %s for writing\n",
+               filename);
+        delete [] desc;
+        delete [] weights;
+        delete [] rows;
+        delete [] children;
+        return -1;
+    }
+
+    /* The offsets are always stored with 64 bits */
+    unsigned long long *offsets = new unsigned long long[num_nodes + 1];
+    for (unsigned long i = 0; i <= num_nodes; i++) {
+        offsets[i] = (i < m_index.m_num_words) ? 
+            m_index.m_offsets[i] : m_index.m_num_postings;
+    }
+
+    int error = 0;
+    pos = 0;
+    error |= WriteTable(f, pos, 0, &header, sizeof(VocabTreeMapHeader), 1);
+    error |= WriteTable(f, pos, header.desc_offset, 
+                        desc, m_dim, num_nodes);
+    error |= WriteTable(f, pos, header.weight_offset, 
+                        weights, sizeof(float), num_nodes);
+    error |= WriteTable(f, pos, header.row_offset, 
+                        rows, sizeof(int), num_nodes);
+    error |= WriteTable(f, pos, header.child_offset, children, 
+                        sizeof(int), num_interior * m_branch_factor);
+    error |= WriteTable(f, pos, header.posting_offset, offsets, 
+                        sizeof(unsigned long long), num_nodes + 1);
+    error |= WriteTable(f, pos, header.image_offset, m_index.m_images,
+                        sizeof(unsigned int), m_index.m_num_postings);
+    error |= WriteTable(f, pos, header.count_offset, m_index.m_counts,
+                        sizeof(float), m_index.m_num_postings);
+
+    fclose(f);
+
+    delete [] desc;
+    delete [] weights;
+    delete [] rows;
+    delete [] children;
+    delete [] offsets;
+
+    if (error != 0) {
+        printf("[VocabTree::WriteMapped] Error writing file %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Map (or, on Windows, read) a whole file into memory */
+void *MapFile(const char *filename, unsigned long &size_out)
+{
+    struct stat sb;
+    if (stat(filename, &sb) < 0) {
+        printf("[MapFile] Error: could not stat file %s\n", filename);
+        return NULL;
+    }
+
+    size_out = (unsigned long) sb.st_size;
+
+#ifndef WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("[MapFile] Error opening file %s for reading\n", filename);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, size_out, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        printf("[MapFile] Error mapping file %s\n", filename);
+        return NULL;
+    }
+#else
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("[MapFile] Error opening file %s for reading\n", filename);
+        return NULL;
+    }
+
+    void *base = malloc(size_out);
+    if (base == NULL || fread(base, 1, size_out, f) != size_out) {
+        printf("[MapFile] Error reading file %s\n", filename);
+        free(base);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+#endif
+
+    return base;
+}
+
+void UnmapFile(void *base, unsigned long size)
+{
+#ifndef WIN32
+    munmap(base, size);
+#else
+    free(base);
+#endif
+}
+
+/* Check that a table of count elements of the given size lies inside
+ * a mapped file of size bytes */
+static bool CheckTable(unsigned long long offset, unsigned long long count,
+                       unsigned long long elem_size, 
+                       unsigned long long size)
+{
+    if (offset % VOCAB_MAP_ALIGN != 0 || offset > size)
+        return false;
+
+    return count <= (size - offset) / elem_size;
+}
+
+/* Check the header and tables of a mapped database once, so that the
+ * nodes and postings can be used without further checks */
+static const char *CheckMappedTables(const unsigned char *bytes, 
+                                     unsigned long long size)
+{
+    const VocabTreeMapHeader *header = (const VocabTreeMapHeader *) bytes;
+    unsigned long long num_nodes = header->num_nodes;
+    unsigned long long num_interior = header->num_interior;
+    unsigned long long num_postings = header->num_postings;
+    int bf = header->branch_factor;
+    int dim = header->dim;
+
+    if (bf <= 0 || dim <= 0 || num_nodes > 0x7fffffff || 
+        num_interior > num_nodes)
+        return "bad tree dimensions";
+
+    unsigned long long num_children = num_interior * bf;
+    if (!CheckTable(header->desc_offset, num_nodes * dim, 1, size) ||
+        !CheckTable(header->weight_offset, num_nodes, sizeof(float), size) ||
+        !CheckTable(header->row_offset, num_nodes, sizeof(int), size) ||
+        !CheckTable(header->child_offset, num_children, sizeof(int), size) ||
+        !CheckTable(header->posting_offset, num_nodes + 1, 
+                    sizeof(unsigned long long), size) ||
+        !CheckTable(header->image_offset, num_postings, 
+                    sizeof(unsigned int), size) ||
+        !CheckTable(header->count_offset, num_postings, 
+                    sizeof(float), size))
+        return "table outside the file";
+
+    const int *rows = (const int *) (bytes + header->row_offset);
+    const int *children = (const int *) (bytes + header->child_offset);
+    const unsigned long long *offsets = 
+        (const unsigned long long *) (bytes + header->posting_offset);
+
+    /* Each row of the child table belongs to exactly one node */
+    const char *error = NULL;
+    char *used = new char[num_nodes];
+    memset(used, 0, num_nodes);
+
+    unsigned long long num_rows = 0;
+    for (unsigned long long i = 0; error == NULL && i < num_nodes; i++) {
+        if (rows[i] < -2 || rows[i] >= (long long) num_interior)
+            error = "node row out of range";
+        else if (rows[i] >= 0 && used[rows[i]])
+            error = "node row used twice";
+        else if (rows[i] >= 0) {
+            used[rows[i]] = 1;
+            num_rows++;
+        }
+    }
+
+    if (error == NULL && num_rows != num_interior)
+        error = "unused rows in the child table";
+
+    if (error == NULL && rows[0] == -2)
+        error = "missing root node";
+
+    /* Each node has at most one parent and the root has none, so the
+     * nodes reachable from the root form a tree */
+    memset(used, 0, num_nodes);
+    used[0] = 1;
+    for (unsigned long long i = 0; error == NULL && i < num_children; i++) {
+        if (children[i] < -1 || children[i] >= (long long) num_nodes)
+            error = "child out of range";
+        else if (children[i] >= 0 && used[children[i]])
+            error = "node has several parents";
+        else if (children[i] >= 0)
+            used[children[i]] = 1;
+    }
+
+    delete [] used;
+
+    if (error == NULL && offsets[0] != 0)
+        error = "postings do not start at zero";
+
+    for (unsigned long long i = 0; error == NULL && i < num_nodes; i++) {
+        if (offsets[i + 1] < offsets[i])
+            error = "posting offsets decrease";
+    }
+
+    if (error == NULL && offsets[num_nodes] != num_postings)
+        error = "posting offsets do not end at the number of postings";
+
+    /* The image ids index the score array of a query */
+    const unsigned int *images = 
+        (const unsigned int *) (bytes + header->image_offset);
+
+    if (error == NULL && header->num_images > 0x7fffffff)
+        error = "bad number of images";
+
+    for (unsigned long long i = 0; error == NULL && i < num_postings; i++) {
+        if (images[i] >= header->num_images)
+            error = "image id out of range";
+    }
+
+    return error;
+}
+
+int VocabTree::ReadMapped(const char *filename)
+{
+    if (sizeof(unsigned long) != sizeof(unsigned long long)) {
+        printf("[VocabTree::ReadMapped] Error: mapped databases require "
+               "64-bit offsets\n");
+        return -1;
+    }
+
+    unsigned long size = 0;
+    void *base = MapFile(filename, size);
+
+    if (base == NULL)
+        return -1;
+
+    const VocabTreeMapHeader *header = (const VocabTreeMapHeader *) base;
+
+    if (size < sizeof(VocabTreeMapHeader) || 
+        memcmp(header->magic, VOCAB_MAP_MAGIC, 8) != 0 ||
+        header->version != VOCAB_MAP_VERSION ||
+        header->file_size != size || header->num_nodes == 0) {
+        printf("[VocabTree::ReadMapped] Error: %s is not a valid mapped "
+               "database\n", filename);
+        UnmapFile(base, size);
+        return -1;
+    }
+
+    unsigned char *bytes = (unsigned char *) base;
+    const char *error = CheckMappedTables(bytes, size);
+
+    if (error != NULL) {
+        printf("[VocabTree::ReadMapped] Error: %s is not a valid mapped "
+               "database (%s)\n", filename, error);
+        UnmapFile(base, size);
+        return -1;
+    }
+
+    unsigned long num_nodes = header->num_nodes;
+    unsigned long num_interior = header->num_interior;
+    int bf = header->branch_factor;
+    int dim = header->dim;
+
+    unsigned char *desc = bytes + header->desc_offset;
+    const float *weights = (const float *) (bytes + header->weight_offset);
+    const int *rows = (const int *) (bytes + header->row_offset);
+    const int *children = (const int *) (bytes + header->child_offset);
+
+    unsigned long num_leaves = 0;
+    for (unsigned long i = 0; i < num_nodes; i++) {
+        if (rows[i] == -1)
+            num_leaves++;
+    }
+
+    /* Create the nodes in pools, in id order */
+    m_mapping.m_base = base;
+    m_mapping.m_size = size;
+    m_mapping.m_interiors = new VocabTreeInteriorNode[num_interior];
+    m_mapping.m_leaves = new VocabTreeLeaf[num_leaves];
+    m_mapping.m_children = new VocabTreeNode *[num_interior * bf];
+    m_mapping.m_child_desc = new const unsigned char *[num_interior * bf];
+    m_mapping.m_child_slot = new int[num_interior * bf];
+
+    VocabTreeNode **nodes = new VocabTreeNode *[num_nodes];
+    unsigned long next_leaf = 0;
+    for (unsigned long i = 0; i < num_nodes; i++) {
+        if (rows[i] >= 0) {
+            VocabTreeInteriorNode *node = m_mapping.m_interiors + rows[i];
+            node->m_children = m_mapping.m_children + 
+                (unsigned long) rows[i] * bf;
+            node->m_child_desc = m_mapping.m_child_desc + 
+                (unsigned long) rows[i] * bf;
+            node->m_child_slot = m_mapping.m_child_slot + 
+                (unsigned long) rows[i] * bf;
+            nodes[i] = node;
+        } else if (rows[i] == -1) {
+            VocabTreeLeaf *leaf = m_mapping.m_leaves + next_leaf;
+            leaf->m_weight = weights[i];
+            nodes[i] = leaf;
+            next_leaf++;
+        } else {
+            nodes[i] = NULL;
+            continue;
+        }
+
+        nodes[i]->m_id = i;
+        nodes[i]->m_desc = desc + i * dim;
+    }
+
+    for (unsigned long i = 0; i < num_interior * bf; i++) {
+        m_mapping.m_children[i] = 
+            (children[i] >= 0) ? nodes[children[i]] : NULL;
+    }
+
+    m_root = nodes[0];
+    m_root->IndexChildren(bf);
+    delete [] nodes;
+
+    m_branch_factor = bf;
+    m_depth = header->depth;
+    m_dim = dim;
+    m_num_nodes = num_nodes;
+    m_database_images = (int) header->num_images;
+
+    m_index.Wrap(num_nodes, header->num_postings, 
+                 (unsigned long *) (bytes + header->posting_offset),
+                 (unsigned int *) (bytes + header->image_offset),
+                 (float *) (bytes + header->count_offset));
+
+    return 0;
+}
+
+/* Release a tree created by ReadMapped */
+int VocabTree::ClearMapped()
+{
+    /* Flatten replaces the root with a node that is not in the pool */
+    if (m_root != NULL && m_root != m_mapping.m_interiors) {
+        VocabTreeInteriorNode *root = (VocabTreeInteriorNode *) m_root;
+        delete [] root->m_children;
+        delete [] root->m_desc;
+        delete root;
+    }
+
+    /* The node destructors do not free anything, so the pools can be
+     * deleted directly */
+    delete [] m_mapping.m_interiors;
+    delete [] m_mapping.m_leaves;
+    delete [] m_mapping.m_children;
+    delete [] m_mapping.m_child_desc;
+    delete [] m_mapping.m_child_slot;
+
+    m_index.Clear();
+    UnmapFile(m_mapping.m_base, m_mapping.m_size);
+    m_mapping = VocabTreeMapping();
+    m_root = NULL;
+
+    return 0;
+}
@@ -47,6 +47,28 @@
 
 #include "VocabTree.h"
 
+/* FNV-style hash of a run of descriptors, eight bytes at a time.  The
+ * flattened tree uses it to detect stale search trees, and the
+ * checkpoints to detect a changed training set */
+unsigned long long HashDescriptors(const unsigned char *desc, 
+                                   unsigned long len)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned long i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long word;
+        memcpy(&word, desc + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+
+    for (; i < len; i++) {
+        hash = (hash ^ desc[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
 unsigned long VocabTreeInteriorNode::CountNodes(int bf) const
 {
     unsigned long num_nodes = 0;
@@ -84,17 +106,6 @@ double VocabTreeInteriorNode::CountFeatures(int bf)
     return num_features;
 }
 
-int VocabTreeInteriorNode::ClearScores(int bf)
-{    
-    for (int i = 0; i < bf; i++) {
-        if (m_children[i] != NULL) {
-            m_children[i]->ClearScores(bf);   
-        }   
-    }
-
-    return 0;   
-}
-
 int VocabTreeInteriorNode::ClearDatabase(int bf)
 {
     for (int i = 0; i < bf; i++) {
@@ -138,12 +149,6 @@ double VocabTreeLeaf::CountFeatures(int bf)
     return num_features;
 }
 
-int VocabTreeLeaf::ClearScores(int bf)
-{
-    m_score = 0.0;
-    return 0;
-}
-
 int VocabTreeLeaf::ClearDatabase(int bf)
 {
     m_image_list.clear();
@@ -192,6 +197,25 @@ unsigned long VocabTreeInteriorNode::ComputeIDs(int bf, unsigned long id)
     return next_id;
 }
 
+void VocabTreeInteriorNode::IndexChildren(int bf)
+{
+    if (m_child_desc == NULL) {
+        m_child_desc = new const unsigned char *[bf];
+        m_child_slot = new int[bf];
+    }
+
+    m_num_children = 0;
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            m_child_desc[m_num_children] = m_children[i]->m_desc;
+            m_child_slot[m_num_children] = i;
+            m_num_children++;
+
+            m_children[i]->IndexChildren(bf);
+        }
+    }
+}
+
 unsigned long VocabTreeLeaf::ComputeIDs(int bf, unsigned long id)
 {
     m_id = id;
@@ -238,6 +262,8 @@ int VocabTree::PrintWeights()
 
 int VocabTree::ClearDatabase()
 {
+    m_index.Clear();
+
     if (m_root != NULL) {
         m_root->ClearDatabase(m_branch_factor);
     }
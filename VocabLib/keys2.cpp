@@ -37,6 +37,7 @@
 /* keys2.cpp */
 /* Class for SIFT keypoints */
 
+#include <limits.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -44,7 +45,7 @@
 #include <time.h>
 
 #include <fcntl.h>
-//#include <unistd.h>
+#include <unistd.h>
 //#include <sys/mman.h>
 #include <sys/stat.h>
 
@@ -79,40 +80,557 @@ int GetNumberOfKeysGzip(gzFile fp)
     return num;
 }
 
-/* Returns the number of keys in a file */
-int GetNumberOfKeys(const char *filename)
+/* Formats of key files */
+typedef enum {
+    KeyFormatText,         /* Lowe's text format */
+    KeyFormatBinary,       /* 8-bit descriptors, see BINARY_KEY_MAGIC */
+    KeyFormatBinaryShort,  /* as written by WriteBinaryKeyFile */
+} key_format_t;
+
+/* Find the format of an open key file, leaving fp positioned after
+ * the magic of a binary file, or at the start of any other file */
+static key_format_t GetKeyFileFormat(FILE *fp)
 {
-    FILE *file;
+    char magic[8] = { 0 };
+    if (fread(magic, 1, 8, fp) == 8 && 
+        memcmp(magic, BINARY_KEY_MAGIC, 8) == 0)
+        return KeyFormatBinary;
+
+    /* The older binary format has no magic, but its size is implied
+     * by the number of keys at the start */
+    struct stat sb;
+    int num;
+    memcpy(&num, magic, sizeof(int));
+    rewind(fp);
+
+    if (fstat(fileno(fp), &sb) == 0 && num >= 0 &&
+        (long long) sb.st_size == (long long) sizeof(int) + 
+        (long long) num *
+            (long long) (sizeof(keypt_t) + 128 * sizeof(short int)))
+        return KeyFormatBinaryShort;
+
+    return KeyFormatText;
+}
+
+/* Reads from either a FILE * or a gzFile */
+typedef size_t (*key_read_fn)(void *dst, size_t len, void *stream);
+
+static size_t ReadFromFile(void *dst, size_t len, void *stream)
+{
+    return fread(dst, 1, len, (FILE *) stream);
+}
+
+static size_t ReadFromGzip(void *dst, size_t len, void *stream)
+{
+    int n = gzread((gzFile) stream, dst, (unsigned int) len);
+    return n < 0 ? 0 : (size_t) n;
+}
+
+KeyBuffer::~KeyBuffer()
+{
+    delete [] m_keys;
+    delete [] m_info;
+}
+
+void KeyBuffer::Reserve(int num)
+{
+    m_num_keys = 0;
+
+    if (num <= m_capacity && m_keys != NULL && m_info != NULL)
+        return;
+
+    delete [] m_keys;
+    delete [] m_info;
+
+    m_keys = new unsigned char[(size_t) num * 128];
+    m_info = new keypt_t[num];
+    m_capacity = num;
+}
+
+unsigned char *KeyBuffer::ReleaseKeys()
+{
+    unsigned char *keys = m_keys;
+    m_keys = NULL;
+    m_capacity = 0;
+
+    return keys;
+}
+
+keypt_t *KeyBuffer::ReleaseInfo()
+{
+    keypt_t *info = m_info;
+    m_info = NULL;
+    m_capacity = 0;
+
+    return info;
+}
+
+/* Number of bytes left in a file after the current position */
+static long long GetRemainingBytes(FILE *fp)
+{
+    struct stat sb;
+    long pos = ftell(fp);
+    if (pos < 0 || fstat(fileno(fp), &sb) != 0)
+        return -1;
+
+    return (long long) sb.st_size - pos;
+}
 
-    file = fopen (filename, "r");
+/* Read the rest of a binary key file with 8-bit descriptors, after
+ * the magic, given the number of bytes left in the file.  The number
+ * of keys is checked against the bytes left before anything is
+ * allocated */
+static int ReadKeysBinary(key_read_fn read, void *stream, long long left,
+                          KeyBuffer &buffer)
+{
+    int header[2]; /* Number of keys, descriptor length */
+    if (read(header, sizeof(header), stream) != sizeof(header) ||
+        header[0] < 0 || header[1] != 128) {
+        printf("Invalid binary keypoint file.\n");
+        return -1;
+    }
+
+    int num = header[0];
+    size_t len = (size_t) num * 128;
+
+    if ((long long) num * (long long) (sizeof(keypt_t) + 128) >
+        left - (long long) sizeof(header)) {
+        printf("Truncated binary keypoint file.\n");
+        return -1;
+    }
+
+    buffer.Reserve(num);
+
+    if (read(buffer.m_info, sizeof(keypt_t) * num, stream) != 
+            sizeof(keypt_t) * num ||
+        read(buffer.m_keys, len, stream) != len) {
+        printf("Truncated binary keypoint file.\n");
+        return -1;
+    }
+
+    return num;
+}
+
+/* Read a key file written by WriteBinaryKeyFile */
+static int ReadKeysBinaryShort(FILE *fp, KeyBuffer &buffer)
+{
+    long long left = GetRemainingBytes(fp);
+
+    int num;
+    if (fread(&num, sizeof(int), 1, fp) != 1 || num < 0)
+        return -1;
+
+    if ((long long) num *
+        (long long) (sizeof(keypt_t) + 128 * sizeof(short int)) >
+        left - (long long) sizeof(int)) {
+        printf("Truncated binary keypoint file.\n");
+        return -1;
+    }
+
+    buffer.Reserve(num);
+
+    if (fread(buffer.m_info, sizeof(keypt_t), num, fp) != (size_t) num) {
+        printf("Truncated binary keypoint file.\n");
+        return -1;
+    }
+
+    /* Narrow the descriptors a block of keys at a time */
+    const int block = 64;
+    short int d[block * 128];
+
+    for (int i = 0; i < num; i += block) {
+        int n = (num - i < block) ? num - i : block;
+
+        if (fread(d, sizeof(short int), n * 128, fp) != (size_t) n * 128) {
+            printf("Truncated binary keypoint file.\n");
+            return -1;
+        }
+
+        unsigned char *p = buffer.m_keys + (size_t) i * 128;
+        for (int j = 0; j < n * 128; j++)
+            p[j] = (unsigned char) d[j];
+    }
+
+    return num;
+}
+
+/* Size of the blocks read by the text key parser, and the longest
+ * token it handles */
+#define KEY_TEXT_BLOCK (1 << 16)
+#define KEY_TEXT_TOKEN 64
+
+/* Buffered reader for the text key parser, over a stream read in
+ * blocks of KEY_TEXT_BLOCK bytes into buf, or over a whole file in
+ * memory (with eof set from the start).  The data always ends with a
+ * NUL after the last byte read, which stops the scanning loops */
+typedef struct {
+    key_read_fn read;
+    void *stream;
+    char *buf, *pos, *end;
+    bool eof;
+} key_text_reader_t;
+
+static void KeyTextRefill(key_text_reader_t *r)
+{
+    size_t left = r->end - r->pos;
+    memmove(r->buf, r->pos, left);
+
+    size_t n = r->read(r->buf + left, KEY_TEXT_BLOCK - left, r->stream);
+
+    r->pos = r->buf;
+    r->end = r->buf + left + n;
+    *r->end = 0;
+
+    if (n == 0)
+        r->eof = true;
+}
+
+static inline bool IsKeySpace(char c)
+{
+    /* ' ', or one of '\t', '\n', '\v', '\f', '\r' */
+    return c == ' ' || (unsigned char) (c - '\t') < 5;
+}
+
+/* Skip whitespace, and make sure the whole next token is in the
+ * buffer.  Returns false at the end of the input */
+static inline bool KeyTextNextToken(key_text_reader_t *r)
+{
+    for (;;) {
+        while (IsKeySpace(*r->pos))
+            r->pos++;
+
+        if (r->end - r->pos >= KEY_TEXT_TOKEN || r->eof)
+            return r->pos < r->end;
+
+        KeyTextRefill(r);
+    }
+}
+
+static bool KeyTextReadInt(key_text_reader_t *r, int *val)
+{
+    if (!KeyTextNextToken(r))
+        return false;
+
+    char *e;
+    long v = strtol(r->pos, &e, 10);
+    if (e == r->pos || v < INT_MIN || v > INT_MAX)
+        return false;
+
+    r->pos = e;
+    *val = (int) v;
+    return true;
+}
+
+static bool KeyTextReadFloat(key_text_reader_t *r, float *val)
+{
+    if (!KeyTextNextToken(r))
+        return false;
+
+    /* Same conversion as the %f of scanf */
+    char *e;
+    *val = strtof(r->pos, &e);
+    if (e == r->pos)
+        return false;
+
+    r->pos = e;
+    return true;
+}
+
+/* Read one descriptor value.  Values are stored in 8 bits; like the
+ * %hu of the old scanf parser followed by the narrowing to unsigned
+ * char, anything outside [0,255] keeps its low 8 bits */
+static inline bool KeyTextReadByte(key_text_reader_t *r, unsigned char *val)
+{
+    if (!KeyTextNextToken(r))
+        return false;
+
+    const char *p = r->pos;
+    unsigned int v = (unsigned char) (*p - '0');
+
+    if (v < 10) {
+        /* At most two more digits; the NUL at the end of the buffer
+         * stops the scan */
+        unsigned int d;
+        if ((d = (unsigned char) (p[1] - '0')) < 10) {
+            v = 10 * v + d;
+            if ((d = (unsigned char) (p[2] - '0')) < 10) {
+                v = 10 * v + d;
+                p++;
+            }
+            p++;
+        }
+        p++;
+
+        if (IsKeySpace(*p) || *p == 0) {
+            r->pos = (char *) p;
+            *val = (unsigned char) v;
+            return true;
+        }
+    }
+
+    /* A sign or more than three digits */
+    char *e;
+    unsigned long lv = strtoul(r->pos, &e, 10);
+    if (e == r->pos || !(IsKeySpace(*e) || *e == 0))
+        return false;
+
+    r->pos = e;
+    *val = (unsigned char) lv;
+    return true;
+}
+
+/* Parse a key file in Lowe's text format (see ReadKeys), decoding it
+ * in place without scanf */
+static int ParseKeysText(key_text_reader_t &r, KeyBuffer &buffer)
+{
+    int num, len;
+    if (!KeyTextReadInt(&r, &num) || !KeyTextReadInt(&r, &len) || 
+        num < 0) {
+        printf("Invalid keypoint file.\n");
+        return -1;
+    }
+
+    if (len != 128) {
+        printf("Keypoint descriptor length invalid (should be 128).");
+        return -1;
+    }
+
+    buffer.Reserve(num);
+
+    unsigned char *p = buffer.m_keys;
+    for (int i = 0; i < num; i++) {
+        keypt_t &pos = buffer.m_info[i];
+        bool valid = 
+            KeyTextReadFloat(&r, &pos.y) && KeyTextReadFloat(&r, &pos.x) &&
+            KeyTextReadFloat(&r, &pos.scale) && 
+            KeyTextReadFloat(&r, &pos.orient);
+
+        for (int j = 0; j < 128 && valid; j++)
+            valid = KeyTextReadByte(&r, p++);
+
+        if (!valid) {
+            printf("Invalid keypoint file format.");
+            return -1;
+        }
+    }
+
+    return num;
+}
+
+/* Parse a text key file from a stream, read in large blocks */
+static int ReadKeysText(key_read_fn read, void *stream, KeyBuffer &buffer)
+{
+    char block[KEY_TEXT_BLOCK + 1];
+
+    key_text_reader_t r;
+    r.read = read;
+    r.stream = stream;
+    r.buf = r.pos = r.end = block;
+    r.eof = false;
+    block[0] = 0;
+
+    return ParseKeysText(r, buffer);
+}
+
+/* Memory holding a whole file, read by ReadFromMemory */
+typedef struct {
+    const unsigned char *pos, *end;
+} key_memory_t;
+
+static size_t ReadFromMemory(void *dst, size_t len, void *stream)
+{
+    key_memory_t *m = (key_memory_t *) stream;
+    if (len > (size_t) (m->end - m->pos))
+        len = m->end - m->pos;
+
+    memcpy(dst, m->pos, len);
+    m->pos += len;
+
+    return len;
+}
+
+/* Largest ratio of inflated to compressed size trusted from a gzip
+ * trailer; key files compress by about 3:1 */
+#define INFLATE_MAX_RATIO 32
+
+/* Read a whole gzipped file and inflate it into out, followed by a
+ * NUL.  The compressed file is read with one fread, and inflated with
+ * as few calls as possible, into a buffer sized from the length
+ * stored at the end of the file.  Files that are not gzipped are
+ * passed through, as gzread does.  Returns the inflated length, or -1
+ * on an error */
+static long InflateFile(const char *filename, 
+                        std::vector<unsigned char> &in,
+                        std::vector<unsigned char> &out)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return -1;
+
+    struct stat sb;
+    if (fstat(fileno(f), &sb) != 0) {
+        fclose(f);
+        return -1;
+    }
+
+    size_t size = sb.st_size;
+    in.resize(size + 1);
+    size_t n = fread(&in[0], 1, size, f);
+    fclose(f);
+
+    if (n != size)
+        return -1;
+
+    if (size < 18 || in[0] != 0x1f || in[1] != 0x8b) {
+        /* Not gzipped */
+        out.resize(size + 1);
+        memcpy(&out[0], &in[0], size);
+        out[size] = 0;
+        return (long) size;
+    }
+
+    /* The last four bytes hold the length (mod 2^32) of the last
+     * member, which is usually the whole file.  A corrupt trailer can
+     * claim up to 4GB, so the guess is capped at INFLATE_MAX_RATIO
+     * times the compressed size; the loop below grows the buffer if
+     * the data really is larger */
+    size_t guess = 
+        (size_t) in[size - 4] | ((size_t) in[size - 3] << 8) | 
+        ((size_t) in[size - 2] << 16) | ((size_t) in[size - 1] << 24);
+
+    if (guess > size * INFLATE_MAX_RATIO)
+        guess = size * INFLATE_MAX_RATIO;
+
+    if (out.size() < guess + 1)
+        out.resize(guess + 1);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    /* 16 + MAX_WBITS: expect a gzip header */
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+        return -1;
+
+    z.next_in = &in[0];
+    z.avail_in = (uInt) size;
+
+    size_t len = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END || z.avail_in > 0) {
+        if (ret == Z_STREAM_END) {
+            /* Another gzip member follows; anything else after the
+             * end is ignored, as gzread does */
+            if (z.avail_in < 2 || z.next_in[0] != 0x1f || 
+                z.next_in[1] != 0x8b || inflateReset(&z) != Z_OK)
+                break;
+        }
+
+        if (len + 1 >= out.size())
+            out.resize(2 * out.size());
+
+        z.next_out = &out[len];
+        z.avail_out = (uInt) (out.size() - 1 - len);
+
+        ret = inflate(&z, Z_NO_FLUSH);
+        len = z.next_out - &out[0];
+
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            break;
+    }
+
+    inflateEnd(&z);
+
+    if (ret != Z_STREAM_END) {
+        printf("Error inflating file %s\n", filename);
+        return -1;
+    }
+
+    out[len] = 0;
+    return (long) len;
+}
+
+/* Parse a gzipped key file, in either format, after inflating it 
+ * whole */
+static int ReadKeysInflated(const char *filename, KeyBuffer &buffer)
+{
+    long len = InflateFile(filename, buffer.m_compressed, buffer.m_inflated);
+    if (len < 0)
+        return -1;
+
+    unsigned char *data = &buffer.m_inflated[0];
+
+    if (len >= 8 && memcmp(data, BINARY_KEY_MAGIC, 8) == 0) {
+        key_memory_t m;
+        m.pos = data + 8;
+        m.end = data + len;
+
+        return ReadKeysBinary(ReadFromMemory, &m, m.end - m.pos, buffer);
+    }
+
+    key_text_reader_t r;
+    r.read = NULL;
+    r.stream = NULL;
+    r.buf = r.pos = (char *) data;
+    r.end = (char *) data + len;
+    r.eof = true;
+
+    return ParseKeysText(r, buffer);
+}
+
+/* Widen 8-bit descriptors to shorts */
+static short int *WidenKeys(const unsigned char *keys, int num)
+{
+    size_t len = (size_t) num * 128;
+    short int *keys_short = new short int[len];
+    for (size_t i = 0; i < len; i++)
+        keys_short[i] = keys[i];
+
+    return keys_short;
+}
+
+/* Read a key file in any format into buffer */
+static int ReadKeyFileAny(const char *filename, KeyBuffer &buffer)
+{
+    int n;
+
+    FILE *file = fopen(filename, "rb");
     if (! file) {
         /* Try to file a gzipped keyfile */
         char buf[1024];
         sprintf(buf, "%s.gz", filename);
-        gzFile gzf = gzopen(buf, "rb");
 
-        if (gzf == NULL) {
+        if (access(buf, R_OK) != 0) {
             printf("Could not open file: %s\n", filename);
-            return 0;
-        } else {
-            int n = GetNumberOfKeysGzip(gzf);
-            gzclose(gzf);
-            return n;
+            return -1;
+        }
+
+        n = ReadKeysInflated(buf, buffer);
+    } else {
+        switch (GetKeyFileFormat(file)) {
+        case KeyFormatBinary:
+            n = ReadKeysBinary(ReadFromFile, file, GetRemainingBytes(file),
+                               buffer);
+            break;
+        case KeyFormatBinaryShort:
+            n = ReadKeysBinaryShort(file, buffer);
+            break;
+        default:
+            n = ReadKeysText(ReadFromFile, file, buffer);
+            break;
         }
+
+        fclose(file);
     }
-    
-    int n = GetNumberOfKeysNormal(file);
-    fclose(file);
+
     return n;
 }
 
-/* This reads a keypoint file from a given filename and returns the list
- * of keypoints. */
-int ReadKeyFile(const char *filename, short int **keys, keypt_t **info)
+/* Returns the number of keys in a file */
+int GetNumberOfKeys(const char *filename)
 {
     FILE *file;
 
-    file = fopen (filename, "r");
+    file = fopen (filename, "rb");
     if (! file) {
         /* Try to file a gzipped keyfile */
         char buf[1024];
@@ -123,17 +641,110 @@ int ReadKeyFile(const char *filename, short int **keys, keypt_t **info)
             printf("Could not open file: %s\n", filename);
             return 0;
         } else {
-            int n = ReadKeysGzip(gzf, keys, info);
+            char magic[8];
+            int header[2];
+            int n = 0;
+            if (gzread(gzf, magic, 8) == 8 &&
+                memcmp(magic, BINARY_KEY_MAGIC, 8) == 0) {
+                if (gzread(gzf, header, sizeof(header)) == sizeof(header))
+                    n = header[0];
+            } else {
+                gzrewind(gzf);
+                n = GetNumberOfKeysGzip(gzf);
+            }
+
             gzclose(gzf);
             return n;
         }
     }
     
-    int n = ReadKeys(file, keys, info);
+    int n = 0;
+    switch (GetKeyFileFormat(file)) {
+    case KeyFormatBinary:
+    case KeyFormatBinaryShort: {
+        int header[2];
+        if (fread(header, sizeof(int), 1, file) == 1)
+            n = header[0];
+        break;
+    }
+    default:
+        n = GetNumberOfKeysNormal(file);
+        break;
+    }
+
     fclose(file);
     return n;
+}
+
+int LoadKeyFile(const char *filename, KeyBuffer &buffer, 
+                double min_feature_scale, int max_keys)
+{
+    int num = ReadKeyFileAny(filename, buffer);
+
+    if (num < 0) {
+        buffer.m_num_keys = 0;
+        return -1;
+    }
+
+    if (min_feature_scale != 0.0 || max_keys > 0) {
+        /* Filter the keys in place */
+        int num_filtered = 0;
+        for (int i = 0; i < num; i++) {
+            if (buffer.m_info[i].scale < min_feature_scale)
+                continue;
+
+            if (num_filtered != i) {
+                memcpy(buffer.m_keys + (size_t) num_filtered * 128,
+                       buffer.m_keys + (size_t) i * 128, 128);
+                buffer.m_info[num_filtered] = buffer.m_info[i];
+            }
+
+            num_filtered++;
+
+            if (max_keys > 0 && num_filtered >= max_keys)
+                break;
+        }
 
-    // return ReadKeysMMAP(file);
+        num = num_filtered;
+    }
+
+    buffer.m_num_keys = num;
+    return num;
+}
+
+/* This reads a keypoint file from a given filename and returns the list
+ * of keypoints. */
+int ReadKeyFile(const char *filename, short int **keys, keypt_t **info)
+{
+    KeyBuffer buffer;
+    int num = LoadKeyFile(filename, buffer);
+
+    if (num < 0)
+        return 0;
+
+    *keys = WidenKeys(buffer.m_keys, num);
+
+    if (info != NULL)
+        *info = buffer.ReleaseInfo();
+
+    return num;
+}
+
+int ReadKeyFileUChar(const char *filename, unsigned char **keys, 
+                     keypt_t **info)
+{
+    KeyBuffer buffer;
+    int num = LoadKeyFile(filename, buffer);
+
+    if (num < 0)
+        return 0;
+
+    *keys = buffer.ReleaseKeys();
+
+    if (info != NULL)
+        *info = buffer.ReleaseInfo();
+
+    return num;
 }
 
 #if 0
@@ -214,9 +825,25 @@ std::vector<Keypoint *> ReadKeysMMAP(FILE *fp)
  * list of integers in range [0,255]. */
 int ReadKeys(FILE *fp, short int **keys, keypt_t **info)
 {
-    int i, num, len;
+    KeyBuffer buffer;
+    int num = ReadKeysText(ReadFromFile, fp, buffer);
 
-    std::vector<Keypoint *> kps;
+    if (num < 0)
+        return 0;
+
+    *keys = WidenKeys(buffer.m_keys, num);
+
+    if (info != NULL) 
+        *info = buffer.ReleaseInfo();
+
+    return num;
+}
+
+/* The original fscanf/sscanf parser for text key files, kept as the
+ * reference for ParseKeysText (see src/VocabTestKeys) */
+int ReadKeysReference(FILE *fp, short int **keys, keypt_t **info)
+{
+    int i, num, len;
 
     if (fscanf(fp, "%d %d", &num, &len) != 2) {
 	printf("Invalid keypoint file\n");
@@ -235,8 +862,6 @@ int ReadKeys(FILE *fp, short int **keys, keypt_t **info)
 
     short int *p = *keys;
     for (i = 0; i < num; i++) {
-	/* Allocate memory for the keypoint. */
-	// short int *d = new short int[128];
 	float x, y, scale, ori;
 
 	if (fscanf(fp, "%f %f %f %f\n", &y, &x, &scale, &ori) != 4) {
@@ -273,7 +898,7 @@ int ReadKeys(FILE *fp, short int **keys, keypt_t **info)
 	}
     }
 
-    return num; // kps;
+    return num;
 }
 
 int WriteBinaryKeyFile(const char *filename, int num_keys, 
@@ -297,71 +922,52 @@ int WriteBinaryKeyFile(const char *filename, int num_keys,
     return num_keys;
 }
 
-int ReadKeysGzip(gzFile fp, short int **keys, keypt_t **info)
+int WriteBinaryKeyFileUChar(const char *filename, int num_keys, 
+                            const unsigned char *keys, const keypt_t *info)
 {
-    int i, num, len;
-
-    std::vector<Keypoint *> kps;
-    char header[256];
-    gzgets(fp, header, 256);
+    FILE *f = fopen(filename, "wb");
+    
+    if (f == NULL) {
+        printf("[WriteBinaryKeyFileUChar] Error opening file %s for "
+               "writing\n", filename);
 
-    if (sscanf(header, "%d %d", &num, &len) != 2) {
-	printf("Invalid keypoint file.\n");
-	return 0;
+        return 0;
     }
 
-    if (len != 128) {
-	printf("Keypoint descriptor length invalid (should be 128).");
-	return 0;
-    }
+    int header[2] = { num_keys, 128 };
+    size_t len = (size_t) num_keys * 128;
 
-    *keys = new short int[128 * num];
+    int error = 
+        (fwrite(BINARY_KEY_MAGIC, 1, 8, f) != 8 ||
+         fwrite(header, sizeof(int), 2, f) != 2 ||
+         fwrite(info, sizeof(keypt_t), num_keys, f) != (size_t) num_keys ||
+         fwrite(keys, 1, len, f) != len);
 
-    if (info != NULL) 
-        *info = new keypt_t[num];
+    error = (fclose(f) != 0) || error;
 
-    short int *p = *keys;
-    for (i = 0; i < num; i++) {
-	/* Allocate memory for the keypoint. */
-	// short int *d = new short int[128];
-	float x, y, scale, ori;
-        char buf[1024];
-        gzgets(fp, buf, 1024);
+    if (error) {
+        printf("[WriteBinaryKeyFileUChar] Error writing file %s\n", 
+               filename);
+        return 0;
+    }
 
-	if (sscanf(buf, "%f %f %f %f\n", &y, &x, &scale, &ori) != 4) {
-	    printf("Invalid keypoint file format.");
-	    return 0;
-	}
+    return num_keys;
+}
 
-        if (info != NULL) {
-            (*info)[i].x = x;
-            (*info)[i].y = y;
-            (*info)[i].scale = scale;
-            (*info)[i].orient = ori;
-        }
-        
-	for (int line = 0; line < 7; line++) {
-	    gzgets(fp, buf, 1024);
+int ReadKeysGzip(gzFile fp, short int **keys, keypt_t **info)
+{
+    KeyBuffer buffer;
+    int num = ReadKeysText(ReadFromGzip, fp, buffer);
 
-	    if (line < 6) {
-		sscanf(buf, 
-		       "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu "
-		       "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu", 
-		       p+0, p+1, p+2, p+3, p+4, p+5, p+6, p+7, p+8, p+9, 
-		       p+10, p+11, p+12, p+13, p+14, 
-		       p+15, p+16, p+17, p+18, p+19);
+    if (num < 0)
+        return 0;
 
-		p += 20;
-	    } else {
-		sscanf(buf, 
-		       "%hu %hu %hu %hu %hu %hu %hu %hu",
-		       p+0, p+1, p+2, p+3, p+4, p+5, p+6, p+7);
-		p += 8;
-	    }
-	}
-    }
+    *keys = WidenKeys(buffer.m_keys, num);
+
+    if (info != NULL) 
+        *info = buffer.ReleaseInfo();
 
-    return num; // kps;
+    return num;
 }
 
 std::vector<KeypointMatch> 
@@ -53,14 +53,69 @@ typedef struct {
     float orient;
 } keypt_t;
 
+/* Buffers for the keys of one file, with 8-bit descriptors.  A buffer
+ * can be reused for many files, and only grows when a file has more
+ * keys than any before it */
+class KeyBuffer {
+public:
+    KeyBuffer() : m_num_keys(0), m_capacity(0), m_keys(NULL), m_info(NULL),
+                  m_load_time(0.0)
+    { }
+
+    ~KeyBuffer();
+
+    /* Make room for num keys; the contents are not kept */
+    void Reserve(int num);
+
+    /* Give up ownership of an array to the caller (who frees it with
+     * delete []) */
+    unsigned char *ReleaseKeys();
+    keypt_t *ReleaseInfo();
+
+    int m_num_keys;         /* Number of keys loaded */
+    int m_capacity;         /* Number of keys the arrays can hold */
+    unsigned char *m_keys;  /* Descriptors, 128 per key */
+    keypt_t *m_info;        /* Position and scale of each key */
+    double m_load_time;     /* Wall-clock seconds LoadKeyFiles took to
+                             * load the keys */
+
+    /* Scratch space for reading gzipped files */
+    std::vector<unsigned char> m_compressed;
+    std::vector<unsigned char> m_inflated;
+
+private:
+    KeyBuffer(const KeyBuffer &);
+    KeyBuffer &operator=(const KeyBuffer &);
+};
+
 /* Returns the number of keys in a file */
 int GetNumberOfKeys(const char *filename);
 
+/* Load the keys of a key file in any format (see ReadKeyFile) into
+ * buffer.  If min_feature_scale is non-zero, keys with a smaller
+ * scale are dropped, and if max_keys > 0, only the first max_keys
+ * keys that remain are kept.  Returns the number of keys loaded, or
+ * -1 if the file could not be read */
+int LoadKeyFile(const char *filename, KeyBuffer &buffer,
+                double min_feature_scale = 0.0, int max_keys = 0);
+
+/* Binary key files start with this magic, followed by the number of
+ * keys and the descriptor length (ints), the keypt_t of each key, and
+ * the 8-bit descriptors.  Files written by WriteBinaryKeyFile (with
+ * 16-bit descriptors and no magic) can be read as well */
+#define BINARY_KEY_MAGIC "KEYBIN01"
+
 /* This reads a keypoint file from a given filename and returns the list
- * of keypoints. */
+ * of keypoints.  The format (Lowe's text format or either binary
+ * format, possibly gzipped) is detected from the contents. */
 int ReadKeyFile(const char *filename, short int **keys, 
                 keypt_t **info = NULL);
 
+/* Same as ReadKeyFile, with 8-bit descriptors.  A binary file with
+ * 8-bit descriptors is read without conversion */
+int ReadKeyFileUChar(const char *filename, unsigned char **keys, 
+                     keypt_t **info = NULL);
+
 int ReadKeyPositions(const char *filename, keypt_t **info);
 
 /* Read keypoints from the given file pointer and return the list of
@@ -74,12 +129,21 @@ int ReadKeyPositions(const char *filename, keypt_t **info);
 int ReadKeys(FILE *fp, short int **keys, keypt_t **info = NULL);
 int ReadKeysGzip(gzFile fp, short int **keys, keypt_t **info = NULL);
 
+/* The original scanf-based text parser, slower than ReadKeys.  Kept
+ * as the reference that ReadKeys is checked against */
+int ReadKeysReference(FILE *fp, short int **keys, keypt_t **info = NULL);
+
 /* Read keys using MMAP to speed things up */
 std::vector<Keypoint *> ReadKeysMMAP(FILE *fp);
 
 int WriteBinaryKeyFile(const char *filename, int num_keys, 
                        const short int *keys, const keypt_t *info);
 
+/* Write a binary key file with 8-bit descriptors (see
+ * BINARY_KEY_MAGIC) */
+int WriteBinaryKeyFileUChar(const char *filename, int num_keys, 
+                            const unsigned char *keys, const keypt_t *info);
+
 #ifndef __SIFT_READER__
 /* Create a search tree for the given set of keypoints */
 ANNkd_tree *CreateSearchTree(int num_keys, short int *keys);
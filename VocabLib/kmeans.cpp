@@ -43,10 +43,47 @@
 
 #include <sys/time.h>
 
+#include <omp.h>
+
+#include "kmeans.h"
+#include "kmeans_hamerly.h"
 #include "kmeans_kd.h"
+#include "VocabDistance.h"
+
+/* Random number generator with explicit state (xorshift64*), so
+ * that clusterings running in parallel each have their own
+ * reproducible stream */
+unsigned long long seed_state(unsigned int seed)
+{
+    unsigned long long state = seed + 0x9e3779b97f4a7c15ULL;
+    state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    state = (state ^ (state >> 27)) * 0x94d049bb133111ebULL;
+    state ^= state >> 31;
+
+    return state != 0 ? state : 1;
+}
+
+unsigned int next_random(unsigned long long &state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+
+    return (unsigned int) ((state * 2685821657736338717ULL) >> 33);
+}
+
+/* Draw a random number in [0, n), for n up to 2^62 */
+unsigned long long next_random_ull(unsigned long long &state,
+                                   unsigned long long n)
+{
+    unsigned long long hi = next_random(state);
+    unsigned long long lo = next_random(state);
+
+    return ((hi << 31) | lo) % n;
+}
 
 /* Choose k numbers at random from 0 to n-1 */
-static void choose(int n, int k, int *arr)
+static void choose(int n, int k, int *arr, unsigned long long &state)
 {
     int i;
     
@@ -55,28 +92,173 @@ static void choose(int n, int k, int *arr)
         return;
     }
 
+    /* Mark the chosen numbers in a bitmap, so that each rejection
+     * test is O(1) rather than a scan over the earlier choices */
+    unsigned char *chosen = (unsigned char *) calloc((n + 7) / 8, 1);
+
     for (i = 0; i < k; i++) {
         while (1) {
-            int idx = rand() % n;
-            int j, redo = 0;
-
-            for (j = 0; j < i; j++) {
-                if (idx == arr[j]) {
-                    redo = 1;
-                    break;
-                }
-            }
+            int idx = next_random(state) % n;
 
-            if (!redo) {
+            if (!(chosen[idx / 8] & (1 << (idx % 8)))) {
+                chosen[idx / 8] |= (1 << (idx % 8));
                 arr[i] = idx;
                 break;
             }
         }
     }
+
+    free(chosen);
+}
+
+/* Lower the distances dist[i] of the points in [start, end) to their
+ * distance to the new mean c; return the sum of the new distances */
+static unsigned long long update_distances(int dim, int start, int end,
+                                           VectorSet v, 
+                                           const unsigned char *c,
+                                           unsigned long *dist, 
+                                           bool first)
+{
+    unsigned long long sum = 0;
+
+    for (int i = start; i < end; i++) {
+        unsigned long d = vec_diff_normsq(dim, v[i], c);
+        if (first || d < dist[i])
+            dist[i] = d;
+
+        sum += dist[i];
+    }
+
+    return sum;
+}
+
+/* Choose k numbers from 0 to n-1 with k-means++ seeding: the first
+ * at random, and each next one with probability proportional to the
+ * squared distance from v[i] to the closest vector chosen so far.
+ * The distance updates are split into fixed blocks that run in
+ * parallel, and the sampling walks the per-block sums in order, so
+ * the choice depends only on the random state */
+static void choose_plusplus(int n, int dim, int k, VectorSet v,
+                            int *arr, unsigned long long &state)
+{
+    if (k > n) {
+        printf("[choose_plusplus] Error: k > n\n");
+        return;
+    }
+
+    const int block_size = 1024;
+    int num_blocks = (n + block_size - 1) / block_size;
+
+    unsigned long *dist = 
+        (unsigned long *) malloc(sizeof(unsigned long) * n);
+    unsigned long long *sums = 
+        (unsigned long long *) malloc(sizeof(unsigned long long) * 
+                                      num_blocks);
+
+    arr[0] = next_random(state) % n;
+
+    for (int i = 1; i < k; i++) {
+        const unsigned char *c = v[arr[i - 1]];
+        bool first = (i == 1);
+
+        if (omp_in_parallel()) {
+            /* Called from a task; share the blocks with the team */
+#pragma omp taskloop
+            for (int b = 0; b < num_blocks; b++) {
+                int end = (b + 1) * block_size < n ? 
+                    (b + 1) * block_size : n;
+                sums[b] = update_distances(dim, b * block_size, end, 
+                                           v, c, dist, first);
+            }
+        } else {
+#pragma omp parallel for schedule(static)
+            for (int b = 0; b < num_blocks; b++) {
+                int end = (b + 1) * block_size < n ? 
+                    (b + 1) * block_size : n;
+                sums[b] = update_distances(dim, b * block_size, end, 
+                                           v, c, dist, first);
+            }
+        }
+
+        unsigned long long total = 0;
+        for (int b = 0; b < num_blocks; b++)
+            total += sums[b];
+
+        if (total == 0) {
+            /* Every point coincides with a chosen vector; fall back
+             * to a uniform choice */
+            arr[i] = next_random(state) % n;
+            continue;
+        }
+
+        /* Find the point where the running sum passes r */
+        unsigned long long r = next_random_ull(state, total);
+
+        int b = 0;
+        while (r >= sums[b]) {
+            r -= sums[b];
+            b++;
+        }
+
+        int idx = b * block_size;
+        while (r >= dist[idx]) {
+            r -= dist[idx];
+            idx++;
+        }
+
+        arr[i] = idx;
+    }
+
+    free(dist);
+    free(sums);
+}
+
+/* Refine the means with mini-batch kmeans (Sculley, "Web-scale
+ * k-means clustering", 2010).  Each iteration assigns a random batch
+ * of the vectors to the means, then moves each mean toward the
+ * vectors assigned to it, at a rate of 1 / (number of vectors
+ * assigned to it so far).  Returns the number of iterations run */
+static int minibatch_means(int n, int dim, int k, VectorSet v,
+                           double *means, int batch_size, int iterations,
+                           int max_pts_visit, centroid_index_t *index,
+                           unsigned long long &state)
+{
+    unsigned int *batch_idx = 
+        (unsigned int *) malloc(sizeof(unsigned int) * batch_size);
+    VectorSet batch(v.m_data, batch_idx, v.m_dim);
+    unsigned int *batch_clustering = 
+        (unsigned int *) calloc(batch_size, sizeof(unsigned int));
+    int *counts = (int *) calloc(k, sizeof(int));
+
+    for (int t = 0; t < iterations; t++) {
+        for (int i = 0; i < batch_size; i++)
+            batch_idx[i] = v.m_idx[next_random(state) % n];
+
+        double error;
+        compute_clustering_kd_tree(batch_size, dim, k, batch, means,
+                                   batch_clustering, error, max_pts_visit,
+                                   index);
+
+        for (int i = 0; i < batch_size; i++) {
+            int c = batch_clustering[i];
+            counts[c]++;
+
+            double rate = 1.0 / counts[c];
+            double *mean = means + c * dim;
+            for (int j = 0; j < dim; j++)
+                mean[j] += rate * ((double) batch[i][j] - mean[j]);
+        }
+    }
+
+    free(batch_idx);
+    free(batch_clustering);
+    free(counts);
+
+    return iterations;
 }
 
 /* Copy 'dim' elements to array 'vec' from array 'v' */
-static void fill_vector(double *vec, unsigned char *v, int dim)
+static void fill_vector(double *vec, const unsigned char *v, int dim)
 {
     int i;
     for (i = 0; i < dim; i++) 
@@ -84,11 +266,12 @@ static void fill_vector(double *vec, unsigned char *v, int dim)
 }
 
 /* Accumulate array 'v' (of dimension 'dim') into array 'acc' */
-static void vec_accum(int dim, double *acc, unsigned char *v)
+static void vec_accum(int dim, unsigned long long *acc, 
+                      const unsigned char *v)
 {
     int i;
     for (i = 0; i < dim; i++) {
-        acc[i] += (double) v[i];
+        acc[i] += v[i];
     }
 }
 
@@ -122,6 +305,20 @@ static double vec_normsq(int dim, double *v)
     return norm;
 }
 
+/* Accumulate the points in [start, end) into the sums (k*dim) and
+ * counts (k) of their means */
+static void accum_means(int dim, int start, int end, VectorSet v,
+                        unsigned int *clustering, 
+                        unsigned long long *sums, int *counts)
+{
+    for (int i = start; i < end; i++) {
+        unsigned int cluster = clustering[i];
+        vec_accum(dim, sums + cluster * dim, v[i]);
+
+        counts[cluster]++;
+    }
+}
+
 /* Function compute_means.  
  * This function recomputes the means based on the current clustering
  * of the points.
@@ -139,50 +336,134 @@ static double vec_normsq(int dim, double *v)
  *                array.  The means should be concatenated into one
  *                long array of length k*dim.
  */
-double compute_means(int n, int dim, int k, unsigned char **v, 
+double compute_means(int n, int dim, int k, VectorSet v, 
                      unsigned int *clustering, double *means_out)
 {
     int i;
     double max_change = 0.0;
-    int *counts = (int *) malloc(sizeof(int) * k);
-
-    for (i = 0; i < k * dim; i++)
-        means_out[i] = 0.0;
+    unsigned long long *sums = 
+        (unsigned long long *) calloc(k * dim, sizeof(unsigned long long));
+    int *counts = (int *) calloc(k, sizeof(int));
+
+    /* The sums are kept in integers, which are exact, so partial sums
+     * can be combined in any order: the means do not depend on how
+     * the points are split among threads.  Split into at most one
+     * part per thread, of at least 4096 points each */
+    int num_parts = 
+        omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+    if (num_parts > n / 4096)
+        num_parts = n / 4096;
+    if (num_parts < 1)
+        num_parts = 1;
+
+    if (num_parts == 1) {
+        accum_means(dim, 0, n, v, clustering, sums, counts);
+    } else if ((long long) num_parts * k * 16 <= n) {
+        /* Few means: each part sums into its own arrays, which are
+         * then added up */
+        unsigned long long *part_sums = (unsigned long long *) 
+            calloc((long long) num_parts * k * dim, 
+                   sizeof(unsigned long long));
+        int *part_counts = (int *) calloc(num_parts * k, sizeof(int));
+
+        if (omp_in_parallel()) {
+#pragma omp taskloop
+            for (int p = 0; p < num_parts; p++) {
+                accum_means(dim, (long long) n * p / num_parts, 
+                            (long long) n * (p + 1) / num_parts, 
+                            v, clustering, 
+                            part_sums + (long long) p * k * dim, 
+                            part_counts + p * k);
+            }
+        } else {
+#pragma omp parallel for num_threads(num_parts)
+            for (int p = 0; p < num_parts; p++) {
+                accum_means(dim, (long long) n * p / num_parts, 
+                            (long long) n * (p + 1) / num_parts, 
+                            v, clustering, 
+                            part_sums + (long long) p * k * dim, 
+                            part_counts + p * k);
+            }
+        }
 
-    for (i = 0; i < k; i++)
-        counts[i] = 0;
+        for (int p = 0; p < num_parts; p++) {
+            for (i = 0; i < k * dim; i++)
+                sums[i] += part_sums[(long long) p * k * dim + i];
+            for (i = 0; i < k; i++)
+                counts[i] += part_counts[p * k + i];
+        }
 
-    for (i = 0; i < n; i++) {
-        unsigned int cluster = clustering[i];
-        vec_accum(dim, means_out + cluster * dim, v[i]);
+        free(part_sums);
+        free(part_counts);
+    } else {
+        /* Many means: per-part arrays would cost more than the sums
+         * themselves.  Group the points by mean instead, and sum the
+         * means independently */
+        for (i = 0; i < n; i++)
+            counts[clustering[i]]++;
+
+        int *start = (int *) malloc(sizeof(int) * (k + 1));
+        int *order = (int *) malloc(sizeof(int) * n);
+
+        start[0] = 0;
+        for (i = 0; i < k; i++)
+            start[i + 1] = start[i] + counts[i];
+
+        int *pos = (int *) malloc(sizeof(int) * k);
+        memcpy(pos, start, sizeof(int) * k);
+        for (i = 0; i < n; i++)
+            order[pos[clustering[i]]++] = i;
+        free(pos);
+
+        if (omp_in_parallel()) {
+#pragma omp taskloop grainsize(64)
+            for (int c = 0; c < k; c++) {
+                for (int j = start[c]; j < start[c + 1]; j++)
+                    vec_accum(dim, sums + c * dim, v[order[j]]);
+            }
+        } else {
+#pragma omp parallel for schedule(dynamic, 64)
+            for (int c = 0; c < k; c++) {
+                for (int j = start[c]; j < start[c + 1]; j++)
+                    vec_accum(dim, sums + c * dim, v[order[j]]);
+            }
+        }
 
-        counts[cluster]++;
+        free(start);
+        free(order);
     }
-    
+
     /* Normalize new means */
     for (i = 0; i < k; i++) {
         if (counts[i] == 0) {
+            for (int j = 0; j < dim; j++)
+                means_out[i * dim + j] = 0.0;
             continue;
         }
-        
+
+        for (int j = 0; j < dim; j++)
+            means_out[i * dim + j] = (double) sums[i * dim + j];
+
         vec_scale(dim, means_out + i * dim, 1.0 / counts[i]);
     }
 
+    free(sums);
     free(counts);
 
     return max_change;
 }
 
-double compute_error(int n, int dim, int k, unsigned char **v,
-                     double *means, unsigned int *clustering)
+/* Sum of the squared distances from the points in [start, end) to
+ * their means */
+static double error_block(int dim, int start, int end, VectorSet v,
+                          double *means, unsigned int *clustering)
 {
-    int i, j;
+    double error = 0.0;
 
-    double error = 0;
-    for (i = 0; i < n; i++) {
+    for (int i = start; i < end; i++) {
         unsigned int c = clustering[i];
         
-        for (j = 0; j < dim; j++) {
+        for (int j = 0; j < dim; j++) {
             double d = means[c * dim + j] - v[i][j];
             error += d * d;
         }
@@ -191,6 +472,40 @@ double compute_error(int n, int dim, int k, unsigned char **v,
     return error;
 }
 
+double compute_error(int n, int dim, int k, VectorSet v,
+                     double *means, unsigned int *clustering)
+{
+    /* Sum over fixed blocks, then add the block sums in order, so
+     * the result does not depend on the number of threads */
+    const int block_size = 4096;
+    int num_blocks = (n + block_size - 1) / block_size;
+    double *errors = (double *) malloc(sizeof(double) * num_blocks);
+
+    if (omp_in_parallel()) {
+#pragma omp taskloop
+        for (int b = 0; b < num_blocks; b++) {
+            int end = (b + 1) * block_size < n ? (b + 1) * block_size : n;
+            errors[b] = error_block(dim, b * block_size, end, v, 
+                                    means, clustering);
+        }
+    } else {
+#pragma omp parallel for schedule(static)
+        for (int b = 0; b < num_blocks; b++) {
+            int end = (b + 1) * block_size < n ? (b + 1) * block_size : n;
+            errors[b] = error_block(dim, b * block_size, end, v, 
+                                    means, clustering);
+        }
+    }
+
+    double error = 0;
+    for (int b = 0; b < num_blocks; b++)
+        error += errors[b];
+
+    free(errors);
+
+    return error;
+}
+
 /* Function compute_clustering.  
  * This function recomputes the clustering based on the current means.
  * 
@@ -208,7 +523,7 @@ double compute_error(int n, int dim, int k, unsigned char **v,
  *   
  * Return value : return the number of points that changed assignment
  */
-int compute_clustering(int n, int dim, int k, unsigned char **v,
+int compute_clustering(int n, int dim, int k, VectorSet v,
                        double *means, unsigned int *clustering, 
                        double &error_out)
 {
@@ -253,6 +568,242 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
     return changed;
 }
 
+/* Assign the vectors to their closest means, with the method chosen
+ * in options.  The exact method skips most distances, so it does not
+ * compute the error (error_out is set to 0) */
+static int assign_means(int n, int dim, int k, VectorSet v,
+                        double *means, unsigned int *clustering, 
+                        double &error_out, const KMeansOptions &options,
+                        hamerly_bounds_t *bounds, centroid_index_t *index)
+{
+    if (options.assign == KMeansAssignExact) {
+        error_out = 0.0;
+        return compute_clustering_exact(n, dim, k, v, means, clustering,
+                                        bounds);
+    }
+
+    return compute_clustering_kd_tree(n, dim, k, v, means, clustering,
+                                      error_out, options.max_pts_visit,
+                                      index);
+}
+
+/* State of one restart of kmeans */
+typedef struct {
+    unsigned long long state;     /* random state */
+    double *means;                /* current means */
+    double *means_new;            /* work array for the next means */
+    unsigned int *clustering;     /* current assignment */
+    int *starts;                  /* indices of the initial means */
+    hamerly_bounds_t bounds;      /* bounds, for exact assignment */
+    centroid_index_t index;       /* search index over the means, for
+                                   * the other assignments */
+    double error;                 /* error of the current assignment */
+    int changed;                  /* changes in the last assignment */
+    int round;                    /* iterations run so far */
+    int batches;                  /* mini-batch iterations run */
+    bool done;                    /* converged */
+    bool pruned;                  /* abandoned as clearly worse */
+    timeval start;                /* start of the current round */
+} kmeans_restart_t;
+
+/* Parameters shared by all restarts of one kmeans call */
+typedef struct {
+    int n, dim, k;
+    VectorSet v;
+    const KMeansOptions *options;
+    kmeans_restart_t *restarts;
+} kmeans_job_t;
+
+static const double changed_pct_threshold = 0.05; // 0.005;
+
+static void restart_alloc(kmeans_restart_t *r, int n, int dim, int k)
+{
+    r->means = (double *) malloc(sizeof(double) * dim * k);
+    r->means_new = (double *) malloc(sizeof(double) * dim * k);
+    r->clustering = (unsigned int *) calloc(n, sizeof(unsigned int));
+    r->starts = (int *) malloc(sizeof(int) * k);
+
+    if (r->means == NULL || r->means_new == NULL || 
+        r->clustering == NULL || r->starts == NULL) {
+        printf("[kmeans] Error allocating restart\n");
+        exit(-1);
+    }
+
+    r->done = false;
+    r->pruned = false;
+}
+
+static void restart_free(kmeans_restart_t *r)
+{
+    free(r->means);
+    free(r->means_new);
+    free(r->clustering);
+    free(r->starts);
+}
+
+/* Does a restart keep a centroid index? */
+static bool restart_uses_index(int n, const KMeansOptions &options)
+{
+    return options.assign != KMeansAssignExact ||
+        (options.batch_size > 0 && options.batch_size < n);
+}
+
+/* Release the search state of a restart that is finished or pruned */
+static void restart_release(kmeans_restart_t *r, int n, 
+                            const KMeansOptions &options)
+{
+    if (options.assign == KMeansAssignExact)
+        hamerly_bounds_free(&r->bounds);
+
+    if (restart_uses_index(n, options))
+        centroid_index_free(&r->index);
+}
+
+/* Seconds since r->start; restarts the clock */
+static double restart_elapsed(kmeans_restart_t *r)
+{
+    timeval stop;
+    gettimeofday(&stop, NULL);
+
+    long seconds  = stop.tv_sec  - r->start.tv_sec;
+    long useconds = stop.tv_usec - r->start.tv_usec;
+    double etime = seconds + useconds * 0.000001;    
+
+    r->start = stop;
+
+    return etime;
+}
+
+/* Choose the initial means of a restart and assign the vectors to
+ * them.  In mini-batch mode, this runs the whole restart */
+static void restart_begin(int idx, kmeans_restart_t *r, int n, int dim, 
+                          int k, VectorSet v, 
+                          const KMeansOptions &options)
+{
+    if (options.init == KMeansInitPlusPlus)
+        choose_plusplus(n, dim, k, v, r->starts, r->state);
+    else
+        choose(n, k, r->starts, r->state);
+
+    for (int j = 0; j < k; j++) {
+        fill_vector(r->means + j * dim, v[r->starts[j]], dim);
+    }
+
+    gettimeofday(&r->start, NULL);
+
+    if (options.assign == KMeansAssignExact)
+        hamerly_bounds_init(&r->bounds, n, dim, k);
+
+    /* Mini-batches are always assigned with an index */
+    if (restart_uses_index(n, options))
+        centroid_index_init(&r->index, dim, k, options);
+
+    r->round = 0;
+    r->batches = 0;
+    r->done = false;
+    r->pruned = false;
+
+    if (options.batch_size > 0 && options.batch_size < n) {
+        r->batches = minibatch_means(n, dim, k, v, r->means, 
+                                   options.batch_size, 
+                                   options.batch_iterations, 
+                                   options.max_pts_visit, &r->index,
+                                   r->state);
+
+        /* Final assignment of all the vectors */
+        assign_means(n, dim, k, v, r->means, r->clustering, r->error,
+                     options, &r->bounds, &r->index);
+
+        r->done = true;
+
+        printf("Round %d: %d mini-batches of %d\n", 
+               idx, r->batches, options.batch_size);
+        printf("Round took %0.3lfs\n", restart_elapsed(r));            
+        fflush(stdout);
+    } else {
+        /* Compute new assignments */
+        r->changed = assign_means(n, dim, k, v, r->means, r->clustering, 
+                                  r->error, options, &r->bounds, 
+                                  &r->index);
+    }
+}
+
+/* Run one Lloyd iteration of a restart */
+static void restart_step(int idx, kmeans_restart_t *r, int n, int dim, 
+                         int k, VectorSet v, 
+                         const KMeansOptions &options)
+{
+    printf("Round %d: changed: %d\n", idx, r->changed);
+    printf("Round took %0.3lfs\n", restart_elapsed(r));            
+    fflush(stdout);
+
+    /* Recompute means */
+    compute_means(n, dim, k, v, r->clustering, r->means_new);
+    memcpy(r->means, r->means_new, sizeof(double) * dim * k);
+
+    /* Compute new assignments */
+    r->changed = assign_means(n, dim, k, v, r->means, r->clustering, 
+                              r->error, options, &r->bounds, &r->index);
+
+    r->round++;
+    r->done = ((double) r->changed / n <= changed_pct_threshold);
+}
+
+/* Error of the current assignment of a restart */
+static double restart_error(kmeans_restart_t *r, int n, int dim, int k,
+                            VectorSet v, const KMeansOptions &options)
+{
+    if (options.assign == KMeansAssignExact)
+        return compute_error(n, dim, k, v, r->means, r->clustering);
+
+    return r->error;
+}
+
+/* Finish a converged restart: compute its error and final means */
+static void restart_finish(kmeans_restart_t *r, int n, int dim, int k,
+                           VectorSet v, const KMeansOptions &options)
+{
+    r->error = restart_error(r, n, dim, k, v, options);
+
+    restart_release(r, n, options);
+
+    compute_means(n, dim, k, v, r->clustering, r->means_new);
+    memcpy(r->means, r->means_new, sizeof(double) * dim * k);
+}
+
+/* Run the restarts [0, num) of a job as concurrent tasks, up to
+ * max_round iterations each (or to convergence, if max_round < 0) */
+static void run_restarts(kmeans_job_t *job, int num, int max_round)
+{
+    for (int i = 0; i < num; i++) {
+        kmeans_restart_t *r = job->restarts + i;
+        if (r->pruned || r->done)
+            continue;
+
+#pragma omp task firstprivate(i, r)
+        {
+            const KMeansOptions &options = *job->options;
+
+            if (max_round >= 0)
+                restart_begin(i, r, job->n, job->dim, job->k, job->v, 
+                              options);
+
+            while (!r->done && (max_round < 0 || r->round < max_round))
+                restart_step(i, r, job->n, job->dim, job->k, job->v, 
+                             options);
+
+            if (r->done)
+                restart_finish(r, job->n, job->dim, job->k, job->v, 
+                               options);
+            else
+                r->error = restart_error(r, job->n, job->dim, job->k, 
+                                         job->v, options);
+        }
+    }
+
+#pragma omp taskwait
+}
+
 /* Function kmeans.  
  * Run kmeans clustering on a set of input descriptors.
  * 
@@ -262,6 +813,8 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
  *   k          : number of means to compute
  *   restarts   : number of random restarts to perform
  *   v          : array of pointers to dim-dimensional descriptors
+ *   seed       : seed for choosing the initial means
+ *   options    : clustering options
  * 
  * Output: 
  *   means      : array of output means.  The means should be
@@ -270,121 +823,145 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
  *                range between 0 and k-1), stored as an array of
  *                length n.  clustering[i] contains the
  *                cluster ID for point i
+ *   stats      : if not NULL, the work done is added to it
  */
-double kmeans(int n, int dim, int k, int restarts, unsigned char **v, 
-              double *means, unsigned int *clustering)
+double kmeans(int n, int dim, int k, int restarts, VectorSet v, 
+              double *means, unsigned int *clustering, unsigned int seed,
+              const KMeansOptions &options, kmeans_stats_t *stats)
 {
     int i;
     double min_error = DBL_MAX;
-
-    double *means_curr, *means_new, *work;
-    int *starts;
-    unsigned int *clustering_curr;
-
-    double changed_pct_threshold = 0.05; // 0.005;
+    int best = -1;
+    long total_rounds = 0, total_batches = 0;
 
     if (n <= k) {
         printf("[kmeans] Error: n <= k\n");
         return -1;
     }
 
-    means_curr = (double *) malloc(sizeof(double) * dim * k);
-    means_new = (double *) malloc(sizeof(double) * dim * k);
-    clustering_curr = (unsigned int *) malloc(sizeof(unsigned int) * n);
-    starts = (int *) malloc(sizeof(int) * k);
-    work = (double *) malloc(sizeof(double) * dim);
+    if (!options.parallel_restarts || restarts <= 1) {
+        /* One restart at a time, drawing all initial means from a
+         * single random stream */
+        kmeans_restart_t r;
+        restart_alloc(&r, n, dim, k);
+        r.state = seed_state(seed);
 
-    if (means_curr == NULL) {
-        printf("[kmeans] Error allocating means_curr\n");
-        exit(-1);
-    }
+        for (i = 0; i < restarts; i++) {
+            restart_begin(i, &r, n, dim, k, v, options);
 
-    if (means_new == NULL) {
-        printf("[kmeans] Error allocating means_new\n");
-        exit(-1);
-    }
+            /* restart_begin only marks mini-batch runs as done, so
+             * Lloyd runs get at least one iteration */
+            while (!r.done)
+                restart_step(i, &r, n, dim, k, v, options);
 
-    if (clustering_curr == NULL) {
-        printf("[kmeans] Error allocating clustering_curr\n");
-        exit(-1);
-    }
+            restart_finish(&r, n, dim, k, v, options);
 
-    if (starts == NULL) {
-        printf("[kmeans] Error allocating starts\n");
-        exit(-1);
-    }
+            /* The initial (or final, for mini-batches) assignment
+             * plus one per iteration */
+            total_rounds += r.round + 1;
+            total_batches += r.batches;
 
-    if (work == NULL) {
-        printf("[kmeans] Error allocating work\n");
-        exit(-1);
-    }
+            if (r.error < min_error) {
+                min_error = r.error;
+                memcpy(means, r.means, sizeof(double) * k * dim);
+                memcpy(clustering, r.clustering, sizeof(unsigned int) * n);
+            }
+        }
 
-    for (i = 0; i < restarts; i++) {
-        int j;
-        double max_change = 0.0;
-        double error = 0.0;
-        int round = 0;
+        restart_free(&r);
+    } else {
+        /* All restarts at once, each with its own random stream.
+         * After a few iterations, those clearly worse than the best
+         * are abandoned, and the rest run to convergence */
+        kmeans_job_t job;
+        job.n = n;
+        job.dim = dim;
+        job.k = k;
+        job.v = v;
+        job.options = &options;
+        job.restarts = new kmeans_restart_t[restarts];
+
+        for (i = 0; i < restarts; i++) {
+            restart_alloc(job.restarts + i, n, dim, k);
+            job.restarts[i].state = 
+                seed_state(seed ^ (0x9e3779b9u * (unsigned int) (i + 1)));
+        }
 
-        choose(n, k, starts);
+        for (int phase = 0; phase < 2; phase++) {
+            int max_round = (phase == 0) ? options.prune_rounds : -1;
 
-        for (j = 0; j < k; j++) {
-            fill_vector(means_curr + j * dim, v[starts[j]], dim);
-        }
-        
-        /* Compute new assignments */
-        timeval start, stop;
-        gettimeofday(&start, NULL);
+            if (omp_in_parallel()) {
+                run_restarts(&job, restarts, max_round);
+            } else {
+#pragma omp parallel
+                {
+#pragma omp single
+                    run_restarts(&job, restarts, max_round);
+                }
+            }
 
-        int changed = 0;
-        changed = compute_clustering_kd_tree(n, dim, k, v, means_curr,
-                                             clustering_curr, error);
+            if (phase > 0)
+                break;
 
-        double changed_pct = (double) changed / n;
+            /* Abandon the restarts that are clearly worse */
+            double partial_best = DBL_MAX;
+            for (i = 0; i < restarts; i++) {
+                if (job.restarts[i].error < partial_best)
+                    partial_best = job.restarts[i].error;
+            }
 
-        do {
-            gettimeofday(&stop, NULL);
+            for (i = 0; i < restarts; i++) {
+                kmeans_restart_t *r = job.restarts + i;
+                bool prune = !r->done && 
+                    r->error > partial_best * (1.0 + options.prune_margin);
 
-            long seconds  = stop.tv_sec  - start.tv_sec;
-            long useconds = stop.tv_usec - start.tv_usec;
-            double etime = seconds + useconds * 0.000001;    
+                printf("[kmeans] Restart %d: error %0.3f after %d "
+                       "iterations%s\n", i, r->error / n, r->round,
+                       r->done ? " (converged)" : 
+                       (prune ? ", pruned" : ""));
 
-            printf("Round %d: changed: %d\n", i, changed);
-            printf("Round took %0.3lfs\n", etime);            
+                if (prune) {
+                    r->pruned = true;
+                    restart_release(r, n, options);
+                }
+            }
             fflush(stdout);
+        }
 
-            gettimeofday(&start, NULL);
-
-            /* Recompute means */
-            max_change = compute_means(n, dim, k, v, 
-                                       clustering_curr, means_new);
+        for (i = 0; i < restarts; i++) {
+            kmeans_restart_t *r = job.restarts + i;
+            total_rounds += r->round + 1;
+            total_batches += r->batches;
 
-            memcpy(means_curr, means_new, sizeof(double) * dim * k);
+            if (r->pruned)
+                continue;
 
-            /* Compute new assignments */
-            changed = compute_clustering_kd_tree(n, dim, k, v, means_curr,
-                                                 clustering_curr, error);
+            printf("[kmeans] Restart %d: final error %0.3f after %d "
+                   "iterations\n", i, r->error / n, r->round);
 
-            changed_pct = (double) changed / n;
+            if (r->error < min_error) {
+                min_error = r->error;
+                best = i;
+            }
+        }
 
-            round++;
-        } while (changed_pct > changed_pct_threshold);
+        printf("[kmeans] Keeping restart %d of %d (error %0.3f)\n", 
+               best, restarts, min_error / n);
+        fflush(stdout);
 
-        max_change = compute_means(n, dim, k, v, clustering_curr, means_new);
-        memcpy(means_curr, means_new, sizeof(double) * dim * k);
+        memcpy(means, job.restarts[best].means, sizeof(double) * k * dim);
+        memcpy(clustering, job.restarts[best].clustering, 
+               sizeof(unsigned int) * n);
 
-        if (error < min_error) {
-            min_error = error;
-            memcpy(means, means_curr, sizeof(double) * k * dim);
-            memcpy(clustering, clustering_curr, sizeof(unsigned int) * n);
-        }
+        for (i = 0; i < restarts; i++)
+            restart_free(job.restarts + i);
+        delete [] job.restarts;
     }
 
-
-    free(means_curr);
-    free(means_new);
-    free(clustering_curr);
-    free(starts);
-    free(work);
+    if (stats != NULL) {
+        stats->rounds += total_rounds;
+        stats->batches += total_batches;
+    }
 
     return compute_error(n, dim, k, v, means, clustering);
 }
@@ -3,13 +3,114 @@
 #ifndef __KMEANS_H__
 #define __KMEANS_H__
 
+#include <stddef.h>
+
+/* A set of vectors stored in one packed array (e.g., a mapped
+ * training file) and referenced by 32-bit index: vector i is
+ * data + idx[i] * dim.  Cheap to pass by value; v + off is the set
+ * starting at vector off of v */
+class VectorSet {
+public:
+    VectorSet() : m_data(NULL), m_idx(NULL), m_dim(0) { }
+    VectorSet(const unsigned char *data, unsigned int *idx, int dim) :
+        m_data(data), m_idx(idx), m_dim(dim) { }
+
+    const unsigned char *operator[](long i) const {
+        return m_data + (size_t) m_idx[i] * m_dim;
+    }
+
+    VectorSet operator+(long off) const {
+        return VectorSet(m_data, m_idx + off, m_dim);
+    }
+
+    const unsigned char *m_data;  /* Packed vectors */
+    unsigned int *m_idx;          /* Index of each vector in m_data */
+    int m_dim;                    /* Dimension of the vectors */
+};
+
+/* Ways of choosing the initial means */
+typedef enum {
+    KMeansInitRandom = 0,    /* k distinct input vectors at random */
+    KMeansInitPlusPlus = 1,  /* k-means++: each new mean is drawn with
+                              * probability proportional to the squared
+                              * distance to the closest mean so far.
+                              * Costs O(n k dim / threads) */
+} KMeansInit;
+
+/* Ways of assigning vectors to their closest means */
+typedef enum {
+    KMeansAssignKdTree = 0,  /* approximate search in a kd-tree over the
+                              * means, rebuilt every round */
+    KMeansAssignExact = 1,   /* exact, with Hamerly's bounds to skip
+                              * most distance computations after the
+                              * first round (which is brute force) */
+    KMeansAssignKdForest = 2,  /* approximate search in a randomized
+                                * kd-forest over the means (approximate
+                                * kmeans) */
+} KMeansAssign;
+
+/* Options for kmeans */
+class KMeansOptions {
+public:
+    KMeansOptions() : init(KMeansInitRandom), 
+                      assign(KMeansAssignKdTree), max_pts_visit(512),
+                      forest_trees(4), index_drift(0.0),
+                      parallel_restarts(false), prune_rounds(3),
+                      prune_margin(0.02),
+                      batch_size(0), batch_iterations(100) { }
+
+    KMeansInit init;       /* how the initial means are chosen */
+    KMeansAssign assign;   /* how vectors are assigned to means */
+    int max_pts_visit;     /* points visited per kd-tree or kd-forest
+                            * search */
+    int forest_trees;      /* trees in the kd-forest */
+
+    /* The kd-tree or kd-forest over the means is kept across rounds,
+     * with its points moved to the new means in place; it is rebuilt
+     * only once some mean has moved more than index_drift since the
+     * last build.  With the default of 0, that is whenever any mean
+     * moves.  Larger values save rebuilds late in the clustering, at
+     * the cost of a more approximate search */
+    double index_drift;
+
+    /* Parallel restarts: if set, all restarts run concurrently (each
+     * with its own random stream).  After prune_rounds iterations,
+     * any restart whose error exceeds the best by more than a factor
+     * of (1 + prune_margin) is abandoned; the others run to
+     * convergence */
+    bool parallel_restarts;
+    int prune_rounds;
+    double prune_margin;
+
+    /* Mini-batch mode: if batch_size > 0 (and less than the number of
+     * input vectors), the means are refined with batch_iterations
+     * steps of mini-batch kmeans, each on batch_size random vectors,
+     * instead of full Lloyd iterations.  All vectors are assigned to
+     * the resulting means once at the end.  The batches themselves
+     * are always assigned with the kd-tree */
+    int batch_size;
+    int batch_iterations;
+};
+
+/* Work done by kmeans, summed over restarts (and, when building a
+ * tree, over nodes) */
+typedef struct {
+    long rounds;    /* Lloyd rounds: assignments of all the input
+                     * vectors, i.e., the initial (or, in mini-batch
+                     * mode, final) assignment plus one per iteration */
+    long batches;   /* mini-batch iterations */
+} kmeans_stats_t;
+
 /* Run kmeans on a set of input vectors 
  * 
  * Inputs: n        : number of input vectors
  *         dim      : dimension of each input vector
  *         k        : number of means to compute
  *         restarts : number of random restarts to perform
- *         v        : set of pointers to input vectors (stored as arrays)
+ *         v        : set of input vectors (see VectorSet)
+ *         seed     : seed for the random choice of initial means; the
+ *                    result depends only on the inputs and the seed
+ *         options  : clustering options (see KMeansOptions)
  * 
  * Outputs: means      : vector of means (stored as a flat array,
  *                       i.e., the means are concatenated together in
@@ -17,8 +118,18 @@
  *          clustering : array containing assignment of input points
  *                       to clusters -- clustering[i] contains the
  *                       cluster ID for point i
+ *          stats      : if not NULL, the work done is added to it
  */
-double kmeans(int n, int dim, int k, int restarts, unsigned char **v, 
-              double *means, unsigned int *clustering);
+double kmeans(int n, int dim, int k, int restarts, VectorSet v, 
+              double *means, unsigned int *clustering, unsigned int seed,
+              const KMeansOptions &options, kmeans_stats_t *stats = NULL);
+
+/* Random number generator with explicit state (xorshift64*): 
+ * seed_state turns a seed into a state, next_random returns 31 random
+ * bits, and next_random_ull a random number from 0 to n-1 */
+unsigned long long seed_state(unsigned int seed);
+unsigned int next_random(unsigned long long &state);
+unsigned long long next_random_ull(unsigned long long &state,
+                                   unsigned long long n);
 
 #endif /* __KMEANS_H__ */
@@ -0,0 +1,378 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+
+/* kmeans_forest.cpp */
+/* Randomized kd-forest for approximate nearest mean search */
+
+#include <float.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <omp.h>
+
+#include "kmeans.h"
+#include "kmeans_forest.h"
+
+/* Points per leaf, and the number of highest-variance dimensions the
+ * split dimension is chosen from */
+#define FOREST_LEAF_SIZE 4
+#define FOREST_RAND_DIMS 5
+/* Points sampled to estimate the variances at a node */
+#define FOREST_VAR_SAMPLES 128
+
+/* Orders point indices by one coordinate */
+class forest_coord_less {
+public:
+    forest_coord_less(float **pts, int dim) : m_pts(pts), m_dim(dim) { }
+    bool operator()(int a, int b) const { 
+        return m_pts[a][m_dim] < m_pts[b][m_dim];
+    }
+
+    float **m_pts;
+    int m_dim;
+};
+
+/* Choose the split dimension of the points idx[0..n-1] at random
+ * among the FOREST_RAND_DIMS of highest variance */
+static int choose_split_dim(float **pts, int dim, const int *idx, int n,
+                            double *mean, double *var, int *top,
+                            unsigned long long &state)
+{
+    int samples = n < FOREST_VAR_SAMPLES ? n : FOREST_VAR_SAMPLES;
+
+    for (int j = 0; j < dim; j++) {
+        mean[j] = 0.0;
+        var[j] = 0.0;
+    }
+
+    for (int i = 0; i < samples; i++) {
+        const float *p = pts[idx[i]];
+        for (int j = 0; j < dim; j++)
+            mean[j] += p[j];
+    }
+
+    for (int j = 0; j < dim; j++)
+        mean[j] /= samples;
+
+    for (int i = 0; i < samples; i++) {
+        const float *p = pts[idx[i]];
+        for (int j = 0; j < dim; j++) {
+            double d = p[j] - mean[j];
+            var[j] += d * d;
+        }
+    }
+
+    /* Insertion into the short list of highest variances */
+    int num_top = 0;
+    for (int j = 0; j < dim; j++) {
+        if (num_top == FOREST_RAND_DIMS && var[j] <= var[top[num_top - 1]])
+            continue;
+
+        int pos = (num_top < FOREST_RAND_DIMS) ? num_top++ : num_top - 1;
+        while (pos > 0 && var[top[pos - 1]] < var[j]) {
+            top[pos] = top[pos - 1];
+            pos--;
+        }
+
+        top[pos] = j;
+    }
+
+    return top[next_random(state) % num_top];
+}
+
+/* Build one tree over idx[0..n-1] (reordered in place) into nodes,
+ * returning the number of nodes used */
+static int build_tree(float **pts, int dim, int *idx, int n,
+                      kd_forest_node_t *nodes, unsigned long long &state)
+{
+    double *mean = (double *) malloc(sizeof(double) * dim);
+    double *var = (double *) malloc(sizeof(double) * dim);
+    int top[FOREST_RAND_DIMS];
+
+    /* Nodes are split breadth-first from a queue of pending nodes,
+     * each with its range of idx */
+    int *lo = (int *) malloc(sizeof(int) * 2 * n);
+    int *hi = (int *) malloc(sizeof(int) * 2 * n);
+
+    int num_nodes = 1;
+    lo[0] = 0;
+    hi[0] = n;
+
+    for (int curr = 0; curr < num_nodes; curr++) {
+        kd_forest_node_t *node = nodes + curr;
+        int start = lo[curr], end = hi[curr];
+
+        if (end - start <= FOREST_LEAF_SIZE) {
+            node->dim = -1;
+            node->cut = 0.0f;
+            node->child[0] = start;
+            node->child[1] = end;
+            continue;
+        }
+
+        int d = choose_split_dim(pts, dim, idx + start, end - start,
+                                 mean, var, top, state);
+        int mid = start + (end - start) / 2;
+        std::nth_element(idx + start, idx + mid, idx + end, 
+                         forest_coord_less(pts, d));
+
+        node->dim = d;
+        node->cut = pts[idx[mid]][d];
+        node->child[0] = num_nodes;
+        node->child[1] = num_nodes + 1;
+
+        lo[num_nodes] = start;
+        hi[num_nodes] = mid;
+        lo[num_nodes + 1] = mid;
+        hi[num_nodes + 1] = end;
+        num_nodes += 2;
+    }
+
+    free(mean);
+    free(var);
+    free(lo);
+    free(hi);
+
+    return num_nodes;
+}
+
+void kd_forest_build(kd_forest_t *forest, float **pts, int n, int dim,
+                     int num_trees, unsigned int seed)
+{
+    forest->n = n;
+    forest->dim = dim;
+    forest->num_trees = num_trees;
+    forest->pts = pts;
+    forest->max_nodes = 2 * n;
+    forest->nodes = (kd_forest_node_t *) 
+        malloc(sizeof(kd_forest_node_t) * forest->max_nodes * num_trees);
+    forest->idx = (int *) malloc(sizeof(int) * n * num_trees);
+
+    if (forest->nodes == NULL || forest->idx == NULL) {
+        printf("[kd_forest_build] Error allocating forest\n");
+        exit(-1);
+    }
+
+    /* The trees are independent, and each has its own random stream */
+    if (omp_in_parallel()) {
+#pragma omp taskloop
+        for (int t = 0; t < num_trees; t++) {
+            unsigned long long state = seed_state(seed + t);
+            int *idx = forest->idx + (size_t) t * n;
+            for (int i = 0; i < n; i++)
+                idx[i] = i;
+
+            build_tree(pts, dim, idx, n, 
+                       forest->nodes + (size_t) t * forest->max_nodes, state);
+        }
+    } else {
+#pragma omp parallel for
+        for (int t = 0; t < num_trees; t++) {
+            unsigned long long state = seed_state(seed + t);
+            int *idx = forest->idx + (size_t) t * n;
+            for (int i = 0; i < n; i++)
+                idx[i] = i;
+
+            build_tree(pts, dim, idx, n, 
+                       forest->nodes + (size_t) t * forest->max_nodes, state);
+        }
+    }
+}
+
+void kd_forest_free(kd_forest_t *forest)
+{
+    free(forest->nodes);
+    free(forest->idx);
+    forest->nodes = NULL;
+    forest->idx = NULL;
+}
+
+void kd_forest_search_init(kd_forest_search_t *search, 
+                           const kd_forest_t *forest)
+{
+    search->query = 0;
+    search->checked = (int *) calloc(forest->n, sizeof(int));
+    search->heap_size = 0;
+    search->heap_capacity = 64;
+    search->heap = (kd_forest_branch_t *) 
+        malloc(sizeof(kd_forest_branch_t) * search->heap_capacity);
+}
+
+void kd_forest_search_free(kd_forest_search_t *search)
+{
+    free(search->checked);
+    free(search->heap);
+}
+
+/* Min-heap of branches on their distance bound */
+static void heap_push(kd_forest_search_t *search, float dist, int node)
+{
+    if (search->heap_size == search->heap_capacity) {
+        search->heap_capacity *= 2;
+        search->heap = (kd_forest_branch_t *) 
+            realloc(search->heap, 
+                    sizeof(kd_forest_branch_t) * search->heap_capacity);
+    }
+
+    kd_forest_branch_t *heap = search->heap;
+    int i = search->heap_size++;
+    while (i > 0 && heap[(i - 1) / 2].dist > dist) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i].dist = dist;
+    heap[i].node = node;
+}
+
+static kd_forest_branch_t heap_pop(kd_forest_search_t *search)
+{
+    kd_forest_branch_t *heap = search->heap;
+    kd_forest_branch_t top = heap[0];
+    kd_forest_branch_t last = heap[--search->heap_size];
+
+    int n = search->heap_size;
+    int i = 0;
+    while (2 * i + 1 < n) {
+        int c = 2 * i + 1;
+        if (c + 1 < n && heap[c + 1].dist < heap[c].dist)
+            c++;
+        if (heap[c].dist >= last.dist)
+            break;
+
+        heap[i] = heap[c];
+        i = c;
+    }
+
+    if (n > 0)
+        heap[i] = last;
+
+    return top;
+}
+
+/* Squared distance, abandoned (with a result above bound) once it
+ * exceeds bound */
+static float dist_bounded(const float *a, const float *b, int dim, 
+                          float bound)
+{
+    float dist = 0.0f;
+    for (int j = 0; j < dim; j += 16) {
+        int end = j + 16 < dim ? j + 16 : dim;
+        for (int l = j; l < end; l++) {
+            float d = a[l] - b[l];
+            dist += d * d;
+        }
+
+        if (dist > bound)
+            break;
+    }
+
+    return dist;
+}
+
+int kd_forest_search(const kd_forest_t *forest, kd_forest_search_t *search,
+                     const float *q, int max_checks, float &dist_out)
+{
+    int best = -1;
+    float best_dist = FLT_MAX;
+    int checks = 0;
+
+    /* Start the stamps over before they overflow */
+    if (search->query == INT_MAX) {
+        memset(search->checked, 0, sizeof(int) * forest->n);
+        search->query = 0;
+    }
+
+    int query = ++search->query;
+
+    search->heap_size = 0;
+
+    /* Start at the root of every tree */
+    for (int t = 0; t < forest->num_trees; t++)
+        heap_push(search, 0.0f, t * forest->max_nodes);
+
+    while (search->heap_size > 0 && 
+           (checks < max_checks || best == -1)) {
+        kd_forest_branch_t branch = heap_pop(search);
+        if (branch.dist >= best_dist)
+            break;
+
+        /* Descend to a leaf, keeping the far sides for later */
+        int tree = branch.node / forest->max_nodes;
+        const kd_forest_node_t *nodes = 
+            forest->nodes + (size_t) tree * forest->max_nodes;
+        const kd_forest_node_t *node = 
+            forest->nodes + branch.node;
+
+        while (node->dim >= 0) {
+            float diff = q[node->dim] - node->cut;
+            int near = diff < 0.0f ? node->child[0] : node->child[1];
+            int far = diff < 0.0f ? node->child[1] : node->child[0];
+
+            float dist = branch.dist + diff * diff;
+            if (dist < best_dist)
+                heap_push(search, dist, tree * forest->max_nodes + far);
+
+            node = nodes + near;
+        }
+
+        const int *idx = forest->idx + (size_t) tree * forest->n;
+        for (int i = node->child[0]; i < node->child[1]; i++) {
+            int p = idx[i];
+            if (search->checked[p] == query)
+                continue;
+
+            search->checked[p] = query;
+            checks++;
+
+            float dist = dist_bounded(q, forest->pts[p], forest->dim, 
+                                      best_dist);
+            if (dist < best_dist || (dist == best_dist && p < best)) {
+                best = p;
+                best_dist = dist;
+            }
+        }
+    }
+
+    dist_out = best_dist;
+
+    return best;
+}
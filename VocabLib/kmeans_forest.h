@@ -0,0 +1,62 @@
+/* kmeans_forest.h */
+
+#ifndef __KMEANS_FOREST_H__
+#define __KMEANS_FOREST_H__
+
+/* A randomized kd-forest, for the approximate kmeans of Philbin et
+ * al. ("Object retrieval with large vocabularies and fast spatial
+ * matching", 2007).  Each tree splits at the median of a dimension
+ * chosen at random among the few of highest variance, and a search
+ * explores all of the trees with one priority queue, checking at most
+ * a given number of points.  The forest refers to the points rather
+ * than copying them, so they can be moved in place between builds,
+ * at the cost of a more approximate search */
+
+typedef struct {
+    int dim;          /* Split dimension, or -1 for a leaf */
+    float cut;        /* Split value */
+    int child[2];     /* Children of a split; for a leaf, the range
+                       * [child[0], child[1]) of its points in idx */
+} kd_forest_node_t;
+
+typedef struct {
+    int n, dim, num_trees;
+    float **pts;              /* The points (not owned) */
+    int max_nodes;            /* Nodes allocated per tree */
+    kd_forest_node_t *nodes;  /* Nodes of each tree; node 0 is a root */
+    int *idx;                 /* Points of the leaves of each tree */
+} kd_forest_t;
+
+/* A branch not taken during a search */
+typedef struct {
+    float dist;       /* Lower bound on the distance of its points */
+    int node;         /* Index of the node in forest->nodes */
+} kd_forest_branch_t;
+
+/* Scratch space for searching a forest, for one thread at a time.
+ * It can be kept across searches, and across rebuilds of a forest
+ * over the same number of points: each search only bumps the query
+ * stamp */
+typedef struct {
+    int query;                 /* Number of the current query */
+    int *checked;              /* Per point: last query that checked it */
+    kd_forest_branch_t *heap;  /* Branches to explore, closest first */
+    int heap_size, heap_capacity;
+} kd_forest_search_t;
+
+/* Build a forest of num_trees trees over the n points pts, drawing
+ * the random choices from seed */
+void kd_forest_build(kd_forest_t *forest, float **pts, int n, int dim,
+                     int num_trees, unsigned int seed);
+void kd_forest_free(kd_forest_t *forest);
+
+void kd_forest_search_init(kd_forest_search_t *search, 
+                           const kd_forest_t *forest);
+void kd_forest_search_free(kd_forest_search_t *search);
+
+/* Return the (approximately) closest point to q, checking at most
+ * max_checks points, and its squared distance in dist_out */
+int kd_forest_search(const kd_forest_t *forest, kd_forest_search_t *search,
+                     const float *q, int max_checks, float &dist_out);
+
+#endif /* __KMEANS_FOREST_H__ */
@@ -0,0 +1,303 @@
+/* 
+ * Copyright 2011-2012 Noah Snavely, Cornell University
+ * (snavely@cs.cornell.edu).  All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY NOAH SNAVELY ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL NOAH SNAVELY OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ * 
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of Cornell University.
+ *
+ */
+
+/* kmeans_hamerly.cpp */
+/* Exact kmeans assignment accelerated with Hamerly's bounds */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include "kmeans_hamerly.h"
+
+/* Round to float away from the bound being tightened, so that stored
+ * bounds stay valid */
+static float round_up(double x)
+{
+    float f = (float) x;
+    if ((double) f < x)
+        f = nextafterf(f, FLT_MAX);
+    return f;
+}
+
+static float round_down(double x)
+{
+    float f = (float) x;
+    if ((double) f > x)
+        f = nextafterf(f, -FLT_MAX);
+    return f;
+}
+
+static double dist_vec_mean(int dim, const unsigned char *v, 
+                            const double *mean)
+{
+    double d = 0.0;
+    for (int j = 0; j < dim; j++) {
+        double t = mean[j] - (double) v[j];
+        d += t * t;
+    }
+
+    return sqrt(d);
+}
+
+static double dist_means(int dim, const double *a, const double *b)
+{
+    double d = 0.0;
+    for (int j = 0; j < dim; j++) {
+        double t = a[j] - b[j];
+        d += t * t;
+    }
+
+    return sqrt(d);
+}
+
+/* Find the closest and second closest means to v by brute force,
+ * starting with mean 'first'.  The sum for a mean stops as soon as it
+ * passes the second closest distance so far, since that mean can then
+ * be neither of the two */
+static int nearest_two(int dim, int k, const unsigned char *v, 
+                       const double *means, int first, 
+                       double &d1, double &d2)
+{
+    int best = -1;
+    double min1 = DBL_MAX, min2 = DBL_MAX;
+
+    for (int i = 0; i < k; i++) {
+        int c = (first + i) % k;
+        const double *mean = means + c * dim;
+
+        double d = 0.0;
+        int j = 0;
+        while (j < dim) {
+            int end = j + 16 < dim ? j + 16 : dim;
+            for (; j < end; j++) {
+                double t = mean[j] - (double) v[j];
+                d += t * t;
+            }
+
+            if (d > min2)
+                break;
+        }
+
+        if (d > min2)
+            continue;
+
+        if (d < min1 || (d == min1 && c < best)) {
+            min2 = min1;
+            min1 = d;
+            best = c;
+        } else {
+            min2 = d;
+        }
+    }
+
+    d1 = sqrt(min1);
+    d2 = (min2 == DBL_MAX) ? FLT_MAX : sqrt(min2);
+
+    return best;
+}
+
+void hamerly_bounds_init(hamerly_bounds_t *bounds, int n, int dim, int k)
+{
+    bounds->rounds = 0;
+    bounds->upper = (float *) malloc(sizeof(float) * n);
+    bounds->lower = (float *) malloc(sizeof(float) * n);
+    bounds->means_prev = (double *) malloc(sizeof(double) * k * dim);
+    bounds->drift = (double *) malloc(sizeof(double) * k);
+    bounds->half_sep = (double *) malloc(sizeof(double) * k);
+
+    if (bounds->upper == NULL || bounds->lower == NULL || 
+        bounds->means_prev == NULL || bounds->drift == NULL || 
+        bounds->half_sep == NULL) {
+        printf("[hamerly_bounds_init] Error allocating bounds\n");
+        exit(-1);
+    }
+}
+
+void hamerly_bounds_free(hamerly_bounds_t *bounds)
+{
+    free(bounds->upper);
+    free(bounds->lower);
+    free(bounds->means_prev);
+    free(bounds->drift);
+    free(bounds->half_sep);
+}
+
+/* Assign the points in [start, end), returning the number that
+ * changed.  drift_max is the largest drift of any mean (that of mean
+ * c_max) and drift_next the largest of the others */
+static int assign_block_exact(int dim, int k, int start, int end,
+                              VectorSet v, double *means,
+                              unsigned int *clustering, 
+                              hamerly_bounds_t *bounds, 
+                              int c_max, double drift_max, 
+                              double drift_next)
+{
+    int changed = 0;
+
+    for (int i = start; i < end; i++) {
+        double d1, d2;
+
+        if (bounds->rounds == 0) {
+            int best = nearest_two(dim, k, v[i], means, 0, d1, d2);
+
+            if ((int) clustering[i] != best) {
+                changed++;
+                clustering[i] = best;
+            }
+
+            bounds->upper[i] = round_up(d1);
+            bounds->lower[i] = round_down(d2);
+            continue;
+        }
+
+        int a = clustering[i];
+
+        /* Move the bounds by the drift of the means */
+        double upper = bounds->upper[i] + bounds->drift[a];
+        double lower = bounds->lower[i] - 
+            (a == c_max ? drift_next : drift_max);
+        double bound = lower > bounds->half_sep[a] ? 
+            lower : bounds->half_sep[a];
+
+        if (upper >= bound) {
+            /* Tighten the upper bound and try again */
+            upper = dist_vec_mean(dim, v[i], means + a * dim);
+
+            if (upper >= bound) {
+                int best = nearest_two(dim, k, v[i], means, a, d1, d2);
+
+                if (best != a) {
+                    changed++;
+                    clustering[i] = best;
+                }
+
+                upper = d1;
+                lower = d2;
+            }
+        }
+
+        bounds->upper[i] = round_up(upper);
+        bounds->lower[i] = round_down(lower);
+    }
+
+    return changed;
+}
+
+int compute_clustering_exact(int n, int dim, int k, VectorSet v,
+                             double *means, unsigned int *clustering,
+                             hamerly_bounds_t *bounds)
+{
+    int c_max = -1;
+    double drift_max = 0.0, drift_next = 0.0;
+
+    if (bounds->rounds > 0) {
+        /* How far has each mean moved since the last round? */
+        for (int c = 0; c < k; c++) {
+            double d = dist_means(dim, means + c * dim, 
+                                  bounds->means_prev + c * dim);
+            bounds->drift[c] = d;
+
+            if (d > drift_max) {
+                drift_next = drift_max;
+                drift_max = d;
+                c_max = c;
+            } else if (d > drift_next) {
+                drift_next = d;
+            }
+        }
+    }
+
+    /* Half the distance from each mean to the closest other one.
+     * This costs O(k^2 dim), so it is only worth it when k^2 <= n;
+     * otherwise only the per-point lower bounds are used */
+    if ((double) k * k <= (double) n) {
+        for (int c = 0; c < k; c++)
+            bounds->half_sep[c] = DBL_MAX;
+
+        for (int c = 0; c < k; c++) {
+            for (int c2 = c + 1; c2 < k; c2++) {
+                double d = 0.5 * dist_means(dim, means + c * dim, 
+                                            means + c2 * dim);
+                if (d < bounds->half_sep[c])
+                    bounds->half_sep[c] = d;
+                if (d < bounds->half_sep[c2])
+                    bounds->half_sep[c2] = d;
+            }
+        }
+    } else {
+        for (int c = 0; c < k; c++)
+            bounds->half_sep[c] = 0.0;
+    }
+
+    const int block_size = 1024;
+    int num_blocks = (n + block_size - 1) / block_size;
+    int *changed = (int *) malloc(sizeof(int) * num_blocks);
+
+    if (omp_in_parallel()) {
+        /* Called from a task; share the blocks with the team */
+#pragma omp taskloop
+        for (int b = 0; b < num_blocks; b++) {
+            int end = (b + 1) * block_size < n ? (b + 1) * block_size : n;
+            changed[b] = assign_block_exact(dim, k, b * block_size, end, 
+                                            v, means, clustering, bounds, 
+                                            c_max, drift_max, drift_next);
+        }
+    } else {
+#pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < num_blocks; b++) {
+            int end = (b + 1) * block_size < n ? (b + 1) * block_size : n;
+            changed[b] = assign_block_exact(dim, k, b * block_size, end, 
+                                            v, means, clustering, bounds, 
+                                            c_max, drift_max, drift_next);
+        }
+    }
+
+    int changed_total = 0;
+    for (int b = 0; b < num_blocks; b++)
+        changed_total += changed[b];
+
+    free(changed);
+
+    memcpy(bounds->means_prev, means, sizeof(double) * k * dim);
+    bounds->rounds++;
+
+    return changed_total;
+}
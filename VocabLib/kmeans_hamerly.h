@@ -0,0 +1,36 @@
+/* kmeans_hamerly.h */
+
+#ifndef __KMEANS_HAMERLY_H__
+#define __KMEANS_HAMERLY_H__
+
+#include "kmeans.h"
+
+/* Distance bounds kept between the rounds of an exact assignment
+ * (Hamerly, "Making k-means even faster", 2010).  Initialize with
+ * hamerly_bounds_init before the first round of a clustering, and
+ * release with hamerly_bounds_free */
+typedef struct {
+    int rounds;          /* Rounds assigned with these bounds so far */
+    float *upper;        /* Per point: upper bound on the distance to
+                          * its assigned mean */
+    float *lower;        /* Per point: lower bound on the distance to
+                          * any other mean */
+    double *means_prev;  /* Means of the previous round */
+    double *drift;       /* Per mean: distance moved since the
+                          * previous round */
+    double *half_sep;    /* Per mean: half the distance to the closest
+                          * other mean */
+} hamerly_bounds_t;
+
+void hamerly_bounds_init(hamerly_bounds_t *bounds, int n, int dim, int k);
+void hamerly_bounds_free(hamerly_bounds_t *bounds);
+
+/* Assign each of the n vectors to its closest mean, exactly.  After
+ * the first round, the bounds from earlier rounds and the drift of
+ * the means let most points skip their distance computations.
+ * Returns the number of points that changed assignment */
+int compute_clustering_exact(int n, int dim, int k, VectorSet v,
+                             double *means, unsigned int *clustering,
+                             hamerly_bounds_t *bounds);
+
+#endif /* __KMEANS_HAMERLY_H__ */
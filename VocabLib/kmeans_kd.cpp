@@ -45,71 +45,233 @@
 
 #include "../lib/ann_1.1/include/ANN/ANN.h"
 
-static void fill_vector_float(float *vec, unsigned char *v, int dim)
+#include "kmeans_kd.h"
+
+static void fill_vector_float(float *vec, const unsigned char *v, int dim)
 {
     int i;
     for (i = 0; i < dim; i++) 
         vec[i] = (double) v[i];
 }
 
-int compute_clustering_kd_tree(int n, int dim, int k, unsigned char **v,
-                               double *means, unsigned int *clustering, 
-                               double &error_out)
+/* Assign the points in [start, end) to their nearest means */
+static void assign_block(centroid_index_t *index, int dim, int start, 
+                         int end, VectorSet v, unsigned int *clustering,
+                         int max_pts_visit,
+                         int &changed_out, double &error_out)
 {
+    float *vec = (float *) malloc(sizeof(float) * dim);
+    int changed = 0;
     double error = 0.0;
 
-    // int changed = 0;
+    bool keep = (index->num_trees > 0 || index->max_drift > 0.0);
+
+    /* Blocks run one at a time on each thread, so a thread can use
+     * its own search state without locking */
+    kd_forest_search_t *search = NULL;
+    if (index->tree == NULL)
+        search = index->searches + omp_get_thread_num();
+
+    for (int i = start; i < end; i++) {
+        int nn;
+        float dist;
+        fill_vector_float(vec, v[i], dim);
+
+        if (index->tree != NULL) {
+            index->tree->annkPriSearch(vec, 1, &nn, &dist, 0.0, 
+                                       max_pts_visit);
+        } else {
+            nn = kd_forest_search(&index->forest, search, vec, 
+                                  max_pts_visit, dist);
+        }
+
+        /* With a forest, or a tree that is not rebuilt every round,
+         * a vector keeps its mean unless a closer one is found, so
+         * that the search noise does not keep moving vectors back and
+         * forth */
+        int curr = (int) clustering[i];
+        if (keep && curr != nn && curr >= 0 && curr < index->k) {
+            float dist_curr = 0.0f;
+            for (int j = 0; j < dim; j++) {
+                float d = vec[j] - index->pts[curr][j];
+                dist_curr += d * d;
+            }
+
+            if (dist_curr <= dist) {
+                nn = curr;
+                dist = dist_curr;
+            }
+        }
+
+        error += (double) dist;
+
+        if ((int) clustering[i] != nn) {
+            changed++;
+            clustering[i] = nn;
+        }
+    }
+
+    free(vec);
 
-    /* Using a kd-tree */
-    ANNpointArray pts = annAllocPts(k, dim);
+    changed_out = changed;
+    error_out = error;
+}
+
+void centroid_index_init(centroid_index_t *index, int dim, int k,
+                         const KMeansOptions &options)
+{
+    index->k = k;
+    index->dim = dim;
+    index->num_trees = 
+        (options.assign == KMeansAssignKdForest) ? options.forest_trees : 0;
+    index->max_drift = options.index_drift;
+    index->pts = annAllocPts(k, dim);
+    index->means_built = (double *) malloc(sizeof(double) * k * dim);
+    index->tree = NULL;
+    index->num_searches = 0;
+    index->searches = NULL;
+    index->built = false;
+    index->builds = 0;
+}
+
+void centroid_index_free(centroid_index_t *index)
+{
+    if (index->tree != NULL)
+        delete index->tree;
+
+    if (index->built && index->num_trees > 0)
+        kd_forest_free(&index->forest);
+
+    for (int i = 0; i < index->num_searches; i++)
+        kd_forest_search_free(index->searches + i);
+    free(index->searches);
+
+    annDeallocPts(index->pts);
+    free(index->means_built);
+}
+
+/* Move the indexed points to the means, and rebuild the index if
+ * they have drifted too far since it was built */
+static void centroid_index_update(centroid_index_t *index, 
+                                  const double *means)
+{
+    int k = index->k, dim = index->dim;
+
+    bool rebuild = !index->built;
+    double max_drift_sq = index->max_drift * index->max_drift;
+    for (int i = 0; i < k && !rebuild; i++) {
+        double drift_sq = 0.0;
+        for (int j = 0; j < dim; j++) {
+            double d = means[i * dim + j] - index->means_built[i * dim + j];
+            drift_sq += d * d;
+        }
+
+        rebuild = (drift_sq > max_drift_sq);
+    }
 
     for (int i = 0; i < k; i++) {
         for (int j = 0; j < dim; j++) {
-            pts[i][j] = means[i * dim + j];
+            index->pts[i][j] = means[i * dim + j];
         }
     }
 
-    ANNkd_tree *tree = new ANNkd_tree(pts, k, dim, 4);
-    annMaxPtsVisit(512);
+    if (!rebuild)
+        return;
+
+    if (index->num_trees > 0) {
+        if (index->built)
+            kd_forest_free(&index->forest);
 
-    const int max_threads = omp_get_max_threads();    
-    int changed[max_threads];
-    float *vec[max_threads];
+        kd_forest_build(&index->forest, index->pts, k, dim, 
+                        index->num_trees, (unsigned int) index->builds);
+    } else {
+        if (index->tree != NULL)
+            delete index->tree;
 
-    for (int i = 0; i < max_threads; i++) {
-        changed[i] = 0;
-        vec[i] = (float *) malloc(sizeof(float) * dim);
+        index->tree = new ANNkd_tree(index->pts, k, dim, 4);
     }
-    
-#pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        int my_thread = omp_get_thread_num();
 
-        int nn;
-        float dist;
-        fill_vector_float(vec[my_thread], v[i], dim);
-        tree->annkPriSearch(vec[my_thread], 1, &nn, &dist, 0.0);
+    memcpy(index->means_built, means, sizeof(double) * k * dim);
+    index->built = true;
+    index->builds++;
+}
 
-        error += (double) dist;
+/* Make sure that every thread that may assign points has a forest
+ * search state.  The states depend only on k, so they are kept across
+ * rebuilds, and only added when more threads show up */
+static void centroid_index_reserve_searches(centroid_index_t *index)
+{
+    int num_threads = 
+        omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
 
-        if ((int) clustering[i] != nn) {
-            changed[my_thread]++;
-            clustering[i] = nn;
-        }
+    if (num_threads <= index->num_searches)
+        return;
+
+    index->searches = (kd_forest_search_t *)
+        realloc(index->searches, sizeof(kd_forest_search_t) * num_threads);
+    for (int i = index->num_searches; i < num_threads; i++)
+        kd_forest_search_init(index->searches + i, &index->forest);
+
+    index->num_searches = num_threads;
+}
+
+int compute_clustering_kd_tree(int n, int dim, int k, VectorSet v,
+                               double *means, unsigned int *clustering, 
+                               double &error_out, int max_pts_visit,
+                               centroid_index_t *index)
+{
+    centroid_index_t local;
+    if (index == NULL) {
+        centroid_index_init(&local, dim, k, KMeansOptions());
+        index = &local;
     }
 
-    error_out = error;
+    centroid_index_update(index, means);
+    if (index->num_trees > 0)
+        centroid_index_reserve_searches(index);
 
-    for (int i = 0; i < max_threads; i++)
-        free(vec[i]);
+    /* The points are assigned in fixed blocks, each with its own
+     * counts and work vector.  The per-block results are summed in
+     * block order afterwards, so nothing is shared between threads
+     * and the result does not depend on their number */
+    const int block_size = 1024;
+    int num_blocks = (n + block_size - 1) / block_size;
+    int *changed = (int *) malloc(sizeof(int) * num_blocks);
+    double *error = (double *) malloc(sizeof(double) * num_blocks);
 
-    delete tree;
-    annDeallocPts(pts);
+    if (omp_in_parallel()) {
+        /* Called from a task (e.g., while building the subtrees of a
+         * vocabulary tree in parallel); hand the blocks to the
+         * threads of the enclosing team */
+#pragma omp taskloop
+        for (int b = 0; b < num_blocks; b++) {
+            int end = (b + 1) * block_size < n ? (b + 1) * block_size : n;
+            assign_block(index, dim, b * block_size, end, v, clustering,
+                         max_pts_visit, changed[b], error[b]);
+        }
+    } else {
+#pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < num_blocks; b++) {
+            int end = (b + 1) * block_size < n ? (b + 1) * block_size : n;
+            assign_block(index, dim, b * block_size, end, v, clustering,
+                         max_pts_visit, changed[b], error[b]);
+        }
+    }
 
     int changed_total = 0;
-    for (int i = 0; i < max_threads; i++) {
-        changed_total += changed[i];
+    double error_total = 0.0;
+    for (int b = 0; b < num_blocks; b++) {
+        changed_total += changed[b];
+        error_total += error[b];
     }
 
+    error_out = error_total;
+
+    free(changed);
+    free(error);
+
+    if (index == &local)
+        centroid_index_free(&local);
+
     return changed_total;
 }
@@ -3,8 +3,52 @@
 #ifndef __KMEANS_KD_H__
 #define __KMEANS_KD_H__
 
-int compute_clustering_kd_tree(int n, int dim, int k, unsigned char **v,
+#include "kmeans.h"
+#include "kmeans_forest.h"
+
+/* From the float build of ANN, which is only included by
+ * kmeans_kd.cpp (its names clash with the char build's) */
+class ANNkd_tree;
+
+/* A search index over the means, kept across the rounds of a
+ * clustering: either one kd-tree or a randomized kd-forest.  Each
+ * round, the indexed points are moved to the new means in place, and
+ * the index is rebuilt only once some mean has drifted more than
+ * options.index_drift since the last build (always, by default, if
+ * any mean moved).  Initialize with centroid_index_init before the
+ * first round, and release with centroid_index_free */
+typedef struct {
+    int k, dim;
+    int num_trees;         /* 0 for a kd-tree, or the size of the forest */
+    double max_drift;      /* Drift allowed before a rebuild */
+    float **pts;           /* The means, as searched */
+    double *means_built;   /* The means when the index was built */
+    ANNkd_tree *tree;      /* kd-tree over pts, or NULL */
+    kd_forest_t forest;    /* Forest over pts, if num_trees > 0 */
+    int num_searches;      /* Forest search states, one per thread */
+    kd_forest_search_t *searches;
+    bool built;            /* Has the index been built? */
+    int builds;            /* Number of builds so far */
+} centroid_index_t;
+
+void centroid_index_init(centroid_index_t *index, int dim, int k,
+                         const KMeansOptions &options);
+void centroid_index_free(centroid_index_t *index);
+
+/* Assign each of the n vectors to its closest mean, found with an
+ * approximate search of the index that checks at most max_pts_visit
+ * points.  If index is NULL, a kd-tree is built just for this call.
+ * With a forest, or with index_drift > 0, the input clustering must
+ * hold valid means, since vectors keep them unless a closer mean is
+ * found.
+ * error_out is the sum of squared distances to the assigned means.
+ * Safe to call from several threads or tasks at once (with different
+ * indexes); from inside a parallel region, the work is shared with
+ * the team through tasks.  Returns the number of vectors that changed
+ * assignment */
+int compute_clustering_kd_tree(int n, int dim, int k, VectorSet v,
                                double *means, unsigned int *clustering, 
-                               double &error_out);
+                               double &error_out, int max_pts_visit,
+                               centroid_index_t *index = NULL);
 
 #endif /* __KMEANS_KD_H__ */
@@ -43,49 +43,17 @@
 #include <time.h>
 #include <ctime>
 
+#include <omp.h>
+
 #include <string>
 
 #include "VocabTree.h"
+#include "VocabKeyLoader.h"
 #include "keys2.h"
 
 #include "defines.h"
 #include "qsort.h"
 
-/* Read in a set of keys from a file 
- *
- * Inputs:
- *   keyfile      : file from which to read keys
- *   dim          : dimensionality of descriptors
- * 
- * Outputs:
- *   num_keys_out : number of keys read
- *
- * Return value   : pointer to array of descriptors.  The descriptors
- *                  are concatenated together in one big array of
- *                  length num_keys_out * dim 
- */
-unsigned char *ReadKeys(const char *keyfile, int dim, int &num_keys_out)
-{
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    for (int j = 0; j < num_keys * dim; j++) {
-        keys_char[j] = (unsigned char) keys[j];
-    }
-
-    delete [] keys;
-
-    if (info != NULL) 
-        delete [] info;
-
-    num_keys_out = num_keys;
-
-    return keys_char;
-}
-
 int BasifyFilename(const char *filename, char *base)
 {
     strcpy(base, filename);
@@ -114,7 +82,7 @@ void PrintHTMLHeader(FILE *f, int num_nns)
 }
 
 void PrintHTMLRow(FILE *f, const std::string &query, 
-                  double *scores, int *perm, int num_nns,
+                  const float *scores, int *perm, int num_nns,
                   const std::vector<std::string> &db_images)
 {
     char q_base[512], q_thumb[512];
@@ -135,7 +103,7 @@ void PrintHTMLRow(FILE *f, const std::string &query,
 
     fprintf(f, "<td></td>\n");
     for (int i = 0; i < num_nns; i++) 
-        fprintf(f, "<td>%0.5f</td>\n", scores[i]);
+        fprintf(f, "<td>%0.5f</td>\n", scores[perm[i]]);
 
     fprintf(f, "</tr>\n");
 }
@@ -150,13 +118,76 @@ void PrintHTMLFooter(FILE *f)
 }
 #endif
 
-int main(int argc, char **argv) 
+/* Scores of a query, kept with the key buffer it was loaded into
+ * until they are written */
+struct query_slot_t {
+    VocabQueryContext ctx;
+    float *scores;
+    int top;
+    double mag;
+    double start, end;   /* Wall-clock times, as clock() sums the
+                          * time of all threads */
+};
+
+struct match_data_t {
+    const VocabTree *tree;
+    const std::vector<std::string> *query_files;
+    int num_db_images;
+    int num_nbrs;
+    bool normalize;
+    FILE *f_match;
+    query_slot_t *slots;
+};
+
+/* Score a loaded query against the database */
+static void score_query(int index, int slot, KeyBuffer &keys, void *data)
+{
+    match_data_t *match = (match_data_t *) data;
+    query_slot_t &q = match->slots[slot];
+
+    q.start = omp_get_wtime();
+
+    /* Clear scores */
+    for (int j = 0; j < match->num_db_images; j++) 
+        q.scores[j] = 0.0;
+
+    q.mag = match->tree->ScoreQueryKeys(keys.m_num_keys, match->normalize,
+                                        keys.m_keys, q.scores, q.ctx);
+
+    /* Find the top scores */
+    q.top = q.ctx.SelectTopScores(match->num_db_images, q.scores, 
+                                  match->num_nbrs);
+
+    q.end = omp_get_wtime();
+}
+
+/* Write the matches of a query; called in query order */
+static void write_matches(int index, int slot, KeyBuffer &keys, void *data)
 {
-    const int dim = 128;
+    match_data_t *match = (match_data_t *) data;
+    query_slot_t &q = match->slots[slot];
+
+    /* The total includes loading the keys */
+    printf("[VocabMatch] Scored image %s in %0.3fs "
+           "( %0.3fs total, num_keys = %d, mag = %0.3f )\n", 
+           (*match->query_files)[index].c_str(), q.end - q.start,
+           keys.m_load_time + (q.end - q.start), keys.m_num_keys, q.mag);
+
+    for (int j = 0; j < q.top; j++) {
+        fprintf(match->f_match, "%d %d %0.4f\n", 
+                index, q.ctx.m_top[j], q.scores[q.ctx.m_top[j]]);
+    }
+
+    fflush(match->f_match);
+    fflush(stdout);
+}
 
-    if (argc != 6 && argc != 7 && argc != 8) {
+int main(int argc, char **argv) 
+{
+    if (argc < 6 || argc > 10) {
         printf("Usage: %s <db.in> <list.in> <query.in> <num_nbrs> "
-               "<matches.out> [distance_type:1] [normalize:1]\n", argv[0]);
+               "<matches.out> [distance_type:1] [normalize:1] "
+               "[num_threads:1] [prefetch:0]\n", argv[0]);
         return 1;
     }
 
@@ -167,6 +198,8 @@ int main(int argc, char **argv)
     char *matches_out = argv[5];
     DistanceType distance_type = DistanceMin;
     bool normalize = true;
+    int num_threads = 1;
+    int prefetch = 0;
 
 #if 0    
     if (argc >= 7)
@@ -179,6 +212,12 @@ int main(int argc, char **argv)
     if (argc >= 8)
         normalize = (atoi(argv[7]) != 0);
 
+    if (argc >= 9)
+        num_threads = MAX(1, atoi(argv[8]));
+
+    if (argc >= 10)
+        prefetch = MAX(0, atoi(argv[9]));
+
     printf("[VocabMatch] Using database %s\n", db_in);
 
     switch (distance_type) {
@@ -206,11 +245,14 @@ int main(int argc, char **argv)
            (double) (end - start) / CLOCKS_PER_SEC);
 
 #if 1
-    tree.Flatten();
+    /* Cache the search structure for the flattened tree next to
+     * the tree file */
+    tree.Flatten((std::string(db_in) + ".ann").c_str());
 #endif
 
     tree.SetDistanceType(distance_type);
     tree.SetInteriorNodeWeight(0, 0.0);
+    tree.FinalizeDatabase();
     
     /* Read the database keyfiles */
     FILE *f = fopen(list_in, "r");
@@ -266,10 +308,6 @@ int main(int argc, char **argv)
     PrintHTMLHeader(f_html, num_nbrs);
 #endif
 
-    float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
-
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
         printf("[VocabMatch] Error opening file %s for writing\n",
@@ -277,55 +315,37 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    for (int i = 0; i < num_query_images; i++) {
-        start = clock();
-
-        /* Clear scores */
-        for (int j = 0; j < num_db_images; j++) 
-            scores[j] = 0.0;
-
-        unsigned char *keys;
-        int num_keys;
-
-        keys = ReadKeys(query_files[i].c_str(), dim, num_keys);
+    if (num_threads > 1)
+        printf("[VocabMatch] Using %d threads\n", num_threads);
 
-        clock_t start_score = clock();
-        double mag = tree.ScoreQueryKeys(num_keys, normalize, keys, scores);
-        clock_t end_score = end = clock();
+    /* Queries are loaded and scored concurrently, each into its own
+     * slot (key buffer, query context and scores), sharing the
+     * read-only database.  Results are written in query order, so the
+     * output does not depend on the number of threads */
+    VocabLoadOptions load;
+    load.num_threads = num_threads;
+    load.prefetch = prefetch;
 
-        printf("[VocabMatch] Scored image %s in %0.3fs "
-               "( %0.3fs total, num_keys = %d, mag = %0.3f )\n", 
-               query_files[i].c_str(), 
-               (double) (end_score - start_score) / CLOCKS_PER_SEC,
-               (double) (end - start) / CLOCKS_PER_SEC, num_keys, mag);
+    int num_slots = GetNumLoadSlots(load);
 
-        /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
+    match_data_t match;
+    match.tree = &tree;
+    match.query_files = &query_files;
+    match.num_db_images = num_db_images;
+    match.num_nbrs = num_nbrs;
+    match.normalize = normalize;
+    match.f_match = f_match;
+    match.slots = new query_slot_t[num_slots];
 
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
+    for (int i = 0; i < num_slots; i++)
+        match.slots[i].scores = new float[num_db_images];
 
-        int top = MIN(num_nbrs, num_db_images);
+    LoadKeyFiles(query_files, load, score_query, write_matches, &match);
 
-        for (int j = 0; j < top; j++) {
-            // if (perm[j] == index_i)
-            //     continue;
-            fprintf(f_match, "%d %d %0.4f\n", i, perm[j], scores_d[j]);
-            //fprintf(f_match, "%d %d %0.4f\n", i, perm[j], mag - scores_d[j]);
-        }
-        
-        fflush(f_match);
-        fflush(stdout);
+    for (int i = 0; i < num_slots; i++)
+        delete [] match.slots[i].scores;
 
-#if 0
-        PrintHTMLRow(f_html, query_files[i], scores_d, 
-                     perm, num_nbrs, db_files);
-#endif
-
-        delete [] keys;
-    }
+    delete [] match.slots;
 
     fclose(f_match);
 
@@ -334,9 +354,5 @@ int main(int argc, char **argv)
     fclose(f_html);
 #endif
 
-    delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
-
     return 0;
 }
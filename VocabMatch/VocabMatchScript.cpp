@@ -22,56 +22,6 @@
 #include "util.h"
 #endif
 
-// const double min_feature_scale = 0.0; // 1.4; // 1.2
-unsigned char *ReadAndFilterKeys(const char *keyfile, int dim, 
-                                 double min_feature_scale, int max_keys, 
-                                 int &num_keys_out)
-{
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    if (num_keys == 0) {
-        num_keys_out = 0;
-        return NULL;
-    }
-    
-    /* Filter keys */
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    int num_keys_filtered = 0;
-    if (min_feature_scale == 0.0 && max_keys == 0) {
-        for (int j = 0; j < num_keys * dim; j++) {
-            keys_char[j] = (unsigned char) keys[j];
-        }
-        num_keys_filtered = num_keys;
-    } else {
-        for (int j = 0; j < num_keys; j++) {
-            if (info[j].scale < min_feature_scale)
-                continue;
-            
-            for (int k = 0; k < dim; k++) {
-                keys_char[num_keys_filtered * dim + k] = 
-                    (unsigned char) keys[j * dim + k];
-            }
-            
-            num_keys_filtered++;
-
-            if (max_keys > 0 && num_keys_filtered >= max_keys)
-                break;
-        }
-    }
-
-    delete [] keys;
-
-    if (info != NULL) 
-        delete [] info;
-
-    num_keys_out = num_keys_filtered;
-
-    return keys_char;
-}
-
 int BasifyFilename(const char *filename, char *base)
 {
     int len = strlen(filename);
@@ -91,8 +41,6 @@ int BasifyFilename(const char *filename, char *base)
 
 int main(int argc, char **argv) 
 {
-    const int dim = 128;
-
     if (argc != 6 && argc != 7 && argc != 8 && argc != 9 && argc != 10 && 
         argc != 11) {
         printf("Usage: %s <tree.in> <db.in> <query.in> <num_nbrs> "
@@ -167,7 +115,9 @@ int main(int argc, char **argv)
            (double) (end - start) / CLOCKS_PER_SEC);
 
 #if 1
-    tree.Flatten();
+    /* Cache the search structure for the flattened tree next to
+     * the tree file */
+    tree.Flatten((std::string(tree_in) + ".ann").c_str());
 #endif
 
     tree.SetDistanceType(distance_type);
@@ -179,6 +129,8 @@ int main(int argc, char **argv)
         tree.SetConstantLeafWeights();
 #endif
     }
+
+    tree.FinalizeDatabase();
     
     /* Read the database keyfiles */
     FILE *f = fopen(db_in, "r");
@@ -226,9 +178,8 @@ int main(int argc, char **argv)
     printf("[VocabMatch] Scoring query images...\n");
     fflush(stdout);
 
+    VocabQueryContext ctx;
     float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
 
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
@@ -237,6 +188,7 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    KeyBuffer keys;
     for (int i = 0; i < num_query_images; i++) {
         int index_i = query_indices[i];
 
@@ -246,13 +198,13 @@ int main(int argc, char **argv)
         for (int j = 0; j < num_db_images; j++) 
             scores[j] = 0.0;
 
-        unsigned char *keys;
-        int num_keys;
+        int num_keys = LoadKeyFile(query_files[i].c_str(), keys, 
+                                   min_feature_scale, max_keys);
 
-        keys = ReadAndFilterKeys(query_files[i].c_str(), dim, 
-                                 min_feature_scale, max_keys, num_keys);
+        if (num_keys < 0)
+            num_keys = 0;
 
-        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, scores);
+        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys.m_keys, scores, ctx);
 
         end = clock();
         printf("[VocabMatch] Scored image %s (%d keys) in %0.3fs\n", 
@@ -270,33 +222,22 @@ int main(int argc, char **argv)
 #endif
 
         /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
-
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
-        // assert(is_sorted(num_db_images, scores_d));
-
-        int top = MIN(num_nbrs+1, num_db_images);
+        int top = ctx.SelectTopScores(num_db_images, scores, num_nbrs+1);
 
         for (int j = 0; j < top; j++) {
-            if (perm[j] == index_i)
+            if (ctx.m_top[j] == index_i)
                 continue;
-            fprintf(f_match, "%d %d %0.5e\n", index_i, perm[j], scores_d[j]);
+            fprintf(f_match, "%d %d %0.5e\n", index_i, 
+                    ctx.m_top[j], scores[ctx.m_top[j]]);
             fflush(f_match);
         }
         
         fflush(stdout);
-
-        delete [] keys;
     }
 
     fclose(f_match);
 
     delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
 
     return 0;
 }
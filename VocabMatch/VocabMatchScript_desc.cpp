@@ -147,7 +147,9 @@ int main(int argc, char **argv)
            (double) (end - start) / CLOCKS_PER_SEC);
 
 #if 1
-    tree.Flatten();
+    /* Cache the search structure for the flattened tree next to
+     * the tree file */
+    tree.Flatten((std::string(tree_in) + ".ann").c_str());
 #endif
 
     tree.SetDistanceType(distance_type);
@@ -159,6 +161,8 @@ int main(int argc, char **argv)
         tree.SetConstantLeafWeights();
 #endif
     }
+
+    tree.FinalizeDatabase();
     
     /* Read the database keyfiles */
     FILE *f = fopen(db_in, "r");
@@ -210,9 +214,8 @@ int main(int argc, char **argv)
     printf("[VocabMatch] Scoring query images...\n");
     fflush(stdout);
 
+    VocabQueryContext ctx;
     float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
 
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
@@ -235,7 +238,7 @@ int main(int argc, char **argv)
 
         keys = ReadDescriptorFile(query_files[i].c_str(), dim, num_keys);
 
-        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, scores);
+        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, scores, ctx);
 
         end = clock();
         printf("[VocabMatch] Scored image %s (%d keys) in %0.3fs\n", 
@@ -253,20 +256,13 @@ int main(int argc, char **argv)
 #endif
 
         /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
-
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
-        // assert(is_sorted(num_db_images, scores_d));
-
-        int top = MIN(num_nbrs+1, num_db_images);
+        int top = ctx.SelectTopScores(num_db_images, scores, num_nbrs+1);
 
         for (int j = 0; j < top; j++) {
-            if (perm[j] == index_i)
+            if (ctx.m_top[j] == index_i)
                 continue;
-            fprintf(f_match, "%d %d %0.5e\n", index_i, perm[j], scores_d[j]);
+            fprintf(f_match, "%d %d %0.5e\n", index_i, 
+                    ctx.m_top[j], scores[ctx.m_top[j]]);
             fflush(f_match);
         }
         
@@ -278,8 +274,6 @@ int main(int argc, char **argv)
     fclose(f_match);
 
     delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
 
     return 0;
 }
@@ -53,41 +53,6 @@
 #include "defines.h"
 #include "qsort.h"
 
-/* Read in a set of keys from a file 
- *
- * Inputs:
- *   keyfile      : file from which to read keys
- *   dim          : dimensionality of descriptors
- * 
- * Outputs:
- *   num_keys_out : number of keys read
- *
- * Return value   : pointer to array of descriptors.  The descriptors
- *                  are concatenated together in one big array of
- *                  length num_keys_out * dim 
- */
-unsigned char *ReadKeys(const char *keyfile, int dim, int &num_keys_out)
-{
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    for (int j = 0; j < num_keys * dim; j++) {
-        keys_char[j] = (unsigned char) keys[j];
-    }
-
-    delete [] keys;
-
-    if (info != NULL) 
-        delete [] info;
-
-    num_keys_out = num_keys;
-
-    return keys_char;
-}
-
 int BasifyFilename(const char *filename, char *base)
 {
     strcpy(base, filename);
@@ -116,7 +81,7 @@ void PrintHTMLHeader(FILE *f, int num_nns)
 }
 
 void PrintHTMLRow(FILE *f, const std::string &query, 
-                  double *scores, int *perm, int num_nns,
+                  const float *scores, int *perm, int num_nns,
                   const std::vector<std::string> &db_images)
 {
     char q_base[512], q_thumb[512];
@@ -137,7 +102,7 @@ void PrintHTMLRow(FILE *f, const std::string &query,
 
     fprintf(f, "<td></td>\n");
     for (int i = 0; i < num_nns; i++) 
-        fprintf(f, "<td>%0.5f</td>\n", scores[i]);
+        fprintf(f, "<td>%0.5f</td>\n", scores[perm[i]]);
 
     fprintf(f, "</tr>\n");
 }
@@ -237,11 +202,14 @@ int main(int argc, char **argv)
            (double) (end - start) / CLOCKS_PER_SEC);
 
 #if 1
-    tree.Flatten();
+    /* Cache the search structure for the flattened tree next to
+     * the tree file */
+    tree.Flatten((std::string(tree_in) + ".ann").c_str());
 #endif
 
     tree.SetDistanceType(distance_type);
     tree.SetInteriorNodeWeight(0, 0.0);
+    tree.FinalizeDatabase();
     
     /* Read the database keyfiles */
     FILE *f = fopen(db_in, "r");
@@ -289,9 +257,8 @@ int main(int argc, char **argv)
     PrintHTMLHeader(f_html, num_nbrs);
 #endif
 
+    VocabQueryContext ctx;
     float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
 
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
@@ -312,7 +279,8 @@ int main(int argc, char **argv)
                                                  dim, num_keys);
 
         clock_t start_score = clock();
-        double mag = tree.ScoreQueryKeys(num_keys, normalize, keys, scores);
+        double mag = 
+            tree.ScoreQueryKeys(num_keys, normalize, keys, scores, ctx);
         clock_t end_score = end = clock();
 
         printf("[VocabMatch] Scored image %s in %0.3fs "
@@ -322,29 +290,22 @@ int main(int argc, char **argv)
                (double) (end - start) / CLOCKS_PER_SEC, num_keys, mag);
 
         /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
-
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
-
-        int top = MIN(num_nbrs, num_db_images);
+        int top = ctx.SelectTopScores(num_db_images, scores, num_nbrs);
 
         for (int j = 0; j < top; j++) {
-            // if (perm[j] == index_i)
+            // if (ctx.m_top[j] == index_i)
             //     continue;
             
-            fprintf(f_match, "%d %d %0.4f\n", i, perm[j], scores_d[j]);
-            //fprintf(f_match, "%d %d %0.4f\n", i, perm[j], mag - scores_d[j]);
+            fprintf(f_match, "%d %d %0.4f\n", i, 
+                    ctx.m_top[j], scores[ctx.m_top[j]]);
         }
         
         fflush(f_match);
         fflush(stdout);
 
 #if 0
-        PrintHTMLRow(f_html, query_files[i], scores_d, 
-                     perm, num_nbrs, db_files);
+        PrintHTMLRow(f_html, query_files[i], scores, 
+                     &ctx.m_top[0], top, db_files);
 #endif
 
         delete [] keys;
@@ -358,8 +319,6 @@ int main(int argc, char **argv)
 #endif
 
     delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
 
     return 0;
 }
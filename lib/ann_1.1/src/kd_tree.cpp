@@ -266,8 +266,18 @@ void ANNkd_tree::SkeletonTree(			// construct skeleton tree
 	}
 
 	bnd_box_lo = bnd_box_hi = NULL;		// bounding box is nonexistent
-	if (KD_TRIVIAL == NULL)				// no trivial leaf node yet?
-		KD_TRIVIAL = new ANNkd_leaf(0, IDX_TRIVIAL);	// allocate it
+	if (KD_TRIVIAL == NULL) {			// no trivial leaf node yet?
+		ANNkd_leaf *leaf = new ANNkd_leaf(0, IDX_TRIVIAL);	// allocate it
+#if defined(__GNUC__)
+										// trees may be built by several
+										// threads at once; keep one leaf
+		if (!__sync_bool_compare_and_swap(&KD_TRIVIAL,
+				(ANNkd_leaf *) NULL, leaf))
+			delete leaf;
+#else
+		KD_TRIVIAL = leaf;
+#endif
+	}
 }
 
 ANNkd_tree::ANNkd_tree(					// basic constructor
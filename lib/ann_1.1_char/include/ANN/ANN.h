@@ -743,6 +743,15 @@ public:
 	ANNkd_tree(							// build from dump file
 		std::istream&	in);			// input stream for dump file
 
+	ANNkd_tree(							// build from binary dump file
+		std::istream&	in,				// input stream for binary dump
+		ANNpointArray	pa,				// point array (not in the dump)
+		int				n,				// number of points
+		int				dd);			// dimension
+										// (on a bad dump, the failbit
+										// of in is set and the tree
+										// is left empty)
+
 	~ANNkd_tree();						// tree destructor
 
 	void annkSearch(					// approx k near neighbor search
@@ -757,7 +766,8 @@ public:
 		int				k,				// number of near neighbors to return
 		ANNidxArray		nn_idx,			// nearest neighbor array (modified)
 		ANNdistArray	dd,				// dist to near neighbors (modified)
-		double			eps=0.0);		// error bound
+		double			eps=0.0,		// error bound
+		int				maxPts=-1);		// max pts to visit (-1 = global limit)
 
 	int annkFRSearch(					// approx fixed-radius kNN search
 		ANNpoint		q,				// the query point
@@ -783,6 +793,9 @@ public:
 	virtual void Dump(					// dump entire tree
 		ANNbool			with_pts,		// print points as well?
 		std::ostream&	out);			// output stream
+
+	virtual void DumpBinary(			// dump tree without points in
+		std::ostream&	out);			// binary form (output stream)
 								
 	virtual void getStats(				// compute tree statistics
 		ANNkdStats&		st);			// the statistics (modified)
@@ -446,3 +446,225 @@ static ANNkd_ptr annReadTree(
 		exit(0);								// to keep the compiler happy
 	}
 }
+
+//----------------------------------------------------------------------
+//	Binary dump
+//		The binary dump stores the tree structure but not the points,
+//		which the caller supplies when loading the tree.  It is much
+//		faster to read than the text dump.  The format is
+//
+//				"#ANNBIN1" <dim> <n_pts> <bkt_size>
+//				<bnd_box_lo> <bnd_box_hi> <pidx[0..n_pts-1]>
+//				<nodes in preorder>
+//
+//		where each node starts with a one byte tag:
+//
+//		Null tree:
+//				'N'
+//		Leaf node:
+//				'L' <n_pts>
+//		Splitting nodes:
+//				'S' <cut_dim> <cut_val> <lo_bound> <hi_bound>
+//
+//		All values are stored in native binary form.  The buckets
+//		of the leaves are consecutive ranges of pidx, in preorder,
+//		as they are after building the tree.  Only kd-trees are
+//		supported.
+//
+//		Errors do not abort: dumping an unsupported node type and
+//		reading a bad or truncated dump set the failbit of the
+//		stream instead, so that callers can fall back to building
+//		the tree.
+//----------------------------------------------------------------------
+
+static const char ANN_BINARY_MAGIC[] = "#ANNBIN1";
+
+void ANNkd_node::dump_binary(			// dump a node in binary
+		ostream &out)					// output stream
+{
+	out.setstate(ios::failbit);			// not supported for this type
+}
+
+void ANNkd_tree::DumpBinary(			// dump entire tree in binary
+		ostream &out)					// output stream
+{
+	out.write(ANN_BINARY_MAGIC, 8);
+	out.write((const char *) &dim, sizeof(int));
+	out.write((const char *) &n_pts, sizeof(int));
+	out.write((const char *) &bkt_size, sizeof(int));
+	out.write((const char *) bnd_box_lo, sizeof(ANNcoord) * dim);
+	out.write((const char *) bnd_box_hi, sizeof(ANNcoord) * dim);
+	out.write((const char *) pidx, sizeof(ANNidx) * n_pts);
+
+	if (root == NULL)					// empty tree?
+		out.put('N');
+	else
+		root->dump_binary(out);			// invoke dumping at root
+}
+
+void ANNkd_split::dump_binary(			// dump a splitting node
+		ostream &out)					// output stream
+{
+	out.put('S');
+	out.write((const char *) &cut_dim, sizeof(int));
+	out.write((const char *) &cut_val, sizeof(ANNcoord));
+	out.write((const char *) cd_bnds, sizeof(ANNcoord) * 2);
+
+	child[ANN_LO]->dump_binary(out);	// dump low child
+	child[ANN_HI]->dump_binary(out);	// dump high child
+}
+
+void ANNkd_leaf::dump_binary(			// dump a leaf node
+		ostream &out)					// output stream
+{
+	int n = (this == KD_TRIVIAL) ? 0 : n_pts;
+
+	out.put('L');
+	out.write((const char *) &n, sizeof(int));
+}
+
+const int ANN_BINARY_MAX_DEPTH = 10000;	// deepest tree read from a dump
+
+static void annDeleteBinaryTree(		// delete a partly read tree
+	ANNkd_ptr			t)						// the tree
+{
+	if (t != NULL && t != KD_TRIVIAL)
+		delete t;
+}
+
+static ANNkd_ptr annReadBinaryTree(		// read tree-part of binary dump
+	istream				&in,					// input stream
+	int					dim,					// dimension
+	int					n_pts,					// number of points
+	ANNidxArray			the_pidx,				// point indices
+	int					&next_idx,				// next index (modified)
+	int					depth)					// depth of this node
+{
+	int tag = in.get();							// input node tag
+
+	if (!in || depth > ANN_BINARY_MAX_DEPTH) {
+		in.setstate(ios::failbit);
+		return NULL;
+	}
+
+	if (tag == 'N') {							// null tree
+		return NULL;
+	}
+	else if (tag == 'L') {						// leaf node
+		int n;
+		in.read((char *) &n, sizeof(int));
+
+		if (!in || n < 0 || n > n_pts - next_idx) {
+			in.setstate(ios::failbit);			// bad bucket size
+			return NULL;
+		}
+
+		if (n == 0)								// trivial leaf
+			return KD_TRIVIAL;
+
+		int old_idx = next_idx;
+		next_idx += n;
+		return new ANNkd_leaf(n, &the_pidx[old_idx]);
+	}
+	else if (tag == 'S') {						// splitting node
+		int cd;
+		ANNcoord cv, bnds[2];
+		in.read((char *) &cd, sizeof(int));
+		in.read((char *) &cv, sizeof(ANNcoord));
+		in.read((char *) bnds, sizeof(ANNcoord) * 2);
+
+		if (!in || cd < 0 || cd >= dim) {
+			in.setstate(ios::failbit);			// bad cutting dimension
+			return NULL;
+		}
+												// read low and high subtrees
+		ANNkd_ptr lc = annReadBinaryTree(in, dim, n_pts, the_pidx, 
+										 next_idx, depth + 1);
+		ANNkd_ptr hc = NULL;
+		if (in) {
+			hc = annReadBinaryTree(in, dim, n_pts, the_pidx, 
+								   next_idx, depth + 1);
+		}
+
+		if (!in) {								// error below?
+			annDeleteBinaryTree(lc);
+			annDeleteBinaryTree(hc);
+			return NULL;
+		}
+												// create new node and return
+		return new ANNkd_split(cd, cv, bnds[ANN_LO], bnds[ANN_HI], lc, hc);
+	}
+	else {										// illegal node type
+		in.setstate(ios::failbit);
+		return NULL;
+	}
+}
+
+ANNkd_tree::ANNkd_tree(					// build from binary dump file
+	istream				&in,					// input stream for dump file
+	ANNpointArray		pa,						// point array
+	int					n,						// number of points
+	int					dd)						// dimension
+{
+	char magic[8];
+	int the_dim = 0, the_n_pts = 0, the_bkt_size = 0;
+
+	in.read(magic, 8);
+	in.read((char *) &the_dim, sizeof(int));
+	in.read((char *) &the_n_pts, sizeof(int));
+	in.read((char *) &the_bkt_size, sizeof(int));
+
+	bool ok = in && memcmp(magic, ANN_BINARY_MAGIC, 8) == 0 &&
+		the_dim == dd && the_n_pts == n && the_bkt_size > 0;
+
+	if (!ok) {									// empty tree for the points
+		in.setstate(ios::failbit);
+		the_n_pts = 0;
+		the_bkt_size = 1;
+	}
+
+	ANNidxArray the_pidx = new ANNidx[the_n_pts];
+												// create a skeletal tree
+	SkeletonTree(the_n_pts, dd, the_bkt_size, pa, the_pidx);
+
+	bnd_box_lo = annAllocPt(dd);				// read bounding box
+	bnd_box_hi = annAllocPt(dd);
+
+	if (!ok)
+		return;
+
+	in.read((char *) bnd_box_lo, sizeof(ANNcoord) * the_dim);
+	in.read((char *) bnd_box_hi, sizeof(ANNcoord) * the_dim);
+	in.read((char *) the_pidx, sizeof(ANNidx) * the_n_pts);
+
+	for (int d = 0; in && d < the_dim; d++) {
+		if (bnd_box_lo[d] > bnd_box_hi[d])
+			in.setstate(ios::failbit);			// inverted bounding box
+	}
+
+	if (in) {									// indices a permutation?
+		char *seen = new char[the_n_pts];
+		memset(seen, 0, the_n_pts);
+		for (int i = 0; in && i < the_n_pts; i++) {
+			if (the_pidx[i] < 0 || the_pidx[i] >= the_n_pts ||
+				seen[the_pidx[i]])
+				in.setstate(ios::failbit);		// bad point index
+			else
+				seen[the_pidx[i]] = 1;
+		}
+		delete [] seen;
+	}
+
+	int next_idx = 0;							// read the tree
+	if (in) {
+		root = annReadBinaryTree(in, the_dim, the_n_pts, the_pidx, 
+								 next_idx, 0);
+	}
+
+	if (!in || next_idx != the_n_pts) {			// didn't see all the points?
+		in.setstate(ios::failbit);
+		annDeleteBinaryTree(root);
+		root = NULL;
+		n_pts = 0;
+	}
+}
@@ -95,7 +95,8 @@ void ANNkd_tree::annkPriSearch(
 	int					k,				// number of near neighbors to return
 	ANNidxArray			nn_idx,			// nearest neighbor indices (returned)
 	ANNdistArray		dd,				// dist to near neighbors (returned)
-	double				eps)			// error bound (ignored)
+	double				eps,			// error bound (ignored)
+	int					maxPts)			// max pts to visit (-1 = global limit)
 {
 										// max tolerable squared error
 	ANNprTempStore store;
@@ -108,6 +109,8 @@ void ANNkd_tree::annkPriSearch(
 	store.ANNprQ = q;
 	store.ANNprPts = pts;
 	store.ANNptsVisited = 0;					// initialize count of points visited
+	if (maxPts < 0)						// use the global limit
+		maxPts = ANNmaxPtsVisited;
 
 	store.ANNprPointMK = new ANNmin_k(k);		// create set for closest k points
 	//printf("store.ANNprPointMK address: %p\n", store.ANNprPointMK); fflush(stdout); //debug
@@ -120,7 +123,7 @@ void ANNkd_tree::annkPriSearch(
 	store.ANNprBoxPQ->insert(box_dist, root); // insert root in priority queue
 
 	while (store.ANNprBoxPQ->non_empty() &&
-		(!(ANNmaxPtsVisited != 0 && store.ANNptsVisited > ANNmaxPtsVisited))) {
+		(!(maxPts != 0 && store.ANNptsVisited > maxPts))) {
 		ANNkd_ptr np;					// next box from prior queue
 
 										// extract closest box from queue
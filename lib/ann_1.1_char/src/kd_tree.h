@@ -62,6 +62,7 @@ public:
 												// print node
 	virtual void print(int level, ostream &out) = 0;
 	virtual void dump(ostream &out) = 0;		// dump node
+	virtual void dump_binary(ostream &out);		// dump node in binary
 
 	friend class ANNkd_tree;					// allow kd-tree to access us
 };
@@ -113,6 +114,7 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void dump_binary(ostream &out);		// dump node in binary
 
 	virtual void ann_search(ANNdist);			// standard search
 	virtual void ann_pri_search(ANNdist, ANNprTempStore&);		// priority search
@@ -179,6 +181,7 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void dump_binary(ostream &out);		// dump node in binary
 
 	virtual void ann_search(ANNdist);			// standard search
 	virtual void ann_pri_search(ANNdist, ANNprTempStore&);		// priority search
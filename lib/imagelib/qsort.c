@@ -46,11 +46,6 @@
 
 #include "qsort.h"
 
-typedef enum {
-    QSORT_ASCENDING,
-    QSORT_DESCENDING
-} qsort_order_t;
-
 static qsort_order_t qsort_order = QSORT_DESCENDING;
 
 /* Set whether we should sort in ascending or descending order */
@@ -64,24 +59,30 @@ void qsort_descending()
     qsort_order = QSORT_DESCENDING;
 }
 
-void qsort_perm_r(int n, double *arr, int *perm);
+static void qsort_perm_r(int n, double *arr, int *perm, 
+                         qsort_order_t order);
 
 /* Sorts the array of doubles `arr' (of length n) and puts the
  * corresponding permutation in `perm' */
 void qsort_perm(int n, double *arr, int *perm) {
+    qsort_perm_order(n, arr, perm, qsort_order);
+}
+
+void qsort_perm_order(int n, double *arr, int *perm, qsort_order_t order) {
     int i;
 
     /* Create the identity permutation */
     for (i = 0; i < n; i++) 
 	perm[i] = i;
     
-    qsort_perm_r(n, arr, perm);
+    qsort_perm_r(n, arr, perm, order);
 }
 
 #define SORT_ASCENDING
 /* #define SORT_DESCENDING */
 
-void qsort_perm_r(int n, double *arr, int *perm) {
+static void qsort_perm_r(int n, double *arr, int *perm, 
+                         qsort_order_t order) {
     int pivot_idx;
     double *r, *l;
     double pivot;
@@ -97,7 +98,7 @@ void qsort_perm_r(int n, double *arr, int *perm) {
     r = arr + (n - 1);
     
     while (l < r) {
-	if (qsort_order == QSORT_ASCENDING) {
+	if (order == QSORT_ASCENDING) {
 	    if (*l >= pivot && *r <= pivot) {
 		/* Swap */
 		int lidx = (int) (l - arr);
@@ -120,7 +121,7 @@ void qsort_perm_r(int n, double *arr, int *perm) {
 		printf("Execution should not reach this point\n");
                 return;
 	    }
-	} else if (qsort_order == QSORT_DESCENDING) {
+	} else if (order == QSORT_DESCENDING) {
 	    if (*l <= pivot && *r >= pivot) {
 		/* Swap */
 		int lidx = (int) (l - arr);
@@ -152,10 +153,11 @@ void qsort_perm_r(int n, double *arr, int *perm) {
     split = l;
 
     /* Sort the left subarray */
-    qsort_perm_r((int) (split - arr), arr, perm);
+    qsort_perm_r((int) (split - arr), arr, perm, order);
 
     /* Sort the right subarray */
-    qsort_perm_r(n - (int) (split - arr), split, perm + (split - arr));
+    qsort_perm_r(n - (int) (split - arr), split, perm + (split - arr), 
+                 order);
 }
 
 /* Find the median in a set of doubles */
@@ -41,6 +41,11 @@
 extern "C" {
 #endif
 
+typedef enum {
+    QSORT_ASCENDING,
+    QSORT_DESCENDING
+} qsort_order_t;
+
 /* Set whether we should sort in ascending or descending order */
 void qsort_ascending();
 void qsort_descending();
@@ -49,6 +54,10 @@ void qsort_descending();
  * corresponding permutation in `perm' */
 void qsort_perm(int n, double *arr, int *perm);
 
+/* Same as qsort_perm, but with the order given explicitly instead of
+ * by the global setting, so it is safe to call from several threads */
+void qsort_perm_order(int n, double *arr, int *perm, qsort_order_t order);
+
 /* Permute the array `arr' given permutation `perm' */
 void permute_dbl(int n, double *arr, int *perm);
 void permute(int n, int size, void *arr, int *perm);
@@ -12,41 +12,6 @@
 #include "keys2.h"
 #include "VocabTree.h"
 
-/* Read in a set of keys from a file 
- *
- * Inputs:
- *   keyfile      : file from which to read keys
- *   dim          : dimensionality of descriptors
- * 
- * Outputs:
- *   num_keys_out : number of keys read
- *
- * Return value   : pointer to array of descriptors.  The descriptors
- *                  are concatenated together in one big array of
- *                  length num_keys_out * dim 
- */
-unsigned char *ReadKeys(const char *keyfile, int dim, int &num_keys_out)
-{
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    for (int j = 0; j < num_keys * dim; j++) {
-        keys_char[j] = (unsigned char) keys[j];
-    }
-
-    delete [] keys;
-
-    if (info != NULL) 
-        delete [] info;
-
-    num_keys_out = num_keys;
-
-    return keys_char;
-}
-
 int main(int argc, char **argv) 
 {
     if (argc != 5 && argc != 6) {
@@ -85,7 +50,9 @@ int main(int argc, char **argv)
     tree.Read(tree_in);
 
     printf("[VocabCompare] Flattening tree...\n");
-    tree.Flatten();
+    /* Cache the search structure for the flattened tree next to
+     * the tree file */
+    tree.Flatten((std::string(tree_in) + ".ann").c_str());
 
     tree.m_distance_type = distance_type;
     tree.SetInteriorNodeWeight(0.0);
@@ -93,28 +60,28 @@ int main(int argc, char **argv)
     /* Initialize leaf weights to 1.0 */
     tree.SetConstantLeafWeights();
 
-    const int dim = 128;
-
     tree.ClearDatabase();
 
-    int num_keys_1 = 0, num_keys_2 = 0;
-    unsigned char *keys1 = ReadKeys(image1_in, dim, num_keys_1);
-    unsigned char *keys2 = ReadKeys(image2_in, dim, num_keys_2);
+    /* Both images are loaded into the same buffer in turn */
+    KeyBuffer keys;
+
+    int num_keys_1 = LoadKeyFile(image1_in, keys);
+    if (num_keys_1 < 0)
+        num_keys_1 = 0;
 
     unsigned long *ids1 = new unsigned long[num_keys_1];
-    unsigned long *ids2 = new unsigned long[num_keys_2];
 
     printf("[VocabCompare] Adding image 0 (%d keys)\n", num_keys_1);
-    tree.AddImageToDatabase(0, num_keys_1, keys1, ids1);
+    tree.AddImageToDatabase(0, num_keys_1, keys.m_keys, ids1);
 
-    printf("[VocabCompare] Adding image 1 (%d keys)\n", num_keys_2);
-    tree.AddImageToDatabase(1, num_keys_2, keys2, ids2);
+    int num_keys_2 = LoadKeyFile(image2_in, keys);
+    if (num_keys_2 < 0)
+        num_keys_2 = 0;
 
-    if (num_keys_1 > 0) 
-        delete [] keys1;
+    unsigned long *ids2 = new unsigned long[num_keys_2];
 
-    if (num_keys_2 > 0)
-        delete [] keys2;
+    printf("[VocabCompare] Adding image 1 (%d keys)\n", num_keys_2);
+    tree.AddImageToDatabase(1, num_keys_2, keys.m_keys, ids2);
 
     // tree.ComputeTFIDFWeights();
     tree.NormalizeDatabase(0, 2);
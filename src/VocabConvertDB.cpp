@@ -0,0 +1,44 @@
+/* VocabConvertDB.cpp */
+/* Driver for converting a database to the memory-mapped format */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "VocabTree.h"
+
+int main(int argc, char **argv) 
+{
+    if (argc != 3) {
+        printf("Usage: %s <db.in> <db.map.out>\n", argv[0]);
+        return 1;
+    }
+
+    char *db_in = argv[1];
+    char *db_out = argv[2];
+
+    printf("[VocabConvertDB] Reading database %s...\n", db_in);
+    fflush(stdout);
+
+    clock_t start = clock();
+    VocabTree tree;
+    if (tree.Read(db_in) != 0)
+        return 1;
+
+    clock_t end = clock();
+    printf("[VocabConvertDB] Read database in %0.3fs\n",
+           (double) (end - start) / CLOCKS_PER_SEC);
+
+    if (tree.FinalizeDatabase() != 0)
+        return 1;
+
+    printf("[VocabConvertDB] Writing mapped database %s...\n", db_out);
+    fflush(stdout);
+
+    if (tree.WriteMapped(db_out) != 0)
+        return 1;
+
+    tree.Clear();
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+/* VocabConvertKeys.cpp */
+/* Driver for converting the key files in a list to the binary key
+ * format, which is much faster to read than Lowe's text format */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "keys2.h"
+
+int main(int argc, char **argv) 
+{
+    if (argc != 3) {
+        printf("Usage: %s <list.in> <list.out>\n", argv[0]);
+        printf("  Writes <key_file>.bin for each key file in list.in, "
+               "and a list of\n  the binary key files to list.out\n");
+        return 1;
+    }
+
+    char *list_in = argv[1];
+    char *list_out = argv[2];
+
+    FILE *f = fopen(list_in, "r");
+    if (f == NULL) {
+        printf("[VocabConvertKeys] Could not open file: %s\n", list_in);
+        return 1;
+    }
+
+    std::vector<std::string> key_files;
+    char buf[256];
+    while (fgets(buf, 256, f)) {
+        /* Remove trailing newline */
+        if (buf[strlen(buf) - 1] == '\n')
+            buf[strlen(buf) - 1] = 0;
+
+        key_files.push_back(std::string(buf));
+    }
+
+    fclose(f);
+
+    int num_files = (int) key_files.size();
+    int num_failed = 0;
+
+    printf("[VocabConvertKeys] Converting %d key files...\n", num_files);
+    fflush(stdout);
+
+#pragma omp parallel for schedule(dynamic) reduction(+:num_failed)
+    for (int i = 0; i < num_files; i++) {
+        const char *key_file = key_files[i].c_str();
+        std::string bin_file = key_files[i] + ".bin";
+
+        unsigned char *keys = NULL;
+        keypt_t *info = NULL;
+        int num_keys = ReadKeyFileUChar(key_file, &keys, &info);
+
+        /* keys is only left NULL if the file could not be read */
+        if (keys == NULL || 
+            WriteBinaryKeyFileUChar(bin_file.c_str(), num_keys, 
+                                    keys, info) != num_keys) {
+            num_failed++;
+        }
+
+        delete [] keys;
+        delete [] info;
+    }
+
+    if (num_failed > 0) {
+        printf("[VocabConvertKeys] Error: %d key files could not be "
+               "converted\n", num_failed);
+        return 1;
+    }
+
+    f = fopen(list_out, "w");
+    if (f == NULL) {
+        printf("[VocabConvertKeys] Could not open file %s for writing\n",
+               list_out);
+        return 1;
+    }
+
+    for (int i = 0; i < num_files; i++)
+        fprintf(f, "%s.bin\n", key_files[i].c_str());
+
+    fclose(f);
+
+    return 0;
+}
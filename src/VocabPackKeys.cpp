@@ -0,0 +1,71 @@
+/* VocabPackKeys.cpp */
+/* Driver for packing the keys of a list of key files into a training
+ * file for VocabLearn */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "VocabTrainingSet.h"
+
+int main(int argc, char **argv) 
+{
+    if (argc < 3 || argc > 7) {
+        printf("Usage: %s <list.in> <train.out> [max_keys:0] "
+               "[max_keys_per_image:0] [min_feature_scale:0.0] "
+               "[seed:0]\n", argv[0]);
+        printf("  max_keys: if > 0, keep a uniform random sample of "
+               "this many keys\n");
+        printf("  max_keys_per_image: if > 0, keep at most this many "
+               "keys of each image\n");
+        printf("  min_feature_scale: drop keys with a smaller scale\n");
+        return 1;
+    }
+
+    char *list_in = argv[1];
+    char *train_out = argv[2];
+
+    VocabSampleOptions sample;
+    if (argc >= 4)
+        sample.max_keys = strtoul(argv[3], NULL, 10);
+    if (argc >= 5)
+        sample.max_keys_per_image = atoi(argv[4]);
+    if (argc >= 6)
+        sample.min_feature_scale = atof(argv[5]);
+    if (argc >= 7)
+        sample.seed = (unsigned int) atoi(argv[6]);
+
+    sample.num_threads = omp_get_max_threads();
+
+    FILE *f = fopen(list_in, "r");
+    if (f == NULL) {
+        printf("[VocabPackKeys] Could not open file: %s\n", list_in);
+        return 1;
+    }
+
+    std::vector<std::string> key_files;
+    char buf[256];
+    while (fgets(buf, 256, f)) {
+        /* Remove trailing newline */
+        if (buf[strlen(buf) - 1] == '\n')
+            buf[strlen(buf) - 1] = 0;
+
+        key_files.push_back(std::string(buf));
+    }
+
+    fclose(f);
+
+    printf("[VocabPackKeys] Packing %d key files into %s...\n",
+           (int) key_files.size(), train_out);
+    fflush(stdout);
+
+    if (WriteTrainingFile(train_out, key_files, sample) != 0)
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+/* VocabTestDistance.cpp */
+/* Driver for checking the distance kernels against the scalar code */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "VocabDistance.h"
+
+#define NUM_VECS 9
+#define MAX_BATCH 7
+
+/* Fill the test vectors: random ones, then the extremes (all 0, all
+ * 255, and alternating 0 and 255) */
+static void FillVectors(unsigned char **data, int dim, unsigned int &seed)
+{
+    for (int j = 0; j < NUM_VECS - 3; j++) {
+        for (int i = 0; i < dim; i++) {
+            seed = seed * 1103515245 + 12345;
+            data[j][i] = (unsigned char) (seed >> 16);
+        }
+    }
+
+    for (int i = 0; i < dim; i++) {
+        data[NUM_VECS - 3][i] = 0;
+        data[NUM_VECS - 2][i] = 255;
+        data[NUM_VECS - 1][i] = (i % 2 == 0) ? 0 : 255;
+    }
+}
+
+/* Compare a kernel against the scalar code on every pair of the test
+ * vectors, one at a time and in batches of every size up to
+ * MAX_BATCH.  Returns the number of mismatches */
+static int CheckKernel(const DistanceKernel &k, int dim,
+                       unsigned char **data)
+{
+    int errors = 0;
+
+    for (int q = 0; q < NUM_VECS; q++) {
+        for (int j = 0; j < NUM_VECS; j++) {
+            unsigned long ref = vec_diff_normsq_scalar(dim, data[q], data[j]);
+            unsigned long dist = k.m_single(dim, data[q], data[j]);
+
+            if (dist != ref) {
+                printf("[VocabTestDistance] Error: %s gives %lu instead "
+                       "of %lu (dim %d, vectors %d and %d)\n",
+                       k.m_name, dist, ref, dim, q, j);
+                errors++;
+            }
+        }
+
+        for (int n = 0; n <= MAX_BATCH; n++) {
+            const unsigned char *c[MAX_BATCH];
+            unsigned long dists[MAX_BATCH], dists_ref[MAX_BATCH];
+
+            for (int j = 0; j < n; j++)
+                c[j] = data[(q + j) % NUM_VECS];
+
+            k.m_batch(dim, data[q], n, c, dists);
+            vec_diff_normsq_batch_scalar(dim, data[q], n, c, dists_ref);
+
+            for (int j = 0; j < n; j++) {
+                if (dists[j] != dists_ref[j]) {
+                    printf("[VocabTestDistance] Error: batched %s gives "
+                           "%lu instead of %lu (dim %d, batch of %d)\n",
+                           k.m_name, dists[j], dists_ref[j], dim, n);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        printf("Usage: %s [rounds:10]\n", argv[0]);
+        return 1;
+    }
+
+    int rounds = 10;
+    if (argc == 2)
+        rounds = atoi(argv[1]);
+
+    /* Lengths around the vector widths, the usual SIFT length, and
+     * lengths at and past the largest the SIMD kernels handle */
+    static const int dims[] =
+        { 1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+          255, 256, 300, 1000, 65536, 65537 };
+    int num_dims = (int) (sizeof(dims) / sizeof(dims[0]));
+    int max_dim = dims[num_dims - 1];
+
+    DistanceKernel kernels[VOCAB_DISTANCE_MAX_KERNELS];
+    int num_kernels = vec_diff_normsq_kernels(kernels);
+
+    printf("[VocabTestDistance] Using the %s kernel\n",
+           vec_diff_normsq_kernel());
+
+    /* Each vector is stored one byte past an aligned block, so that
+     * the kernels see unaligned data */
+    unsigned char *buf = new unsigned char[NUM_VECS * (max_dim + 64)];
+    unsigned char *data[NUM_VECS];
+    for (int j = 0; j < NUM_VECS; j++)
+        data[j] = buf + j * (max_dim + 64) + 1;
+
+    unsigned int seed = 12345;
+    int errors = 0;
+
+    for (int i = 0; i < num_kernels; i++) {
+        int kernel_errors = 0;
+
+        for (int r = 0; r < rounds; r++) {
+            for (int d = 0; d < num_dims; d++) {
+                FillVectors(data, dims[d], seed);
+                kernel_errors += CheckKernel(kernels[i], dims[d], data);
+            }
+        }
+
+        printf("[VocabTestDistance] %s: %s\n", kernels[i].m_name,
+               kernel_errors == 0 ? "ok" : "MISMATCH");
+        errors += kernel_errors;
+    }
+
+    delete [] buf;
+
+    return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/* VocabTestKeys.cpp */
+/* Driver for checking the text key parser against the original
+ * scanf-based one, and timing both */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "keys2.h"
+
+/* Parse a key file with the reference parser */
+static int ReadReference(const char *filename, short int **keys,
+                         keypt_t **info)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        printf("[VocabTestKeys] Error opening file %s\n", filename);
+        return 0;
+    }
+
+    int num = ReadKeysReference(f, keys, info);
+    fclose(f);
+
+    return num;
+}
+
+/* Compare the keys of one file as read by both parsers.  The
+ * reference values are narrowed to 8 bits, as every caller of the
+ * parsers did.  Returns the number of differences */
+static int CompareKeys(const char *filename)
+{
+    short int *keys_ref = NULL, *keys = NULL;
+    keypt_t *info_ref = NULL, *info = NULL;
+
+    int num_ref = ReadReference(filename, &keys_ref, &info_ref);
+    int num = ReadKeyFile(filename, &keys, &info);
+
+    int errors = 0;
+    if (num != num_ref) {
+        printf("[VocabTestKeys] Error: %s has %d keys instead of %d\n",
+               filename, num, num_ref);
+        errors++;
+    } else {
+        for (int i = 0; i < num; i++) {
+            if (memcmp(info + i, info_ref + i, sizeof(keypt_t)) != 0) {
+                printf("[VocabTestKeys] Error: %s key %d is at (%f, %f) "
+                       "instead of (%f, %f)\n", filename, i,
+                       info[i].x, info[i].y, info_ref[i].x, info_ref[i].y);
+                errors++;
+            }
+
+            for (int j = 0; j < 128; j++) {
+                short int ref = (unsigned char) keys_ref[i * 128 + j];
+                if (keys[i * 128 + j] != ref) {
+                    printf("[VocabTestKeys] Error: %s key %d element %d is "
+                           "%d instead of %d\n", filename, i, j,
+                           keys[i * 128 + j], ref);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    if (num_ref > 0) {
+        delete [] keys_ref;
+        delete [] info_ref;
+    }
+
+    if (num > 0) {
+        delete [] keys;
+        delete [] info;
+    }
+
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        printf("Usage: %s <list.in> [rounds:5]\n", argv[0]);
+        printf("  list.in: key files in Lowe's text format\n");
+        return 1;
+    }
+
+    const char *list_in = argv[1];
+    int rounds = 5;
+    if (argc == 3)
+        rounds = atoi(argv[2]);
+
+    FILE *f = fopen(list_in, "r");
+    if (f == NULL) {
+        printf("[VocabTestKeys] Error opening file %s\n", list_in);
+        return 1;
+    }
+
+    /* Only plain text files can be read by the reference parser */
+    std::vector<std::string> key_files;
+    int num_skipped = 0;
+    char buf[1024];
+    while (fgets(buf, 1024, f)) {
+        char filename[1024];
+        if (sscanf(buf, "%s", filename) != 1)
+            continue;
+
+        FILE *key_file = fopen(filename, "rb");
+        char magic[8];
+        bool text = key_file != NULL &&
+            !(fread(magic, 1, 8, key_file) == 8 && 
+              memcmp(magic, BINARY_KEY_MAGIC, 8) == 0);
+
+        if (key_file != NULL)
+            fclose(key_file);
+
+        if (text)
+            key_files.push_back(filename);
+        else
+            num_skipped++;
+    }
+
+    fclose(f);
+
+    int num_files = (int) key_files.size();
+    int errors = 0;
+    for (int i = 0; i < num_files; i++)
+        errors += CompareKeys(key_files[i].c_str());
+
+    printf("[VocabTestKeys] Compared %d files (skipped %d not in text "
+           "format): %s\n", num_files, num_skipped,
+           errors == 0 ? "ok" : "MISMATCH");
+
+    /* Time both parsers over the whole list */
+    clock_t start = clock();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_files; i++) {
+            short int *keys;
+            keypt_t *info;
+            if (ReadReference(key_files[i].c_str(), &keys, &info) > 0) {
+                delete [] keys;
+                delete [] info;
+            }
+        }
+    }
+
+    clock_t end = clock();
+    double time_ref = (double) (end - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    KeyBuffer buffer;
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < num_files; i++)
+            LoadKeyFile(key_files[i].c_str(), buffer);
+    }
+
+    end = clock();
+    double time_new = (double) (end - start) / CLOCKS_PER_SEC;
+
+    printf("[VocabTestKeys] %d rounds: reference %0.3fs, "
+           "ReadKeys %0.3fs\n", rounds, time_ref, time_new);
+
+    return (errors == 0) ? 0 : 1;
+}